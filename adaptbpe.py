@@ -1,19 +1,37 @@
+import itertools
 import json
 import os
+import pickle
 import re
-from typing import Any, Dict, List, Literal, Optional, Union
+from typing import Any, Dict, Iterable, Iterator, List, Literal, Optional, Tuple, Union
 
 import torch
 from jinja2 import Template
 from torch import Tensor, tensor
 
 import bpe_module
-from bpe_module import BPE
+from bpe_module import BPE, BPEEngine, CachePolicy, DecodeStream, EncodeStream, WordSplit
 
 
 class AdaptBPETokenizer:
-    def __init__(self, model_path, special_character, token_replace_map=None, added_vocab=[]):
+    def __init__(
+        self,
+        model_path,
+        special_character,
+        token_replace_map=None,
+        added_vocab=[],
+        engine: BPEEngine = BPEEngine.PriorityQueue,
+        cache_capacity: int = 0,
+        cache_policy: CachePolicy = CachePolicy.LRU,
+        word_split: WordSplit = WordSplit.Auto,
+        compiled_model: Optional[str] = None,
+    ):
+        # compiled_model: file written by compile(); tokenizer.json and the
+        # added vocab are then not read at all (the file holds every table).
         self.model_path = model_path
+        self.compiled_model = compiled_model
+        self.shared_path = None
+        self.load_options = {"cache_capacity": cache_capacity, "cache_policy": cache_policy, "word_split": word_split}
         self.special_character = special_character
         self.tokens_replace_map = token_replace_map
         self.reverse_token_replace_map = {v: k for k, v in token_replace_map.items()} if token_replace_map else {}
@@ -24,7 +42,7 @@ class AdaptBPETokenizer:
 
         self.tokenizer_path = os.path.join(self.model_path, "tokenizer.json")
 
-        if not os.path.exists(self.tokenizer_path):
+        if compiled_model is None and not os.path.exists(self.tokenizer_path):
             raise RuntimeError(f"Tokenizer file not found at: {self.tokenizer_path}")
 
         self.added_tokens_path = os.path.join(self.model_path, "added_vocab.txt")
@@ -36,18 +54,20 @@ class AdaptBPETokenizer:
                 pass
 
         self.load_config()
-        self.load_tokenizer()
-        self.load_added_tokens()
-
-        self.add_special_tokens(added_vocab)
-
-        self.bpe_processor = BPE(
-            bpe_ranks=self.bpe_ranks,
-            vocab=self.vocab,
-            added_vocab=self.added_vocab,
+        if compiled_model is not None:
+            self.bpe_processor = BPE.load_compiled(compiled_model, **self.load_options)
+            return
+        # tokenizer.json, the config and the added vocab are parsed in C++;
+        # no Python dicts are built or converted
+        self.bpe_processor = BPE.from_pretrained(
+            self.model_path,
+            added_vocab=added_vocab,
             special_character=self.special_character,
-            token_replace_map=token_replace_map,
-            reverse_tokens_replace_map=self.reverse_token_replace_map,
+            token_replace_map=token_replace_map or {},
+            engine=engine,
+            cache_capacity=cache_capacity,
+            cache_policy=cache_policy,
+            word_split=word_split,
         )
 
     def __call__(
@@ -98,17 +118,176 @@ class AdaptBPETokenizer:
             return {"input_ids": input_ids, "attention_mask": attention_mask}
 
     def __len__(self):
-        return len(self.vocab)
+        return self.bpe_processor.vocab_size()
 
-    def decode(self, ids: Union[List[int], Tensor]) -> str:
+    def decode(self, ids: Union[List[int], Tensor], skip_special_tokens=False) -> str:
         if isinstance(ids, Tensor):
             ids = ids.tolist()
-        return self.bpe_processor.decode(tokens=ids)
+        return self.bpe_processor.decode(tokens=ids, skip_special_tokens=skip_special_tokens)
+
+    def decode_batch(
+        self,
+        sequences: Union[List[List[int]], Tensor, Any],
+        offsets: Optional[Any] = None,
+        skip_special_tokens=False,
+        num_threads: int = 0,
+    ) -> List[str]:
+        # Either a list of sequences, or a flat ID array plus offsets
+        if offsets is not None:
+            if isinstance(sequences, Tensor):
+                sequences = sequences.numpy()
+            if isinstance(offsets, Tensor):
+                offsets = offsets.numpy()
+            return self.bpe_processor.decode_batch(
+                sequences, offsets, skip_special_tokens=skip_special_tokens, num_threads=num_threads
+            )
+        if isinstance(sequences, Tensor):
+            sequences = sequences.tolist()
+        return self.bpe_processor.decode_batch(
+            sequences, skip_special_tokens=skip_special_tokens, num_threads=num_threads
+        )
 
-    def encode(self, text: str, tokenize=True, add_special_tokens=True) -> List[int]:
+    def decode_stream(
+        self,
+        skip_leading_space=False,
+        byte_fallback=False,
+        stop_strings: Optional[List[str]] = None,
+        stop_ids: Optional[List[int]] = None,
+    ) -> DecodeStream:
+        return DecodeStream(
+            self.bpe_processor,
+            skip_leading_space=skip_leading_space,
+            byte_fallback=byte_fallback,
+            stop_strings=stop_strings or [],
+            stop_ids=stop_ids or [],
+        )
+
+    def cache_info(self) -> Dict[str, Any]:
+        return self.bpe_processor.cache_info()
+
+    def memory_usage(self) -> Dict[str, int]:
+        # Bytes per model table, e.g. {"engine.symbols": ..., "decode.decoded": ...}
+        return self.bpe_processor.memory_usage()
+
+    def compile(self, path: str) -> None:
+        # Load it back with AdaptBPETokenizer(..., compiled_model=path);
+        # pickled copies of this tokenizer load it too.
+        self.bpe_processor.compile(path)
+        self.compiled_model = path
+
+    def share(self) -> str:
+        # Moves the model tables into one sealed shared-memory segment and
+        # returns a path other processes load it from (while this one is
+        # alive). Forked workers share it as is; pickled copies, e.g. for
+        # spawned DataLoader workers, attach to it instead of rebuilding, so
+        # they can only be unpickled while this process lives.
+        if self.shared_path is None:
+            fd = self.bpe_processor.share()
+            self.bpe_processor = BPE.attach(fd, **self.load_options)
+            self.shared_fd = fd  # kept open for the path below
+            self.shared_path = f"/proc/{os.getpid()}/fd/{fd}"
+        return self.shared_path
+
+    def __getstate__(self):
+        # Pickles a path to the compiled tables, never the tables themselves
+        model = self.compiled_model or self.shared_path
+        if model is None:
+            raise pickle.PicklingError(
+                "AdaptBPETokenizer needs a compiled model to pickle: call compile(path) "
+                "or share() first"
+            )
+        state = self.__dict__.copy()
+        state["compiled_model"] = model
+        state.pop("bpe_processor")
+        state.pop("shared_fd", None)
+        return state
+
+    def __setstate__(self, state):
+        self.__dict__.update(state)
+        self.bpe_processor = BPE.load_compiled(self.compiled_model, **self.load_options)
+
+    def encode(
+        self, text: str, tokenize=True, add_special_tokens=True, return_numpy=False, dtype: str = "int32"
+    ) -> List[int]:
+        # dtype="uint16" (with return_numpy) halves the IDs' size; it raises
+        # unless the vocab fits, see bpe_processor.fits_uint16()
+        if add_special_tokens:
+            text = f"{self.bos_token}{text}"
+        return self.bpe_processor.encode(text, tokenize=tokenize, return_numpy=return_numpy, dtype=dtype)
+
+    def encode_into(self, text: str, out: Union[Tensor, Any], truncate=False, add_special_tokens=True) -> int:
+        # out: a writable 1-D int32 or uint16 NumPy array or CPU tensor (torch
+        # has uint16 from 2.3); it is filled in place with no new allocations.
+        # Returns the number of IDs written; raises ValueError when they do
+        # not fit, unless truncate=True.
         if add_special_tokens:
             text = f"{self.bos_token}{text}"
-        return self.bpe_processor.encode(text, tokenize=tokenize)
+        if isinstance(out, Tensor):
+            out = out.numpy()  # shares the tensor's memory
+        return self.bpe_processor.encode_into(text, out, truncate=truncate)
+
+    def encode_batch(
+        self,
+        texts: List[str],
+        num_threads: int = 0,
+        alpha: float = 0.0,
+        add_special_tokens=True,
+        return_numpy=False,
+        dtype: str = "int32",
+    ) -> Union[List[List[int]], Tuple[Any, Any]]:
+        # With return_numpy, (ids, offsets) NumPy arrays: texts[i] -> ids[offsets[i] : offsets[i + 1]]
+        if add_special_tokens:
+            texts = [f"{self.bos_token}{text}" for text in texts]
+        return self.bpe_processor.encode_batch(
+            texts, num_threads=num_threads, alpha=alpha, return_numpy=return_numpy, dtype=dtype
+        )
+
+    def encode_jsonl(
+        self,
+        source: Union[str, bytes],
+        fields: List[str] = ["text"],
+        separator: str = "\n",
+        num_threads: int = 0,
+        add_special_tokens=True,
+        return_numpy=False,
+        dtype: str = "int32",
+    ) -> Union[List[List[int]], Tuple[Any, Any]]:
+        # source: a JSONL file path or its bytes. Each record's fields (in the
+        # order given, joined by separator) are extracted and encoded natively.
+        if isinstance(source, str):
+            with open(source, "rb") as f:
+                source = f.read()
+        return self.bpe_processor.encode_jsonl(
+            source,
+            fields=fields,
+            separator=separator,
+            prefix=self.bos_token if add_special_tokens else "",
+            num_threads=num_threads,
+            return_numpy=return_numpy,
+            dtype=dtype,
+        )
+
+    def encode_stream(self) -> EncodeStream:
+        # Feed chunks with step(); the IDs of all steps plus finish() equal
+        # encode() of the whole text (without add_special_tokens)
+        return EncodeStream(self.bpe_processor)
+
+    def encode_iter(self, chunks: Iterable[Union[str, bytes]], add_special_tokens=True) -> Iterator[List[int]]:
+        # Token IDs of a text given as chunks (e.g. an open file), in bounded memory
+        stream = self.encode_stream()
+        if add_special_tokens:
+            chunks = itertools.chain([self.bos_token], chunks)
+        for chunk in chunks:
+            ids = stream.step(chunk)
+            if ids:
+                yield ids
+        ids = stream.finish()
+        if ids:
+            yield ids
+
+    def encode_file(self, path: str, chunk_size: int = 1 << 20, add_special_tokens=True) -> Iterator[List[int]]:
+        with open(path, "rb") as f:
+            yield from self.encode_iter(iter(lambda: f.read(chunk_size), b""), add_special_tokens=add_special_tokens)
 
     def apply_chat_template(
         self,
@@ -139,59 +318,18 @@ class AdaptBPETokenizer:
         except Exception as e:
             raise ValueError(f"Failed to render chat template: {str(e)}")
 
-    def add_special_tokens(self, added_vocab=[]):
-        for token in self.special_tokens:
-            self.vocab[token] = self.special_tokens[token]
-            self.added_vocab.append(token)
-        self.added_vocab.extend(added_vocab)
-
-        for k, v in self.tokens_replace_map.items():
-            self.added_vocab.append(v)
-
     def __repr__(self):
         return (
             f"AdaptBPETokenizer(\n\tmodel_path= {self.model_path},\n\t"
             f"special_character= {self.special_character},\n\t"
-            f"added_tokens_count= {len(self.added_vocab)},\n\t"
-            f"vocab_size= {len(self.vocab)},\n\t"
-            f"bpe_ranks_count= {len(self.bpe_ranks)},\n\t"
+            f"added_tokens_count= {self.bpe_processor.added_vocab_size()},\n\t"
+            f"vocab_size= {len(self)},\n\t"
+            f"bpe_ranks_count= {self.bpe_processor.merge_count()},\n\t"
+            f"compiled_model= {self.compiled_model},\n\t"
             f"added_tokens_path= {self.added_tokens_path},\n\t"
             f"tokenizer_path= {self.tokenizer_path}\n)"
         )
 
-    def load_added_tokens(self):
-        self.added_vocab = []
-        if not os.path.exists(self.added_tokens_path):
-            return
-
-        with open(self.added_tokens_path, "r") as f:
-            self.added_vocab = [line.strip() for line in f if line.strip()]
-
-    def load_tokenizer(self):
-        with open(self.tokenizer_path, "r") as f:
-            tokenizer = json.load(f)
-
-        added_tokens: List[Dict[str, Any]] = tokenizer.get("added_tokens", [])
-        for added_token in added_tokens:
-            if added_token.get("special", False):
-                self.special_tokens[added_token["content"]] = int(added_token["id"])
-            else:
-                self.vocab[added_token["content"]] = int(added_token["id"])
-
-        vocab = tokenizer["model"]["vocab"]
-        for k, v in vocab.items():
-            self.vocab[k] = int(v)
-
-        self.bpe_ranks = {}
-        merges: Union[List[str], List[List[str]]] = tokenizer["model"]["merges"]
-        for i, merge in enumerate(merges):
-            if isinstance(merge, list):
-                self.bpe_ranks[tuple(merge)] = i
-            else:
-                self.bpe_ranks[tuple(merge.split(" "))] = i
-
-        # print(self.bpe_ranks)
-
     def load_config(self):
         with open(self.config_path, "r") as f:
             config: Dict[str, Any] = json.load(f)
@@ -10,20 +10,58 @@
 #include <set>
 #include <algorithm>
 #include <limits>
+#include <cstring>
+#include <cctype>
 #include <unordered_map>
 #include <queue>
 #include <functional>
+#include <memory>
 #include <random>
 #include <stdexcept>
 #include <locale>  // Potentially for std::locale fix (if needed)
 #include <codecvt> // Potentially for std::wstring_convert (if needed)
+#include <cstddef>
+#include <cerrno>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "json.hpp"
 #include "inja.hpp"
 
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define BPE_X86_SIMD
+#endif
+
 ///////////////////////////////////////////////////////////////////////////////
 //                               UTF-8 Helpers                               //
 ///////////////////////////////////////////////////////////////////////////////
 
+/**
+ * Length of the UTF-8 sequence announced by lead byte `lead` (1 for ASCII and
+ * for bytes that cannot start a sequence).
+ */
+static size_t utf8_char_length(char lead)
+{
+    unsigned char c = static_cast<unsigned char>(lead);
+    if ((c & 0xF8) == 0xF0)
+    { // 4-byte UTF-8
+        return 4;
+    }
+    else if ((c & 0xF0) == 0xE0)
+    { // 3-byte UTF-8
+        return 3;
+    }
+    else if ((c & 0xE0) == 0xC0)
+    { // 2-byte UTF-8
+        return 2;
+    }
+    // 1-byte ASCII
+    return 1;
+}
+
 /**
  * Convert a UTF-8 string into a vector of complete UTF-8 characters (codepoints).
  * Each element is a substring containing exactly one UTF-8 character.
@@ -35,24 +73,7 @@ static std::vector<std::string> utf8_to_chars(const std::string &input)
 
     for (size_t i = 0; i < input.size();)
     {
-        unsigned char c = static_cast<unsigned char>(input[i]);
-        int len;
-        if ((c & 0xF8) == 0xF0)
-        { // 4-byte UTF-8
-            len = 4;
-        }
-        else if ((c & 0xF0) == 0xE0)
-        { // 3-byte UTF-8
-            len = 3;
-        }
-        else if ((c & 0xE0) == 0xC0)
-        { // 2-byte UTF-8
-            len = 2;
-        }
-        else
-        { // 1-byte ASCII
-            len = 1;
-        }
+        size_t len = utf8_char_length(input[i]);
 
         // Bounds check (avoid going past end):
         if (i + len > input.size())
@@ -90,679 +111,3645 @@ static std::string replace_spaces_with_underline(const std::string &input, const
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-//                          Added Vocab (FastList)                           //
+//                               Flat tables                                 //
 ///////////////////////////////////////////////////////////////////////////////
 
-struct Node
+// FNV-1a: fixed across builds, so slot layouts in compiled models stay valid.
+static uint64_t fnv1a(std::string_view key)
 {
-    std::string value;
-    Node *prev;
-    Node *next;
-    explicit Node(const std::string &val) : value(val), prev(nullptr), next(nullptr) {}
-};
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (unsigned char c : key)
+    {
+        hash = (hash ^ c) * 0x100000001b3ULL;
+    }
+    return hash;
+}
 
-class FastList
+// Smallest power of two that keeps `count` entries at most half full.
+static size_t table_capacity(size_t count)
 {
-public:
-    FastList() : head(nullptr), tail(nullptr) {}
-    ~FastList() { clear(); }
+    size_t capacity = 2;
+    while (capacity < count * 2)
+    {
+        capacity <<= 1;
+    }
+    return capacity;
+}
 
-    void append(const std::string &value)
+StringTable::StringTable(const std::vector<std::string> &strings)
+{
+    size_t total = 0;
+    for (auto &s : strings)
     {
-        Node *new_node = new Node(value);
-        if (!head)
-        {
-            head = tail = new_node;
-        }
-        else
-        {
-            tail->next = new_node;
-            new_node->prev = tail;
-            tail = new_node;
-        }
+        total += s.size();
+    }
+    if (total > std::numeric_limits<uint32_t>::max())
+    {
+        throw std::length_error("StringTable: more than 4 GiB of string data");
+    }
+    std::vector<char> chars;
+    std::vector<uint32_t> offsets;
+    chars.reserve(total);
+    offsets.reserve(strings.size() + 1);
+    offsets.push_back(0);
+    for (auto &s : strings)
+    {
+        chars.insert(chars.end(), s.begin(), s.end());
+        offsets.push_back((uint32_t)chars.size());
     }
+    m_chars = std::move(chars);
+    m_offsets = std::move(offsets);
+}
 
-    std::vector<std::string> to_vector() const
+SymbolTable::SymbolTable(const std::vector<std::pair<std::string, int>> &entries)
+{
+    int num_ids = 0;
+    for (auto &entry : entries)
     {
-        std::vector<std::string> result;
-        for (Node *cur = head; cur != nullptr; cur = cur->next)
+        if (entry.second < 0)
         {
-            result.push_back(cur->value);
+            throw std::invalid_argument("Negative ID for piece '" + entry.first + "'");
         }
-        return result;
+        num_ids = std::max(num_ids, entry.second + 1);
     }
 
-    // Merges occurrences of word_list (already split into UTF-8 chars)
-    // into single nodes.  If word_list == {"c","h","o","l","e","r","a"},
-    // then whenever we see consecutive nodes c->h->o->l->...->a, we replace
-    // them with a single node "cholera".
-    void search_and_replace(const std::vector<std::string> &word_list)
+    // The last entry of each ID is stored densely, the others are aliases
+    std::vector<int> dense_entry(num_ids, -1);
+    for (size_t e = 0; e < entries.size(); e++)
+    {
+        dense_entry[entries[e].second] = (int)e;
+    }
+    std::vector<std::string> pieces(num_ids);
+    std::vector<int32_t> alias_ids;
+    std::vector<int> table_entry(entries.size());
+    for (size_t e = 0; e < entries.size(); e++)
     {
-        if (word_list.size() < 2)
+        const int id = entries[e].second;
+        if (dense_entry[id] == (int)e)
         {
-            // For single-character or empty, we skip merges
-            return;
+            pieces[id] = entries[e].first;
+            table_entry[e] = id;
         }
-        Node *current = head;
-        const int word_len = static_cast<int>(word_list.size());
-
-        while (current)
+        else
         {
-            Node *match_node = current;
-            int i = 0;
-            while (match_node && i < word_len && match_node->value == word_list[i])
-            {
-                match_node = match_node->next;
-                ++i;
-            }
-            if (i == word_len)
-            {
-                // Full match found: replace [current, match_node) with single node
-                replace_sequence(current, match_node, word_list);
-                if (!current->prev)
-                {
-                    // replaced at head
-                    current = head;
-                }
-                else
-                {
-                    // replaced in the middle
-                    current = current->prev->next;
-                }
-                if (current)
-                {
-                    current = current->next;
-                }
-            }
-            else
-            {
-                current = current->next;
-            }
+            table_entry[e] = (int)(num_ids + alias_ids.size());
+            alias_ids.push_back(id);
         }
     }
-
-private:
-    Node *head;
-    Node *tail;
-
-    void clear()
+    for (size_t e = 0; e < entries.size(); e++)
     {
-        Node *cur = head;
-        while (cur)
+        if (table_entry[e] >= num_ids)
         {
-            Node *tmp = cur;
-            cur = cur->next;
-            delete tmp;
+            pieces.push_back(entries[e].first);
         }
-        head = tail = nullptr;
     }
 
-    void replace_sequence(Node *start_node, Node *end_node,
-                          const std::vector<std::string> &word_list)
+    std::vector<uint32_t> slots(table_capacity(entries.size()), 0);
+    const size_t mask = slots.size() - 1;
+    for (size_t e = 0; e < entries.size(); e++)
     {
-        // Join word_list into one string
-        std::string merged;
-        merged.reserve(8 * word_list.size()); // heuristic
-        for (auto &piece : word_list)
+        size_t i = fnv1a(entries[e].first) & mask;
+        while (slots[i] != 0)
         {
-            merged += piece;
+            i = (i + 1) & mask;
         }
+        slots[i] = (uint32_t)(table_entry[e] + 1);
+    }
 
-        Node *new_node = new Node(merged);
-
-        Node *prev_node = start_node->prev;
-        Node *next_node = end_node; // end_node is NOT included in the match
+    m_pieces = StringTable(pieces);
+    m_alias_ids = std::move(alias_ids);
+    m_slots = std::move(slots);
+}
 
-        // Link in new_node
-        if (prev_node)
+int SymbolTable::find_entry(std::string_view piece) const
+{
+    if (m_slots.empty())
+    {
+        return -1;
+    }
+    const size_t mask = m_slots.size() - 1;
+    for (size_t i = fnv1a(piece) & mask;; i = (i + 1) & mask)
+    {
+        const uint32_t slot = m_slots[i];
+        if (slot == 0)
         {
-            prev_node->next = new_node;
-            new_node->prev = prev_node;
+            return -1;
         }
-        else
+        if (m_pieces[slot - 1] == piece)
         {
-            head = new_node;
+            return (int)(slot - 1);
         }
-        if (next_node)
+    }
+}
+
+size_t SymbolTable::memory_usage() const
+{
+    return m_pieces.memory_usage() + m_alias_ids.memory_usage() + m_slots.memory_usage();
+}
+
+template <typename V>
+PairMap<V>::PairMap(const std::vector<Slot> &entries)
+    : m_size(entries.size())
+{
+    // Zeroed first so that padding bytes are the same in every compiled file
+    std::vector<Slot> slots(table_capacity(entries.size()));
+    std::memset(static_cast<void *>(slots.data()), 0, slots.size() * sizeof(Slot));
+    for (auto &slot : slots)
+    {
+        slot.key = kEmpty;
+    }
+    const size_t mask = slots.size() - 1;
+    for (auto &entry : entries)
+    {
+        size_t i = hash(entry.key) & mask;
+        while (slots[i].key != kEmpty)
         {
-            next_node->prev = new_node;
-            new_node->next = next_node;
+            i = (i + 1) & mask;
         }
-        else
+        slots[i].key = entry.key;
+        slots[i].value = entry.value;
+    }
+    m_slots = std::move(slots);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                     Normalizer (fused single pass)                        //
+///////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Applies token_replace_map the way encode always has: one key at a time in
+ * map order, each replacing all of its non-overlapping occurrences.
+ */
+static void apply_token_replace_map(std::string &text,
+                                    const std::map<std::string, std::string> &token_replace_map)
+{
+    for (const auto &[original, replacement] : token_replace_map)
+    {
+        size_t pos = 0;
+        while ((pos = text.find(original, pos)) != std::string::npos)
         {
-            tail = new_node;
+            text.replace(pos, original.length(), replacement);
+            pos += replacement.length();
         }
+    }
+}
 
-        // Free replaced nodes
-        Node *cur = start_node;
-        while (cur != end_node)
+// True if `text` is a sequence of complete UTF-8 sequences (lead byte
+// followed by the right number of continuation bytes).
+static bool is_structurally_valid_utf8(const std::string &text)
+{
+    for (size_t i = 0; i < text.size();)
+    {
+        const unsigned char c = static_cast<unsigned char>(text[i]);
+        const size_t len = utf8_char_length(text[i]);
+        if ((c >= 0x80 && len == 1) || i + len > text.size())
+        {
+            return false;
+        }
+        for (size_t k = 1; k < len; k++)
         {
-            Node *tmp = cur;
-            cur = cur->next;
-            delete tmp;
+            if ((static_cast<unsigned char>(text[i + k]) & 0xC0) != 0x80)
+            {
+                return false;
+            }
         }
+        i += len;
     }
-};
+    return true;
+}
 
 /**
- * Merges each string in added_vocab (split into chars) into the token_list
- * in a greedy fashion.
+ * Appends the end offset (plus `base`) of every UTF-8 char of `text` to
+ * `ends`, splitting exactly like utf8_to_chars.
  */
-static std::vector<std::string> merge_added_vocab(
-    const std::vector<std::string> &token_list,
-    const std::vector<std::string> &added_vocab)
+static void utf8_char_ends(const std::string &text, uint32_t base, std::vector<uint32_t> &ends)
 {
-    if (added_vocab.empty())
+    for (size_t i = 0; i < text.size();)
     {
-        return token_list;
+        size_t len = utf8_char_length(text[i]);
+        if (i + len > text.size())
+        {
+            len = 1; // fallback to 1 if truncated
+        }
+        i += len;
+        ends.push_back(base + (uint32_t)i);
     }
+}
 
-    // Sort descending by length => so the longest added vocab merges first
-    std::vector<std::string> vocab_copy = added_vocab;
-    std::sort(vocab_copy.begin(), vocab_copy.end(),
-              [](const std::string &a, const std::string &b)
-              {
-                  return a.size() > b.size();
-              });
+// Length of the leading run of `data` that the normalizer copies through
+// unchanged: ASCII bytes without a replacement. Byte b has a replacement iff
+// lo[b & 15] & hi[b >> 4] is nonzero (hi has one bit per ASCII high nibble).
+using PlainAsciiScan = size_t (*)(const char *data, size_t size,
+                                  const uint8_t *lo, const uint8_t *hi);
 
-    // Build a FastList from token_list
-    FastList fl;
-    for (auto &token : token_list)
+static size_t plain_ascii_prefix_scalar(const char *data, size_t size,
+                                        const uint8_t *lo, const uint8_t *hi)
+{
+    size_t i = 0;
+    while (i < size)
     {
-        fl.append(token);
+        const unsigned char c = static_cast<unsigned char>(data[i]);
+        if (c >= 0x80 || (lo[c & 15] & hi[c >> 4]))
+        {
+            break;
+        }
+        i++;
     }
+    return i;
+}
 
-    // For each added_vocab word, convert to UTF-8 chars & search+replace
-    for (auto &v_word : vocab_copy)
+#ifdef BPE_X86_SIMD
+// The nibble lookups are one pshufb each, so any set of trigger bytes costs
+// the same two shuffles per block; non-ASCII bytes show up in movemask.
+__attribute__((target("sse4.2")))
+static size_t plain_ascii_prefix_sse42(const char *data, size_t size,
+                                       const uint8_t *lo, const uint8_t *hi)
+{
+    const __m128i lo_table = _mm_loadu_si128(reinterpret_cast<const __m128i *>(lo));
+    const __m128i hi_table = _mm_loadu_si128(reinterpret_cast<const __m128i *>(hi));
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16)
     {
-        std::vector<std::string> chars = utf8_to_chars(v_word);
-        fl.search_and_replace(chars);
+        const __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+        const __m128i trigger = _mm_and_si128(
+            _mm_shuffle_epi8(lo_table, _mm_and_si128(block, nibble)),
+            _mm_shuffle_epi8(hi_table, _mm_and_si128(_mm_srli_epi16(block, 4), nibble)));
+        const unsigned plain = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(trigger, _mm_setzero_si128()));
+        const unsigned stop = ((unsigned)_mm_movemask_epi8(block) | ~plain) & 0xFFFFu;
+        if (stop)
+        {
+            return i + __builtin_ctz(stop);
+        }
     }
-
-    return fl.to_vector();
+    return i + plain_ascii_prefix_scalar(data + i, size - i, lo, hi);
 }
 
-///////////////////////////////////////////////////////////////////////////////
-//                   Faster BPE (SentencePiece-style merges)                 //
-///////////////////////////////////////////////////////////////////////////////
-
-/**
- * A small function to detect if a piece ID is "unused" (out-of-vocab)
- * so that we can do resegmentation. Here, we do a trivial check:
- *    if (0 <= id < vocab_size) => it's "used"
- *    else => "unused"
- */
-static bool is_unused_inlined(int id, int vocab_size)
+__attribute__((target("avx2")))
+static size_t plain_ascii_prefix_avx2(const char *data, size_t size,
+                                      const uint8_t *lo, const uint8_t *hi)
 {
-    return (id < 0 || id >= vocab_size);
+    // vpshufb looks up within each 128-bit lane, so both lanes hold the table
+    const __m256i lo_table = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(lo)));
+    const __m256i hi_table = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(hi)));
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32)
+    {
+        const __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+        const __m256i trigger = _mm256_and_si256(
+            _mm256_shuffle_epi8(lo_table, _mm256_and_si256(block, nibble)),
+            _mm256_shuffle_epi8(hi_table, _mm256_and_si256(_mm256_srli_epi16(block, 4), nibble)));
+        const uint32_t plain = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(trigger, _mm256_setzero_si256()));
+        const uint32_t stop = (uint32_t)_mm256_movemask_epi8(block) | ~plain;
+        if (stop)
+        {
+            return i + __builtin_ctz(stop);
+        }
+    }
+    return i + plain_ascii_prefix_sse42(data + i, size - i, lo, hi);
 }
+#endif
 
-/**
- * The FasterBPE class is a priority-queue-based BPE engine.
- * It is used by the BPE class to perform the actual BPE merges.
- */
-FasterBPE::FasterBPE(const std::map<std::pair<std::string, std::string>, int> &bpe_ranks,
-                     const std::map<std::string, int> &vocab)
+static PlainAsciiScan select_plain_ascii_scan()
 {
-    // We want a quick lookup from "left+right" => rank
-    // Also store vocab size for "unused" checks
-    m_vocab_size = (int)vocab.size();
-
-    for (auto &kv : bpe_ranks)
+#ifdef BPE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
     {
-        const auto &p = kv.first; // (left, right)
-        int rank = kv.second;
-        // key = left+right
-        std::string concat = p.first + p.second;
-        m_pieces[concat] = rank;
+        return plain_ascii_prefix_avx2;
     }
-
-    // For a quick piece->ID mapping
-    for (auto &kv : vocab)
+    if (__builtin_cpu_supports("sse4.2"))
     {
-        m_str2id[kv.first] = kv.second;
+        return plain_ascii_prefix_sse42;
     }
+#endif
+    return plain_ascii_prefix_scalar;
 }
 
 /**
- * Takes a sequence of tokenized codepoints (after added_vocab merges)
- * and does the SentencePiece-style priority-queue BPE merges.
- *
- * - alpha is the BPE-dropout probability (0.0 => no dropout).
- * - Returns the final subword tokens (UTF-8).
+ * Precomputes, for every codepoint the three-pass pipeline can change (the
+ * space and each key of token_replace_map), what that pipeline turns it
+ * into. This is exact when every key is a single codepoint and all strings
+ * involved are valid UTF-8: a key can then never match across codepoints,
+ * so each input codepoint is rewritten independently of its neighbours.
  */
-std::vector<std::string> FasterBPE::run_faster_bpe(const std::vector<std::string> &tokens,
-                                                   float alpha) const
+Normalizer::Normalizer(const std::string &special_character,
+                       const std::map<std::string, std::string> &token_replace_map)
+    : m_special_character(special_character),
+      m_token_replace_map(token_replace_map),
+      m_fused(true),
+      m_max_expansion(1)
 {
-    if (tokens.empty())
+    m_ascii.fill(-1);
+    m_trigger_lo.fill(0);
+    m_trigger_hi.fill(0);
+    for (int nibble = 0; nibble < 8; nibble++)
     {
-        return {};
+        m_trigger_hi[nibble] = (uint8_t)(1u << nibble);
     }
 
-    // We define some internal data structures:
-    struct Symbol
+    bool valid = is_structurally_valid_utf8(special_character);
+    for (const auto &[original, replacement] : token_replace_map)
     {
-        int prev;
-        int next;
-        bool freeze;
-        std::string piece;
-    };
-
-    struct SymbolPair
+        valid = valid && is_structurally_valid_utf8(replacement) &&
+                !original.empty() && is_structurally_valid_utf8(original) &&
+                utf8_char_length(original[0]) == original.size();
+    }
+    if (!valid)
     {
-        int left;    // index in "symbols"
-        int right;   // index in "symbols"
-        float score; // bigger => higher priority
-        size_t size; // total length of merged piece
-    };
+        m_fused = false;
+        return;
+    }
 
-    // For the priority queue:
-    struct SymbolPairComparator
+    std::vector<std::string> triggers = {" "};
+    for (const auto &kv : token_replace_map)
     {
-        bool operator()(const SymbolPair *a, const SymbolPair *b) const
+        triggers.push_back(kv.first);
+    }
+    for (const std::string &ch : triggers)
+    {
+        std::string out = (ch == " ") ? special_character : ch;
+        apply_token_replace_map(out, token_replace_map);
+        if (out == ch)
         {
-            // higher score => pop first
-            if (a->score < b->score)
-                return true;
-            if (a->score > b->score)
-                return false;
-            // tie-break: smaller left index => higher priority
-            return (a->left > b->left);
+            continue;
         }
-    };
+        const int index = (int)m_replacements.size();
+        Replacement replacement;
+        utf8_char_ends(out, 0, replacement.ends);
+        replacement.bytes = std::move(out);
+        m_max_expansion = std::max(m_max_expansion, replacement.bytes.size());
+        m_replacements.push_back(std::move(replacement));
+        if (ch.size() == 1)
+        {
+            const unsigned char c = static_cast<unsigned char>(ch[0]);
+            m_ascii[c] = index;
+            m_trigger_lo[c & 15] |= m_trigger_hi[c >> 4];
+        }
+        else
+        {
+            m_multibyte[pack_utf8(ch.data(), ch.size())] = index;
+        }
+    }
+}
 
-    // We also store "rev_merge" so we can resegment out-of-vocab pieces.
-    std::unordered_map<std::string, std::pair<std::string, std::string>> rev_merge;
+uint32_t Normalizer::pack_utf8(const char *bytes, size_t len)
+{
+    uint32_t key = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        key = (key << 8) | static_cast<unsigned char>(bytes[i]);
+    }
+    return key;
+}
 
-    // A quick function to retrieve a "score" from a rank => -rank
-    auto get_score = [&](int rank)
+void Normalizer::emit(const Replacement &replacement, SymbolStream &out) const
+{
+    const uint32_t base = (uint32_t)out.bytes.size();
+    out.bytes += replacement.bytes;
+    for (uint32_t end : replacement.ends)
     {
-        // Lower rank => bigger score
-        return (float)(-rank);
-    };
+        out.offsets.push_back(base + end);
+    }
+}
 
-    // A function to get the ID of a piece. -1 if not in m_str2id.
-    auto piece_to_id = [&](const std::string &piece)
+/**
+ * Replaces spaces with the special character, applies token_replace_map and
+ * splits the result into UTF-8 chars, in a single pass over `text`. Runs of
+ * ASCII without replacements are found with SSE4.2/AVX2 where available and
+ * copied in bulk. Input that is not valid UTF-8 goes through the original
+ * three passes instead.
+ */
+void Normalizer::normalize(const std::string &text, SymbolStream &out) const
+{
+    static const PlainAsciiScan plain_ascii_prefix = select_plain_ascii_scan();
+
+    out.clear();
+    if (text.size() > std::numeric_limits<uint32_t>::max() / m_max_expansion)
+    {
+        throw std::length_error("Text is too long to encode in one call");
+    }
+    if (!m_fused)
+    {
+        normalize_slow(text, out);
+        return;
+    }
+    out.bytes.reserve(text.size());
+    out.offsets.reserve(text.size() + 1);
+
+    const char *data = text.data();
+    for (size_t i = 0; i < text.size();)
     {
-        auto it = m_str2id.find(piece);
-        if (it == m_str2id.end())
+        const size_t run = plain_ascii_prefix(data + i, text.size() - i,
+                                              m_trigger_lo.data(), m_trigger_hi.data());
+        if (run > 0)
         {
-            return -1;
+            const uint32_t base = (uint32_t)out.bytes.size();
+            out.bytes.append(data + i, run);
+            const size_t first = out.offsets.size();
+            out.offsets.resize(first + run);
+            uint32_t *ends = out.offsets.data() + first;
+            for (size_t k = 0; k < run; k++)
+            {
+                ends[k] = base + (uint32_t)k + 1;
+            }
+            i += run;
+            if (i == text.size())
+            {
+                break;
+            }
         }
-        return it->second;
-    };
 
-    // We want to maybe add a pair (left,right) if "left+right" is in merges
-    auto MaybeAddNewSymbolPair = [&](int left_idx, int right_idx,
-                                     auto &symbols, auto &agenda,
-                                     auto &symbol_pair_alloc)
-    {
-        if (left_idx < 0 || right_idx < 0)
+        const unsigned char c = static_cast<unsigned char>(data[i]);
+        if (c < 0x80)
         {
-            return;
+            emit(m_replacements[m_ascii[c]], out);
+            i++;
+            continue;
         }
-        if (symbols[left_idx].freeze || symbols[right_idx].freeze)
+
+        const size_t len = utf8_char_length(data[i]);
+        bool valid = len > 1 && i + len <= text.size();
+        for (size_t k = 1; valid && k < len; k++)
         {
-            return;
+            valid = (static_cast<unsigned char>(data[i + k]) & 0xC0) == 0x80;
         }
-        const std::string &left_piece = symbols[left_idx].piece;
-        const std::string &right_piece = symbols[right_idx].piece;
-        if (left_piece.empty() || right_piece.empty())
+        if (!valid)
         {
+            out.clear();
+            normalize_slow(text, out);
             return;
         }
-        std::string merged = left_piece + right_piece;
-        auto it = m_pieces.find(merged);
-        if (it == m_pieces.end())
+        auto it = m_multibyte.empty() ? m_multibyte.end() : m_multibyte.find(pack_utf8(data + i, len));
+        if (it != m_multibyte.end())
         {
-            return; // not a known pair
+            emit(m_replacements[it->second], out);
         }
-        int rank = it->second;
-        SymbolPair *sp = symbol_pair_alloc();
-        sp->left = left_idx;
-        sp->right = right_idx;
-        sp->score = get_score(rank);
-        sp->size = merged.size();
-        agenda.push(sp);
-
-        // For re-segmentation: if piece is out-of-vocab, we store how to break it
-        int pid = piece_to_id(merged);
-        if (is_unused_inlined(pid, m_vocab_size))
+        else
         {
-            rev_merge[merged] = {left_piece, right_piece};
+            out.bytes.append(data + i, len);
+            out.offsets.push_back((uint32_t)out.bytes.size());
         }
-    };
+        i += len;
+    }
+}
 
-    // 1) Convert 'tokens' into a linked list of Symbol
-    std::vector<Symbol> symbols;
-    symbols.reserve(tokens.size());
+void Normalizer::normalize_slow(const std::string &text, SymbolStream &out) const
+{
+    // 1) Replace spaces with "▁"
+    out.bytes = replace_spaces_with_underline(text, m_special_character);
 
+    // 2) Replace characters according to m_token_replace_map for consistency
+    apply_token_replace_map(out.bytes, m_token_replace_map);
+    if (out.bytes.size() > std::numeric_limits<uint32_t>::max())
     {
-        // We artificially re-split each token into codepoints if needed,
-        // but typically each token is already a single or merged codepoint.
-        // For demonstration, let's assume each string in 'tokens' is atomic.
-        // We'll assign prev/next indices.
-        // The key fix for multi-byte chars (like “▁”) is that they are
-        // single, intact strings in 'tokens', not partial bytes.
-        int idx = 0;
-        for (auto &tk : tokens)
-        {
-            Symbol s;
-            bool freeze_flag = false;
-            // do a full UTF-8 prefix match => but we consider the entire tk at once
-            // for demonstration, we won't actually “split” tk further.
-            // In real usage, if tk has multiple codepoints, you might want to do that
-            // only if needed. Or keep it as is if “added_vocab” already merged them.
-            // int mblen = (int)tk.size();  // treat the entire token as 1 chunk
-            // The essential part is: do NOT break multi-byte chars incorrectly
-            // Here we skip the loop because 'tk' is presumably correct
-            s.piece = tk;
-            s.freeze = freeze_flag;
-            s.prev = (idx == 0) ? -1 : (idx - 1);
-            s.next = -1; // to fill below
-            symbols.push_back(s);
-            idx++;
-        }
-        // fix next pointers
-        for (int i = 0; i < (int)symbols.size() - 1; i++)
-        {
-            symbols[i].next = i + 1;
-        }
+        throw std::length_error("Text is too long to encode in one call");
     }
 
-    if (symbols.empty())
-    {
-        return {};
-    }
+    // 3) Split into full UTF-8 chars
+    utf8_char_ends(out.bytes, 0, out.offsets);
+}
 
-    // 2) Build a priority queue of adjacent pairs
-    using Agenda = std::priority_queue<SymbolPair *,
-                                       std::vector<SymbolPair *>,
-                                       SymbolPairComparator>;
-    Agenda agenda;
+///////////////////////////////////////////////////////////////////////////////
+//                    Added Vocab (Aho-Corasick matcher)                     //
+///////////////////////////////////////////////////////////////////////////////
 
-    // We'll also keep a little factory for SymbolPair pointers
-    // so we can manage them easily.
-    struct SPFactory
+AhoCorasick::AhoCorasick(const std::vector<std::string> &words)
+{
+    // Goto function (trie) over the word bytes
+    std::vector<int32_t> root_edges(256, -1);
+    std::unordered_map<uint64_t, int> edges;
+    std::vector<int32_t> word_at(1, -1);
+    std::vector<int32_t> depth(1, 0);
+    auto next_node = [&](int node, unsigned char byte)
     {
-        std::vector<std::unique_ptr<SymbolPair>> pool;
-        SymbolPair *operator()()
+        if (node == 0)
         {
-            pool.emplace_back(new SymbolPair());
-            return pool.back().get();
+            return (int)root_edges[byte];
         }
-    } symbol_pair_alloc;
+        auto it = edges.find((static_cast<uint64_t>(node) << 8) | byte);
+        return it == edges.end() ? -1 : it->second;
+    };
+    for (int w = 0; w < (int)words.size(); w++)
+    {
+        int node = 0;
+        for (unsigned char byte : words[w])
+        {
+            int child = next_node(node, byte);
+            if (child == -1)
+            {
+                child = (int)word_at.size();
+                word_at.push_back(-1);
+                depth.push_back(depth[node] + 1);
+                if (node == 0)
+                {
+                    root_edges[byte] = child;
+                }
+                else
+                {
+                    edges.emplace((static_cast<uint64_t>(node) << 8) | byte, child);
+                }
+            }
+            node = child;
+        }
+        if (word_at[node] == -1)
+        {
+            word_at[node] = w;
+        }
+    }
+
+    // Failure and output links, breadth first
+    std::vector<int32_t> fail_link(word_at.size(), 0);
+    std::vector<int32_t> output_link(word_at.size(), -1);
+    std::vector<std::vector<std::pair<unsigned char, int>>> children(word_at.size());
+    for (int byte = 0; byte < 256; byte++)
+    {
+        if (root_edges[byte] != -1)
+        {
+            children[0].push_back({(unsigned char)byte, root_edges[byte]});
+        }
+    }
+    for (auto &kv : edges)
+    {
+        children[kv.first >> 8].push_back({(unsigned char)(kv.first & 0xFF), kv.second});
+    }
+    std::queue<int> bfs;
+    for (auto &edge : children[0])
+    {
+        bfs.push(edge.second);
+    }
+    while (!bfs.empty())
+    {
+        const int node = bfs.front();
+        bfs.pop();
+        for (auto &edge : children[node])
+        {
+            const int child = edge.second;
+            int fail = fail_link[node];
+            int target = next_node(fail, edge.first);
+            while (target == -1 && fail != 0)
+            {
+                fail = fail_link[fail];
+                target = next_node(fail, edge.first);
+            }
+            fail_link[child] = (target == -1) ? 0 : target;
+            const int f = fail_link[child];
+            output_link[child] = (word_at[f] != -1) ? f : output_link[f];
+            bfs.push(child);
+        }
+    }
+
+    std::vector<PairMap<int32_t>::Slot> edge_slots;
+    edge_slots.reserve(edges.size());
+    for (auto &kv : edges)
+    {
+        edge_slots.push_back({kv.first, kv.second});
+    }
+    std::sort(edge_slots.begin(), edge_slots.end(),
+              [](const PairMap<int32_t>::Slot &a, const PairMap<int32_t>::Slot &b) { return a.key < b.key; });
+    m_root_edges = std::move(root_edges);
+    m_edges = PairMap<int32_t>(edge_slots);
+    m_fail = std::move(fail_link);
+    m_word_at = std::move(word_at);
+    m_output_link = std::move(output_link);
+    m_depth = std::move(depth);
+}
+
+size_t AhoCorasick::memory_usage() const
+{
+    return m_root_edges.memory_usage() + m_edges.memory_usage() + m_fail.memory_usage() +
+           m_word_at.memory_usage() + m_output_link.memory_usage() + m_depth.memory_usage();
+}
+
+int AhoCorasick::next_node(int node, unsigned char byte) const
+{
+    if (node == 0)
+    {
+        return m_root_edges[byte];
+    }
+    const int32_t *child = m_edges.find((static_cast<uint64_t>(node) << 8) | byte);
+    return child == nullptr ? -1 : *child;
+}
+
+int AhoCorasick::step(int node, unsigned char byte) const
+{
+    int next = next_node(node, byte);
+    while (next == -1 && node != 0)
+    {
+        node = m_fail[node];
+        next = next_node(node, byte);
+    }
+    return (next == -1) ? 0 : next;
+}
+
+/**
+ * Longest word first; words of equal length keep their list order.
+ * Single-codepoint words never need merging.
+ */
+static std::vector<std::string> added_words_by_priority(const std::vector<std::string> &added_vocab)
+{
+    std::vector<std::string> words;
+    std::unordered_map<std::string, bool> seen;
+    for (auto &word : added_vocab)
+    {
+        if (utf8_to_chars(word).size() >= 2 && seen.emplace(word, true).second)
+        {
+            words.push_back(word);
+        }
+    }
+    std::stable_sort(words.begin(), words.end(),
+                     [](const std::string &a, const std::string &b)
+                     {
+                         return a.size() > b.size();
+                     });
+    return words;
+}
+
+AddedVocabMatcher::AddedVocabMatcher(const std::vector<std::string> &added_vocab)
+{
+    const std::vector<std::string> words = added_words_by_priority(added_vocab);
+    m_words = StringTable(words);
+    m_automaton = AhoCorasick(words);
+}
+
+void AddedVocabMatcher::memory_usage(std::map<std::string, size_t> &usage) const
+{
+    usage["added_vocab.words"] = m_words.memory_usage();
+    usage["added_vocab.automaton"] = m_automaton.memory_usage();
+}
+
+/**
+ * One automaton pass over the bytes of `symbols`, collecting every
+ * occurrence of a word that starts and ends on symbol boundaries.
+ */
+void AddedVocabMatcher::find_matches(const SymbolStream &symbols, std::vector<Match> &matches) const
+{
+    thread_local std::vector<int> token_at; // byte offset => symbol index, -1 inside a symbol
+    matches.clear();
+
+    const std::string &bytes = symbols.bytes;
+    const std::vector<uint32_t> &offsets = symbols.offsets;
+    const int count = (int)symbols.size();
+    const size_t size = offsets[count];
+    token_at.assign(size, -1);
+    for (int t = 0; t < count; t++)
+    {
+        token_at[offsets[t]] = t;
+    }
+
+    int node = 0;
+    int current = 0; // symbol holding byte i
+    for (size_t i = 0; i < size; i++)
+    {
+        node = m_automaton.step(node, static_cast<unsigned char>(bytes[i]));
+
+        if (i + 1 != offsets[current + 1])
+        {
+            continue; // matches must end on a symbol boundary
+        }
+        current++;
+        for (int out = m_automaton.first_output(node); out != -1;
+             out = m_automaton.next_output(out))
+        {
+            const int word = m_automaton.word_at(out);
+            const size_t begin_offset = i + 1 - m_words[word].size();
+            if (token_at[begin_offset] != -1)
+            {
+                matches.push_back(Match{word, token_at[begin_offset], current});
+            }
+        }
+    }
+}
+
+void AddedVocabMatcher::mark_crossed(const SymbolStream &symbols, std::vector<uint8_t> &crossed) const
+{
+    crossed.assign(symbols.size() + 1, 0);
+    if (m_words.empty())
+    {
+        return;
+    }
+    thread_local std::vector<Match> matches;
+    find_matches(symbols, matches);
+    for (const Match &m : matches)
+    {
+        std::fill(crossed.begin() + m.begin + 1, crossed.begin() + m.end, 1);
+    }
+}
+
+/**
+ * Merges every added-vocab word found in `token_list` (UTF-8 chars) into a
+ * single token. One automaton pass collects all occurrences that start and
+ * end on token boundaries; they are then accepted longest word first,
+ * leftmost first, skipping any that overlap an accepted one - exactly what
+ * merging the words one after the other, longest first, would produce.
+ */
+void AddedVocabMatcher::merge(SymbolStream &symbols) const
+{
+    if (m_words.empty())
+    {
+        return;
+    }
+
+    struct Scratch
+    {
+        std::vector<Match> matches;
+        std::vector<int> span_end; // symbol => end of the accepted match starting there
+    };
+    thread_local Scratch scratch;
+    std::vector<Match> &matches = scratch.matches;
+    find_matches(symbols, matches);
+    if (matches.empty())
+    {
+        return;
+    }
+
+    std::vector<uint32_t> &offsets = symbols.offsets;
+    const int count = (int)symbols.size();
+
+    std::sort(matches.begin(), matches.end(),
+              [](const Match &a, const Match &b)
+              {
+                  return a.word != b.word ? a.word < b.word : a.begin < b.begin;
+              });
+
+    // span_end doubles as the occupancy map: -1 free, -2 covered
+    std::vector<int> &span_end = scratch.span_end;
+    span_end.assign(count, -1);
+    for (const Match &m : matches)
+    {
+        bool free = true;
+        for (int t = m.begin; t < m.end && free; t++)
+        {
+            free = (span_end[t] == -1);
+        }
+        if (!free)
+        {
+            continue;
+        }
+        for (int t = m.begin + 1; t < m.end; t++)
+        {
+            span_end[t] = -2;
+        }
+        span_end[m.begin] = m.end;
+    }
+
+    // Drop the boundaries inside accepted matches, in place
+    size_t kept = 1;
+    for (int t = 0; t < count;)
+    {
+        const int next = (span_end[t] < 0) ? t + 1 : span_end[t];
+        offsets[kept++] = offsets[next];
+        t = next;
+    }
+    offsets.resize(kept);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                   Faster BPE (SentencePiece-style merges)                 //
+///////////////////////////////////////////////////////////////////////////////
+
+/**
+ * A small function to detect if a piece ID is "unused" (out-of-vocab)
+ * so that we can do resegmentation. Here, we do a trivial check:
+ *    if (0 <= id < vocab_size) => it's "used"
+ *    else => "unused"
+ */
+static bool is_unused_inlined(int id, int vocab_size)
+{
+    return (id < 0 || id >= vocab_size);
+}
+
+/**
+ * The FasterBPE class is a priority-queue-based BPE engine.
+ * It is used by the BPE class to perform the actual BPE merges.
+ */
+FasterBPE::FasterBPE(const std::map<std::pair<std::string, std::string>, int> &bpe_ranks,
+                     const std::map<std::string, int> &vocab,
+                     const std::vector<std::string> &added_vocab,
+                     BPEEngine engine)
+    : m_engine(engine)
+{
+    // Vocab size for "unused" checks
+    m_vocab_size = (int)vocab.size();
+
+    // "left+right" => rank, sorted so that every table below is built in
+    // the same order on every run (compiled models are reproducible)
+    std::unordered_map<std::string, int> ranks;
+    for (auto &kv : bpe_ranks)
+    {
+        ranks[kv.first.first + kv.first.second] = kv.second;
+    }
+    std::vector<std::pair<std::string, int>> pieces(ranks.begin(), ranks.end());
+    std::sort(pieces.begin(), pieces.end());
+
+    // Symbol IDs for the integer engine. Vocab pieces keep their vocab ID;
+    // everything else that can take part in a merge (merge results that are
+    // not in the vocab, added-vocab words, and every codepoint of a merge)
+    // gets a synthetic ID above both the largest vocab ID and the vocab size,
+    // so that is_unused_inlined() treats it exactly like the string engine does.
+    std::unordered_map<std::string, int> symbol_ids;
+    std::vector<std::pair<std::string, int>> symbols(vocab.begin(), vocab.end());
+    int max_id = -1;
+    for (auto &kv : vocab)
+    {
+        symbol_ids[kv.first] = kv.second;
+        max_id = std::max(max_id, kv.second);
+    }
+    m_first_synthetic_id = std::max(max_id + 1, m_vocab_size);
+    int next_synthetic = m_first_synthetic_id;
+    auto intern = [&](const std::string &piece)
+    {
+        if (symbol_ids.emplace(piece, next_synthetic).second)
+        {
+            symbols.push_back({piece, next_synthetic});
+            next_synthetic++;
+        }
+    };
+    for (auto &kv : pieces)
+    {
+        intern(kv.first);
+        for (auto &ch : utf8_to_chars(kv.first))
+        {
+            intern(ch);
+        }
+    }
+    for (auto &kv : bpe_ranks)
+    {
+        intern(kv.first.first);
+        intern(kv.first.second);
+    }
+    for (auto &word : added_vocab)
+    {
+        intern(word);
+    }
+    m_symbols = SymbolTable(symbols);
+
+    std::vector<int32_t> merge_rank(m_symbols.entries(), -1);
+    for (auto &kv : pieces)
+    {
+        merge_rank[m_symbols.find_entry(kv.first)] = kv.second;
+    }
+    m_merge_rank = std::move(merge_rank);
+
+    // The string engine matches a pair whenever "left+right" is a merged
+    // piece, whatever the split. Register every split of every merged piece
+    // whose halves are known symbols so both engines agree.
+    std::vector<PairMap<MergeEntry>::Slot> merges;
+    for (auto &kv : pieces)
+    {
+        const std::string &merged = kv.first;
+        const MergeEntry entry{kv.second, symbol_ids.at(merged)};
+        for (size_t k = 1; k < merged.size(); k++)
+        {
+            auto left = symbol_ids.find(merged.substr(0, k));
+            if (left == symbol_ids.end())
+            {
+                continue;
+            }
+            auto right = symbol_ids.find(merged.substr(k));
+            if (right == symbol_ids.end())
+            {
+                continue;
+            }
+            // left + right == merged, so each pair is registered once
+            merges.push_back({pack_pair(left->second, right->second), entry});
+        }
+    }
+    m_merges = PairMap<MergeEntry>(merges);
+
+    for (int c = 0; c < 128; c++)
+    {
+        auto it = symbol_ids.find(std::string(1, (char)c));
+        m_ascii_symbol_ids[c] = (it == symbol_ids.end()) ? -1 : it->second;
+    }
+
+    if (m_engine == BPEEngine::Backtracking)
+    {
+        build_backtracking_tables();
+    }
+}
+
+bool FasterBPE::merges_across(const std::string &boundary) const
+{
+    if (boundary.empty())
+    {
+        return true;
+    }
+    for (size_t e = 0; e < m_symbols.entries(); e++)
+    {
+        if (m_merge_rank[e] < 0)
+        {
+            continue;
+        }
+        const std::string_view merged = m_symbols.entry_piece(e);
+        for (size_t pos = merged.find(boundary, 1); pos != std::string::npos;
+             pos = merged.find(boundary, pos + 1))
+        {
+            if (pos < boundary.size() ||
+                merged.compare(pos - boundary.size(), boundary.size(), boundary) != 0)
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void FasterBPE::memory_usage(std::map<std::string, size_t> &usage) const
+{
+    usage["engine.symbols"] = m_symbols.memory_usage();
+    usage["engine.merge_rank"] = m_merge_rank.memory_usage();
+    usage["engine.ascii_symbol_ids"] = sizeof(m_ascii_symbol_ids);
+    usage["engine.merges"] = m_merges.memory_usage();
+    if (m_engine == BPEEngine::Backtracking)
+    {
+        usage["engine.piece_rank"] = m_piece_rank.memory_usage();
+        usage["engine.piece_split"] = m_piece_split.memory_usage();
+        usage["engine.next_prefix"] = m_next_prefix.memory_usage();
+        usage["engine.trie_edges"] = m_trie_edges.memory_usage();
+        usage["engine.trie_piece"] = m_trie_piece.memory_usage();
+    }
+}
+
+int FasterBPE::symbol_id(std::string_view piece) const
+{
+    if (piece.size() == 1 && static_cast<unsigned char>(piece[0]) < 0x80)
+    {
+        return m_ascii_symbol_ids[static_cast<unsigned char>(piece[0])];
+    }
+    return m_symbols.find(piece);
+}
+
+/**
+ * Takes a sequence of tokenized codepoints (after added_vocab merges)
+ * and does the SentencePiece-style priority-queue BPE merges.
+ *
+ * - alpha is the BPE-dropout probability (0.0 => no dropout).
+ * - Returns the final subword tokens (UTF-8).
+ */
+std::vector<std::string> FasterBPE::run_faster_bpe(const std::vector<std::string> &tokens,
+                                                   float alpha) const
+{
+    if (tokens.empty())
+    {
+        return {};
+    }
+
+    // We define some internal data structures:
+    struct Symbol
+    {
+        int prev;
+        int next;
+        bool freeze;
+        std::string piece;
+    };
+
+    struct SymbolPair
+    {
+        int left;    // index in "symbols"
+        int right;   // index in "symbols"
+        float score; // bigger => higher priority
+        size_t size; // total length of merged piece
+    };
+
+    // For the priority queue:
+    struct SymbolPairComparator
+    {
+        bool operator()(const SymbolPair *a, const SymbolPair *b) const
+        {
+            // higher score => pop first
+            if (a->score < b->score)
+                return true;
+            if (a->score > b->score)
+                return false;
+            // tie-break: smaller left index => higher priority
+            return (a->left > b->left);
+        }
+    };
+
+    // Per-thread working memory, reused across calls (reset, never freed):
+    // the symbol array, the SymbolPair slab the agenda points into, the heap
+    // storage and the re-segmentation table. Only the first n symbols are live,
+    // so their strings keep their capacity from one call to the next.
+    struct Scratch
+    {
+        std::vector<Symbol> symbols;
+        std::vector<SymbolPair> pair_slab;
+        std::vector<int> agenda; // heap of indices into pair_slab
+        std::unordered_map<std::string, std::pair<std::string, std::string>> rev_merge;
+        std::string merged;
+    };
+    thread_local Scratch scratch;
+    auto &symbols = scratch.symbols;
+    auto &pair_slab = scratch.pair_slab;
+    auto &agenda = scratch.agenda;
+    // We also store "rev_merge" so we can resegment out-of-vocab pieces.
+    auto &rev_merge = scratch.rev_merge;
+    pair_slab.clear();
+    agenda.clear();
+    if (!rev_merge.empty())
+    {
+        rev_merge.clear();
+    }
+
+    // A quick function to retrieve a "score" from a rank => -rank
+    auto get_score = [&](int rank)
+    {
+        // Lower rank => bigger score
+        return (float)(-rank);
+    };
+
+    // A function to get the ID of a piece. -1 if not in the vocab.
+    auto piece_to_id = [&](const std::string &piece)
+    {
+        return vocab_id(piece);
+    };
+
+    // Heap order over slab indices (see SymbolPairComparator)
+    const SymbolPairComparator pair_less;
+    auto agenda_less = [&](int a, int b)
+    {
+        return pair_less(&pair_slab[a], &pair_slab[b]);
+    };
+
+    // We want to maybe add a pair (left,right) if "left+right" is in merges
+    auto MaybeAddNewSymbolPair = [&](int left_idx, int right_idx)
+    {
+        if (left_idx < 0 || right_idx < 0)
+        {
+            return;
+        }
+        if (symbols[left_idx].freeze || symbols[right_idx].freeze)
+        {
+            return;
+        }
+        const std::string &left_piece = symbols[left_idx].piece;
+        const std::string &right_piece = symbols[right_idx].piece;
+        if (left_piece.empty() || right_piece.empty())
+        {
+            return;
+        }
+        std::string &merged = scratch.merged;
+        merged.assign(left_piece).append(right_piece);
+        const int rank = merge_rank(merged);
+        if (rank < 0)
+        {
+            return; // not a known pair
+        }
+        pair_slab.push_back(SymbolPair{left_idx, right_idx, get_score(rank), merged.size()});
+        agenda.push_back((int)pair_slab.size() - 1);
+        std::push_heap(agenda.begin(), agenda.end(), agenda_less);
+
+        // For re-segmentation: if piece is out-of-vocab, we store how to break it
+        int pid = piece_to_id(merged);
+        if (is_unused_inlined(pid, m_vocab_size))
+        {
+            rev_merge[merged] = {left_piece, right_piece};
+        }
+    };
+
+    // 1) Convert 'tokens' into a linked list of Symbol
+    //    Each string in 'tokens' is atomic: a single UTF-8 codepoint or an
+    //    added-vocab word that must not be split again.
+    const int num_symbols = (int)tokens.size();
+    if ((int)symbols.size() < num_symbols)
+    {
+        symbols.resize(num_symbols);
+    }
+    for (int idx = 0; idx < num_symbols; idx++)
+    {
+        Symbol &s = symbols[idx];
+        s.piece.assign(tokens[idx]);
+        s.freeze = false;
+        s.prev = idx - 1;
+        s.next = (idx + 1 < num_symbols) ? idx + 1 : -1;
+    }
+
+    // 2) Build a priority queue of adjacent pairs
+    for (int i = 0; i + 1 < num_symbols; i++)
+    {
+        MaybeAddNewSymbolPair(i, i + 1);
+    }
+
+    // 3) BPE-dropout logic (the RNG is only seeded when dropout is on)
+    std::unique_ptr<std::mt19937> rng;
+    auto skip_merge = [&]()
+    {
+        if (alpha <= 0.0f)
+            return false;
+        if (alpha >= 1.0f)
+            return true;
+        if (!rng)
+            rng.reset(new std::mt19937(std::random_device{}()));
+        std::uniform_real_distribution<> dist(0.0, 1.0);
+        return (dist(*rng) < alpha);
+    };
+
+    // 4) Repeatedly pop top pair, merge it, add new pairs
+    while (!agenda.empty())
+    {
+        std::pop_heap(agenda.begin(), agenda.end(), agenda_less);
+        const SymbolPair top = pair_slab[agenda.back()];
+        agenda.pop_back();
+
+        int L = top.left;
+        int R = top.right;
+        if (L < 0 || R < 0)
+            continue;
+
+        // Check if stale: maybe symbol was merged away
+        if (symbols[L].piece.empty() || symbols[R].piece.empty())
+        {
+            continue;
+        }
+        size_t expected_len = symbols[L].piece.size() + symbols[R].piece.size();
+        if (expected_len != top.size)
+        {
+            continue; // stale
+        }
+        // skip merge with probability alpha
+        if (skip_merge())
+        {
+            continue;
+        }
+
+        // Actually merge them
+        symbols[L].piece += symbols[R].piece;
+        symbols[R].piece.clear();
+
+        // fix next/prev pointers
+        int leftPrev = symbols[L].prev;
+        int rightNext = symbols[R].next;
+
+        symbols[L].next = rightNext;
+        if (rightNext != -1)
+        {
+            symbols[rightNext].prev = L;
+        }
+
+        // Possibly re-add new pairs
+        // (leftPrev, L) and (L, rightNext)
+        if (leftPrev != -1)
+        {
+            MaybeAddNewSymbolPair(leftPrev, L);
+        }
+        if (rightNext != -1)
+        {
+            MaybeAddNewSymbolPair(L, rightNext);
+        }
+    }
+
+    // 5) Re-segmentation for any out-of-vocab merges
+    //    If a merged piece is "unused," we look up rev_merge to see how to break it.
+    std::function<void(const std::string &, std::vector<std::string> &)> resegment;
+    resegment = [&](const std::string &w, std::vector<std::string> &out)
+    {
+        // Check if it's in vocab
+        int id = piece_to_id(w);
+        if (id == -1 || is_unused_inlined(id, m_vocab_size))
+        {
+            // See if we can break it further
+            auto it = rev_merge.find(w);
+            if (it == rev_merge.end())
+            {
+                // No info => just keep it
+                out.push_back(w);
+                return;
+            }
+            // break it
+            resegment(it->second.first, out);
+            resegment(it->second.second, out);
+        }
+        else
+        {
+            // in vocab => done
+            out.push_back(w);
+        }
+    };
+
+    // Collect final pieces in order
+    std::vector<std::string> result;
+    result.reserve(num_symbols);
+
+    // Start from index 0
+    int cur_idx = 0;
+    while (cur_idx != -1 && cur_idx < num_symbols)
+    {
+        if (!symbols[cur_idx].piece.empty())
+        {
+            resegment(symbols[cur_idx].piece, result);
+        }
+        cur_idx = symbols[cur_idx].next;
+    }
+
+    return result;
+}
+
+/**
+ * Same merge procedure as run_faster_bpe, but every symbol is an integer ID
+ * and candidate pairs are found in m_merges by their packed (left, right)
+ * key. Pairs live by value in the heap, and stale entries are detected by
+ * comparing the IDs they were built from with the current symbols.
+ */
+std::vector<int> FasterBPE::run_faster_bpe_ids(const std::vector<int> &symbol_ids,
+                                               float alpha) const
+{
+    std::vector<int> result;
+    merge_symbol_ids(symbol_ids.data(), symbol_ids.size(), alpha, result, nullptr);
+    return result;
+}
+
+void FasterBPE::merge_symbol_ids(const int *symbol_ids,
+                                 size_t count,
+                                 float alpha,
+                                 std::vector<int> &out,
+                                 std::pair<int, int> *last_merge) const
+{
+    if (count == 0)
+    {
+        return;
+    }
+
+    struct Symbol
+    {
+        int prev;
+        int next;
+        int id; // -1 once merged away (or unknown => never merges)
+    };
+
+    struct SymbolPair
+    {
+        int left;     // index in "symbols"
+        int right;    // index in "symbols"
+        int left_id;  // symbols[left].id when the pair was queued
+        int right_id; // symbols[right].id when the pair was queued
+        int rank;     // smaller => higher priority
+        int merged_id;
+    };
+
+    struct SymbolPairComparator
+    {
+        bool operator()(const SymbolPair &a, const SymbolPair &b) const
+        {
+            // lower rank => pop first, tie-break: smaller left index
+            if (a.rank != b.rank)
+                return a.rank > b.rank;
+            return a.left > b.left;
+        }
+    };
+
+    // Per-thread working memory, reused across calls (see run_faster_bpe)
+    struct Scratch
+    {
+        std::vector<Symbol> symbols;
+        std::vector<SymbolPair> agenda; // heap storage
+        std::unordered_map<int, std::pair<int, int>> rev_merge;
+        std::vector<int> stack;
+    };
+    thread_local Scratch scratch;
+    auto &symbols = scratch.symbols;
+    auto &agenda = scratch.agenda;
+    // merged_id => (left_id, right_id), only for merges outside the vocab
+    auto &rev_merge = scratch.rev_merge;
+    agenda.clear();
+    if (!rev_merge.empty())
+    {
+        rev_merge.clear();
+    }
+
+    const int num_symbols = (int)count;
+    symbols.resize(num_symbols);
+    for (int i = 0; i < num_symbols; i++)
+    {
+        symbols[i].prev = i - 1;
+        symbols[i].next = (i + 1 < num_symbols) ? i + 1 : -1;
+        symbols[i].id = symbol_ids[i];
+    }
+
+    const SymbolPairComparator pair_less;
+
+    auto MaybeAddNewSymbolPair = [&](int left_idx, int right_idx)
+    {
+        const int left_id = symbols[left_idx].id;
+        const int right_id = symbols[right_idx].id;
+        if (left_id < 0 || right_id < 0)
+        {
+            return;
+        }
+        const MergeEntry *entry_ptr = m_merges.find(pack_pair(left_id, right_id));
+        if (entry_ptr == nullptr)
+        {
+            return;
+        }
+        const MergeEntry &entry = *entry_ptr;
+        agenda.push_back(SymbolPair{left_idx, right_idx, left_id, right_id, entry.rank, entry.merged_id});
+        std::push_heap(agenda.begin(), agenda.end(), pair_less);
+        if (is_unused_inlined(entry.merged_id, m_vocab_size))
+        {
+            rev_merge[entry.merged_id] = {left_id, right_id};
+        }
+    };
+
+    for (int i = 0; i + 1 < num_symbols; i++)
+    {
+        MaybeAddNewSymbolPair(i, i + 1);
+    }
+
+    // BPE-dropout: only pay for the RNG when it is actually used
+    std::unique_ptr<std::mt19937> rng;
+    std::uniform_real_distribution<> dist(0.0, 1.0);
+    auto skip_merge = [&]()
+    {
+        if (alpha <= 0.0f)
+            return false;
+        if (alpha >= 1.0f)
+            return true;
+        if (!rng)
+            rng.reset(new std::mt19937(std::random_device{}()));
+        return (dist(*rng) < alpha);
+    };
+
+    while (!agenda.empty())
+    {
+        std::pop_heap(agenda.begin(), agenda.end(), pair_less);
+        const SymbolPair top = agenda.back();
+        agenda.pop_back();
+
+        Symbol &left = symbols[top.left];
+        Symbol &right = symbols[top.right];
+        // Stale: either side was merged since this pair was queued
+        if (left.id != top.left_id || right.id != top.right_id || left.next != top.right)
+        {
+            continue;
+        }
+        if (skip_merge())
+        {
+            continue;
+        }
+
+        if (last_merge)
+        {
+            *last_merge = {top.left_id, top.right_id};
+        }
+        left.id = top.merged_id;
+        right.id = -1;
+        left.next = right.next;
+        if (right.next != -1)
+        {
+            symbols[right.next].prev = top.left;
+        }
+
+        if (left.prev != -1)
+        {
+            MaybeAddNewSymbolPair(left.prev, top.left);
+        }
+        if (left.next != -1)
+        {
+            MaybeAddNewSymbolPair(top.left, left.next);
+        }
+    }
+
+    // Collect final IDs, re-segmenting merges that are not in the vocab
+    std::vector<int> &stack = scratch.stack;
+    for (int cur_idx = 0; cur_idx != -1; cur_idx = symbols[cur_idx].next)
+    {
+        if (symbols[cur_idx].id < 0)
+        {
+            out.push_back(0); // unknown piece
+            continue;
+        }
+        stack.push_back(symbols[cur_idx].id);
+        while (!stack.empty())
+        {
+            int id = stack.back();
+            stack.pop_back();
+            if (is_unused_inlined(id, m_vocab_size))
+            {
+                auto it = rev_merge.find(id);
+                if (it != rev_merge.end())
+                {
+                    // push right first so the left half is emitted first
+                    stack.push_back(it->second.second);
+                    stack.push_back(it->second.first);
+                    continue;
+                }
+            }
+            out.push_back(id < m_first_synthetic_id ? id : 0);
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                 Backtracking BPE (linear-time encoder)                    //
+///////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Builds the tables for run_backtracking_bpe_ids:
+ *
+ * - every single codepoint is a base piece,
+ * - every merged piece that the priority-queue engine rebuilds from its own
+ *   codepoints is a trie piece, split at the last merge that formed it.
+ *
+ * Added-vocab words are atomic symbols that merge with their neighbours as a
+ * whole, which codepoint-level tables cannot express; runs containing one
+ * are left to the priority queue.
+ *
+ * The equivalence with the priority queue needs every merge result to be a
+ * used vocab piece (no re-segmentation), so other tables are rejected.
+ */
+void FasterBPE::build_backtracking_tables()
+{
+    const int num_ids = (int)m_symbols.size();
+    std::vector<char> used(num_ids, 0); // IDs with a piece
+    for (size_t e = 0; e < m_symbols.entries(); e++)
+    {
+        const int id = m_symbols.entry_id(e);
+        used[id] = 1;
+        if (m_merge_rank[e] >= 0 && (id >= m_first_synthetic_id || is_unused_inlined(id, m_vocab_size)))
+        {
+            throw std::invalid_argument(
+                "Backtracking BPE engine needs every merge result in the vocabulary "
+                "(missing or unused: '" + std::string(m_symbols.entry_piece(e)) + "'); use BPEEngine.PriorityQueue");
+        }
+    }
+
+    std::vector<int32_t> piece_rank(num_ids, -1);
+    std::vector<IdPair> piece_split(num_ids, IdPair{-1, -1});
+    std::vector<int32_t> next_prefix(num_ids, -1);
+
+    std::vector<char> in_trie(num_ids, 0);
+
+    for (int id = 0; id < num_ids; id++)
+    {
+        if (!used[id])
+        {
+            continue;
+        }
+        const std::string piece(m_symbols[id]);
+        std::vector<std::string> chars = utf8_to_chars(piece);
+        if (chars.size() == 1)
+        {
+            piece_split[id] = {id, id};
+            in_trie[id] = 1;
+            continue;
+        }
+
+        const int rank = merge_rank(piece);
+        if (rank >= 0)
+        {
+            std::vector<int> char_ids;
+            char_ids.reserve(chars.size());
+            for (auto &ch : chars)
+            {
+                char_ids.push_back(symbol_id(ch));
+            }
+            std::pair<int, int> split{-1, -1};
+            std::vector<int> encoded;
+            merge_symbol_ids(char_ids.data(), char_ids.size(), 0.0f, encoded, &split);
+            if (encoded.size() == 1 && encoded[0] == id)
+            {
+                piece_rank[id] = rank;
+                piece_split[id] = {split.first, split.second};
+                in_trie[id] = 1;
+            }
+        }
+    }
+
+    // Byte trie over all trie pieces
+    std::vector<int32_t> trie_piece(1, -1);
+    std::unordered_map<uint64_t, int> trie_edges;
+    for (int id = 0; id < num_ids; id++)
+    {
+        if (!in_trie[id])
+        {
+            continue;
+        }
+        int node = 0;
+        for (unsigned char byte : m_symbols[id])
+        {
+            const uint64_t key = (static_cast<uint64_t>(node) << 8) | byte;
+            auto it = trie_edges.find(key);
+            if (it == trie_edges.end())
+            {
+                it = trie_edges.emplace(key, (int)trie_piece.size()).first;
+                trie_piece.push_back(-1);
+            }
+            node = it->second;
+        }
+        trie_piece[node] = id;
+    }
+
+    // Longest strict prefix of each piece that is itself a trie piece
+    for (int id = 0; id < num_ids; id++)
+    {
+        if (!in_trie[id])
+        {
+            continue;
+        }
+        const std::string_view piece = m_symbols[id];
+        int node = 0;
+        for (size_t i = 0; i + 1 < piece.size(); i++)
+        {
+            node = trie_edges.at((static_cast<uint64_t>(node) << 8) | (unsigned char)piece[i]);
+            if (trie_piece[node] != -1)
+            {
+                next_prefix[id] = trie_piece[node];
+            }
+        }
+    }
+
+    std::vector<PairMap<int32_t>::Slot> edges;
+    edges.reserve(trie_edges.size());
+    for (auto &kv : trie_edges)
+    {
+        edges.push_back({kv.first, kv.second});
+    }
+    std::sort(edges.begin(), edges.end(),
+              [](const PairMap<int32_t>::Slot &a, const PairMap<int32_t>::Slot &b) { return a.key < b.key; });
+    m_piece_rank = std::move(piece_rank);
+    m_piece_split = std::move(piece_split);
+    m_next_prefix = std::move(next_prefix);
+    m_trie_edges = PairMap<int32_t>(edges);
+    m_trie_piece = std::move(trie_piece);
+}
+
+// Longest trie piece starting at text[pos], or -1.
+int FasterBPE::longest_match(const std::string &text, size_t pos) const
+{
+    int node = 0;
+    int best = -1;
+    for (size_t i = pos; i < text.size(); i++)
+    {
+        const int32_t *child = m_trie_edges.find((static_cast<uint64_t>(node) << 8) | (unsigned char)text[i]);
+        if (child == nullptr)
+        {
+            break;
+        }
+        node = *child;
+        if (m_trie_piece[node] != -1)
+        {
+            best = m_trie_piece[node];
+        }
+    }
+    return best;
+}
+
+/**
+ * True if BPE keeps `left_id` and `right_id` as two tokens when encoding
+ * their concatenation: unmerge the later-formed side one step at a time and
+ * check that no pair across the boundary would have been merged first.
+ */
+bool FasterBPE::is_valid_token_pair(int left_id, int right_id) const
+{
+    int limit = std::numeric_limits<int>::max();
+    while (true)
+    {
+        const MergeEntry *entry = m_merges.find(pack_pair(left_id, right_id));
+        if (entry != nullptr && entry->rank < limit)
+        {
+            return false;
+        }
+        if (m_piece_rank[left_id] > m_piece_rank[right_id])
+        {
+            limit = m_piece_rank[left_id];
+            const int next_left = m_piece_split[left_id].second;
+            if (next_left == left_id)
+            {
+                limit = m_piece_rank[right_id] + 1;
+                const int next_right = m_piece_split[right_id].first;
+                if (next_right == right_id)
+                {
+                    return true;
+                }
+                right_id = next_right;
+            }
+            left_id = next_left;
+        }
+        else
+        {
+            limit = m_piece_rank[right_id] + 1;
+            const int next_right = m_piece_split[right_id].first;
+            if (next_right == right_id)
+            {
+                limit = m_piece_rank[left_id];
+                const int next_left = m_piece_split[left_id].second;
+                if (next_left == left_id)
+                {
+                    return true;
+                }
+                left_id = next_left;
+            }
+            right_id = next_right;
+        }
+    }
+}
+
+/**
+ * Encodes runs of known symbols by walking forward with the longest trie
+ * piece that ends on a symbol boundary and forms a valid pair with the
+ * previous token, backtracking (and remembering the dead end) otherwise.
+ * Unknown symbols never merge, so they split the input into runs. Runs that
+ * contain an added-vocab word go through merge_symbol_ids instead.
+ */
+std::vector<int> FasterBPE::run_backtracking_bpe_ids(const std::vector<int> &symbol_ids) const
+{
+    if (m_engine != BPEEngine::Backtracking)
+    {
+        throw std::logic_error("BPE was not built with BPEEngine::Backtracking");
+    }
+    std::vector<int> result;
+    backtrack_symbol_ids(symbol_ids.data(), symbol_ids.size(), result);
+    return result;
+}
+
+void FasterBPE::backtrack_symbol_ids(const int *symbol_ids, size_t count, std::vector<int> &out) const
+{
+    // Per-thread working memory, reused across calls (see run_faster_bpe)
+    struct Scratch
+    {
+        std::string text;
+        std::vector<char> reachable; // a token may end here
+        std::vector<int> symbol_end; // end of the input symbol starting here
+        std::vector<int> tokens;
+    };
+    thread_local Scratch scratch;
+    std::string &text = scratch.text;
+    std::vector<char> &reachable = scratch.reachable;
+    std::vector<int> &symbol_end = scratch.symbol_end;
+    std::vector<int> &tokens = scratch.tokens;
+
+    auto encode_run = [&](size_t begin, size_t end)
+    {
+        text.clear();
+        symbol_end.clear();
+        for (size_t i = begin; i < end; i++)
+        {
+            const std::string_view piece = m_symbols[symbol_ids[i]];
+            if (piece.size() > utf8_char_length(piece[0]))
+            {
+                // Added-vocab word: it merges with its neighbours as one
+                // symbol, which the codepoint-level tables do not model
+                merge_symbol_ids(symbol_ids + begin, end - begin, 0.0f, out, nullptr);
+                return;
+            }
+            symbol_end.resize(text.size() + piece.size() + 1, -1);
+            symbol_end[text.size()] = (int)(text.size() + piece.size());
+            text += piece;
+        }
+        reachable.assign(text.size() + 1, 0);
+        for (size_t pos = 0; pos < text.size(); pos = symbol_end[pos])
+        {
+            reachable[symbol_end[pos]] = 1;
+        }
+
+        tokens.clear();
+        size_t pos = 0;
+        int next_token = longest_match(text, 0);
+        while (next_token != -1)
+        {
+            int token = next_token;
+            const int last = tokens.empty() ? -1 : tokens.back();
+            while (true)
+            {
+                const size_t token_end = pos + m_symbols[token].size();
+                if (reachable[token_end] && (last == -1 || is_valid_token_pair(last, token)))
+                {
+                    tokens.push_back(token);
+                    pos = token_end;
+                    next_token = pos < text.size() ? longest_match(text, pos) : -1;
+                    break;
+                }
+                if (m_next_prefix[token] != -1)
+                {
+                    token = m_next_prefix[token];
+                    continue;
+                }
+                if (last == -1)
+                {
+                    // Unreachable with tables from build_backtracking_tables,
+                    // where every codepoint is a base piece; stay correct
+                    // on anything else by deferring to the priority queue
+                    merge_symbol_ids(symbol_ids + begin, end - begin, 0.0f, out, nullptr);
+                    tokens.clear();
+                    next_token = -1;
+                    pos = text.size();
+                    break;
+                }
+                reachable[pos] = 0;
+                tokens.pop_back();
+                pos -= m_symbols[last].size();
+                next_token = last;
+                break;
+            }
+        }
+        for (int id : tokens)
+        {
+            out.push_back(id < m_first_synthetic_id ? id : 0);
+        }
+    };
+
+    size_t run_begin = 0;
+    for (size_t i = 0; i <= count; i++)
+    {
+        if (i == count || symbol_ids[i] < 0)
+        {
+            if (i > run_begin)
+            {
+                encode_run(run_begin, i);
+            }
+            if (i < count)
+            {
+                out.push_back(0); // unknown piece
+            }
+            run_begin = i + 1;
+        }
+    }
+}
+
+void FasterBPE::encode_ids(const int *symbol_ids, size_t count, float alpha,
+                           std::vector<int> &out) const
+{
+    if (m_engine == BPEEngine::Backtracking && alpha <= 0.0f)
+    {
+        backtrack_symbol_ids(symbol_ids, count, out);
+        return;
+    }
+    merge_symbol_ids(symbol_ids, count, alpha, out, nullptr);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                              Word Cache                                   //
+///////////////////////////////////////////////////////////////////////////////
+
+WordCache::WordCache(size_t capacity, CachePolicy policy)
+    : m_capacity(capacity),
+      m_policy(policy),
+      m_num_shards(std::max<size_t>(1, std::min(capacity, kMaxShards))),
+      m_shards(new Shard[m_num_shards]),
+      m_hits(0),
+      m_misses(0)
+{
+    for (size_t i = 0; i < m_num_shards; i++)
+    {
+        m_shards[i].capacity = capacity / m_num_shards + (i < capacity % m_num_shards ? 1 : 0);
+    }
+}
+
+bool WordCache::lookup(std::string_view word, std::vector<int> &out)
+{
+    Shard &shard = this->shard(word);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.index.find(word);
+    if (it == shard.index.end())
+    {
+        m_misses.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    m_hits.fetch_add(1, std::memory_order_relaxed);
+
+    EntryList::iterator entry = it->second;
+    out.insert(out.end(), entry->ids.begin(), entry->ids.end());
+
+    // Move to the front of its (LRU) or the next (LFU) frequency list;
+    // splice keeps the node, so the index stays valid.
+    const size_t freq = entry->freq;
+    const size_t new_freq = (m_policy == CachePolicy::LFU) ? freq + 1 : freq;
+    EntryList &from = shard.by_freq[freq];
+    EntryList &to = shard.by_freq[new_freq];
+    to.splice(to.begin(), from, entry);
+    entry->freq = new_freq;
+    if (from.empty() && new_freq != freq)
+    {
+        shard.by_freq.erase(freq);
+        if (shard.min_freq == freq)
+        {
+            shard.min_freq = new_freq;
+        }
+    }
+    return true;
+}
+
+void WordCache::insert(std::string_view word, const int *ids, size_t count)
+{
+    if (m_capacity == 0)
+    {
+        return;
+    }
+    Shard &shard = this->shard(word);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (shard.index.count(word))
+    {
+        return; // another thread got there first
+    }
+    if (shard.index.size() >= shard.capacity)
+    {
+        // Evict the least recently used entry of the lowest frequency
+        auto lowest = shard.by_freq.find(shard.min_freq);
+        EntryList &victims = lowest->second;
+        shard.index.erase(victims.back().word);
+        victims.pop_back();
+        if (victims.empty())
+        {
+            shard.by_freq.erase(lowest);
+        }
+    }
+    EntryList &fresh = shard.by_freq[1];
+    fresh.push_front(Entry{std::string(word), std::vector<int>(ids, ids + count), 1});
+    shard.index.emplace(fresh.front().word, fresh.begin());
+    shard.min_freq = 1;
+}
+
+void WordCache::clear()
+{
+    for (size_t i = 0; i < m_num_shards; i++)
+    {
+        std::lock_guard<std::mutex> lock(m_shards[i].mutex);
+        m_shards[i].index.clear();
+        m_shards[i].by_freq.clear();
+        m_shards[i].min_freq = 1;
+    }
+    m_hits.store(0, std::memory_order_relaxed);
+    m_misses.store(0, std::memory_order_relaxed);
+}
+
+size_t WordCache::size() const
+{
+    size_t size = 0;
+    for (size_t i = 0; i < m_num_shards; i++)
+    {
+        std::lock_guard<std::mutex> lock(m_shards[i].mutex);
+        size += m_shards[i].index.size();
+    }
+    return size;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                              Thread Pool                                  //
+///////////////////////////////////////////////////////////////////////////////
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_wakeup->notify_all();
+    for (std::thread &worker : *m_workers)
+    {
+        worker.join();
+    }
+}
+
+/**
+ * fork() copies the pool but none of its threads. The handlers keep the
+ * mutex consistent across the fork; in the child they drop the queued tasks
+ * and swap in an empty worker list and a fresh condition variable, so grow()
+ * starts new workers on first use. The parent's copies are released, not
+ * destroyed: a joinable std::thread terminates in its destructor, and the
+ * condition variable still counts waiters that only exist in the parent.
+ */
+ThreadPool &ThreadPool::instance()
+{
+    static ThreadPool pool;
+    static const int atfork = pthread_atfork(
+        [] { pool.m_mutex.lock(); },
+        [] { pool.m_mutex.unlock(); },
+        []
+        {
+            pool.m_workers.release();
+            pool.m_workers = std::make_unique<std::vector<std::thread>>();
+            pool.m_wakeup.release();
+            pool.m_wakeup = std::make_unique<std::condition_variable>();
+            pool.m_tasks.clear();
+            pool.m_mutex.unlock();
+        });
+    (void)atfork;
+    return pool;
+}
+
+size_t ThreadPool::size() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_workers->size();
+}
+
+void ThreadPool::grow(size_t num_workers)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    while (m_workers->size() < num_workers)
+    {
+        m_workers->emplace_back([this] { worker_loop(); });
+    }
+}
+
+void ThreadPool::worker_loop()
+{
+    for (;;)
+    {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_wakeup->wait(lock, [this] { return m_stop || !m_tasks.empty(); });
+            if (m_stop && m_tasks.empty())
+            {
+                return;
+            }
+            task = std::move(m_tasks.front());
+            m_tasks.pop_front();
+        }
+        task();
+    }
+}
+
+/**
+ * Items are claimed one at a time from a shared counter, so uneven inputs
+ * (one long document among short ones) still keep every thread busy. The
+ * caller works too and then waits for the helpers it queued.
+ */
+void ThreadPool::parallel_for(size_t count, size_t num_threads,
+                              const std::function<void(size_t)> &fn)
+{
+    if (num_threads == 0)
+    {
+        num_threads = std::max<size_t>(1, std::thread::hardware_concurrency());
+    }
+    num_threads = std::min(num_threads, count);
+    if (num_threads <= 1)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            fn(i);
+        }
+        return;
+    }
+
+    struct Job
+    {
+        std::atomic<size_t> next{0};
+        std::atomic<bool> failed{false};
+        std::exception_ptr error;
+        std::mutex mutex;
+        std::condition_variable done;
+        size_t helpers_left = 0;
+    };
+    auto job = std::make_shared<Job>();
+    job->helpers_left = num_threads - 1;
+
+    auto run = [job, count, &fn]()
+    {
+        for (size_t i; !job->failed.load(std::memory_order_relaxed) &&
+                       (i = job->next.fetch_add(1)) < count;)
+        {
+            try
+            {
+                fn(i);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(job->mutex);
+                if (!job->error)
+                {
+                    job->error = std::current_exception();
+                }
+                job->failed = true;
+            }
+        }
+    };
+
+    grow(num_threads - 1);
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (size_t t = 0; t + 1 < num_threads; t++)
+        {
+            m_tasks.push_back([job, run]()
+                              {
+                                  run();
+                                  std::lock_guard<std::mutex> lock(job->mutex);
+                                  if (--job->helpers_left == 0)
+                                  {
+                                      job->done.notify_one();
+                                  }
+                              });
+        }
+    }
+    m_wakeup->notify_all();
+
+    run();
+    std::unique_lock<std::mutex> lock(job->mutex);
+    job->done.wait(lock, [&job] { return job->helpers_left == 0; });
+    if (job->error)
+    {
+        std::rethrow_exception(job->error);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                         BPE Wrapper Class                                 //
+///////////////////////////////////////////////////////////////////////////////
+
+// Whether to encode word by word, given the WordSplit option.
+static bool resolve_word_split(WordSplit word_split, const std::string &special_character,
+                               bool words_are_independent)
+{
+    return !special_character.empty() &&
+           (word_split == WordSplit::Always ||
+            (word_split == WordSplit::Auto && words_are_independent));
+}
+
+BPE::BPE(
+    const std::map<std::pair<std::string, std::string>, int> &bpe_ranks,
+    const std::map<std::string, int> &vocab,
+    const std::vector<std::string> &added_vocab,
+    const std::string &special_character,
+    const std::map<std::string, std::string> &token_replace_map,
+    const std::map<std::string, std::string> &reverse_tokens_replace_map,
+    BPEEngine engine,
+    size_t cache_capacity,
+    CachePolicy cache_policy,
+    WordSplit word_split,
+    const std::vector<int> &special_token_ids) : m_added_vocab_matcher(added_vocab),
+                        m_special_character(special_character),
+                        m_token_replace_map(token_replace_map),
+                        m_normalizer(special_character, token_replace_map),
+                        m_faster_bpe(bpe_ranks, vocab, added_vocab, engine),
+                        m_words_are_independent(!m_faster_bpe.merges_across(special_character)),
+                        m_split_words(resolve_word_split(word_split, special_character,
+                                                         m_words_are_independent)),
+                        m_word_cache(cache_capacity, cache_policy)
+{
+    build_decode_table(reverse_tokens_replace_map);
+
+    std::vector<uint64_t> special_bits;
+    for (int id : special_token_ids)
+    {
+        if (id < 0)
+        {
+            continue;
+        }
+        if ((size_t)id / 64 >= special_bits.size())
+        {
+            special_bits.resize(id / 64 + 1, 0);
+        }
+        special_bits[id / 64] |= uint64_t(1) << (id % 64);
+    }
+    m_special_bits = std::move(special_bits);
+}
+
+/**
+ * Decoded bytes of every ID, precomputed: the piece with
+ * reverse_tokens_replace_map applied and each special character turned
+ * into a space, exactly what decode used to do per token.
+ */
+void BPE::build_decode_table(const std::map<std::string, std::string> &reverse_tokens_replace_map)
+{
+    // Vocab IDs are the symbol IDs below the first synthetic one
+    const SymbolTable &symbols = m_faster_bpe.symbols();
+    const int max_id = std::min((int)symbols.size(), m_faster_bpe.first_synthetic_id()) - 1;
+    std::vector<std::string> decoded(max_id + 1);
+    for (int id = 0; id <= max_id; id++)
+    {
+        std::string token(symbols[id]);
+        if (symbols.find(token) != id)
+        {
+            continue; // unused ID
+        }
+        const auto replace_it = reverse_tokens_replace_map.find(token);
+        if (replace_it != reverse_tokens_replace_map.end())
+        {
+            token = replace_it->second;
+        }
+        std::string &bytes = decoded[id];
+        if (m_special_character.empty())
+        {
+            bytes = token;
+        }
+        else
+        {
+            size_t start = 0;
+            for (size_t pos; (pos = token.find(m_special_character, start)) != std::string::npos;)
+            {
+                bytes.append(token, start, pos - start);
+                bytes.push_back(' ');
+                start = pos + m_special_character.size();
+            }
+            bytes.append(token, start, std::string::npos);
+        }
+    }
+    m_decoded = StringTable(decoded);
+
+    // Byte-fallback pieces, "<0xHH>", for the streaming decoder
+    std::vector<int16_t> byte_fallback(max_id + 1, -1);
+    for (int id = 0; id <= max_id; id++)
+    {
+        const std::string_view piece = decoded_token(id);
+        if (piece.size() == 6 && piece.substr(0, 3) == "<0x" && piece[5] == '>' &&
+            std::isxdigit(static_cast<unsigned char>(piece[3])) &&
+            std::isxdigit(static_cast<unsigned char>(piece[4])))
+        {
+            byte_fallback[id] = (int16_t)std::stoi(std::string(piece.substr(3, 2)), nullptr, 16);
+        }
+    }
+    m_byte_fallback = std::move(byte_fallback);
+}
+
+std::string_view BPE::decoded_token(int id) const
+{
+    if (id < 0 || (size_t)id >= m_decoded.size())
+    {
+        return std::string_view();
+    }
+    return m_decoded[id];
+}
+
+std::map<std::string, size_t> BPE::memory_usage() const
+{
+    std::map<std::string, size_t> usage;
+    m_faster_bpe.memory_usage(usage);
+    m_added_vocab_matcher.memory_usage(usage);
+    usage["decode.decoded"] = m_decoded.memory_usage();
+    usage["decode.byte_fallback"] = m_byte_fallback.memory_usage();
+    usage["decode.special_bits"] = m_special_bits.memory_usage();
+    return usage;
+}
+
+std::string BPE::decode_ids(const int *ids, size_t count, bool skip_special_tokens) const
+{
+    // Size the output exactly, then copy each token's precomputed bytes
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (!(skip_special_tokens && is_special_token(ids[i])))
+        {
+            total += decoded_token(ids[i]).size();
+        }
+    }
+    std::string result(total, '\0');
+    char *out = result.data();
+    for (size_t i = 0; i < count; i++)
+    {
+        if (skip_special_tokens && is_special_token(ids[i]))
+        {
+            continue;
+        }
+        const std::string_view piece = decoded_token(ids[i]);
+        std::memcpy(out, piece.data(), piece.size());
+        out += piece.size();
+    }
+    return result;
+}
+
+std::string BPE::decode(const std::vector<int> &tokens, bool skip_special_tokens) const
+{
+    return decode_ids(tokens.data(), tokens.size(), skip_special_tokens);
+}
+
+std::vector<std::string> BPE::decode_batch(
+    const std::vector<std::vector<int>> &sequences,
+    bool skip_special_tokens,
+    size_t num_threads) const
+{
+    std::vector<std::string> results(sequences.size());
+    ThreadPool::instance().parallel_for(
+        sequences.size(), num_threads,
+        [&](size_t i)
+        {
+            results[i] = decode_ids(sequences[i].data(), sequences[i].size(), skip_special_tokens);
+        });
+    return results;
+}
+
+std::vector<std::string> BPE::decode_batch(
+    const int *ids,
+    const int64_t *offsets,
+    size_t count,
+    bool skip_special_tokens,
+    size_t num_threads) const
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        if (offsets[i] < 0 || offsets[i] > offsets[i + 1])
+        {
+            throw std::invalid_argument("decode_batch: offsets must be non-negative and non-decreasing");
+        }
+    }
+    std::vector<std::string> results(count);
+    ThreadPool::instance().parallel_for(
+        count, num_threads,
+        [&](size_t i)
+        {
+            results[i] = decode_ids(ids + offsets[i], offsets[i + 1] - offsets[i], skip_special_tokens);
+        });
+    return results;
+}
+
+/**
+ * A word starts at every symbol that begins with the special character
+ * ("▁") unless the previous symbol already ends with it, so runs of
+ * spaces stay attached to the word that follows them.
+ */
+bool BPE::starts_word(const SymbolStream &symbols, size_t i) const
+{
+    if (i == 0)
+    {
+        return true;
+    }
+    const std::string_view sc = m_special_character;
+    const std::string_view cur = symbols.symbol(i);
+    const std::string_view prev = symbols.symbol(i - 1);
+    if (cur.substr(0, sc.size()) != sc)
+    {
+        return false;
+    }
+    return prev.size() < sc.size() || prev.substr(prev.size() - sc.size()) != sc;
+}
+
+/**
+ * Pre-tokenization stage: runs BPE on every word of `symbols` on its own and
+ * appends the IDs to `out`. Words made of single codepoints go through
+ * m_word_cache (keyed by their text) when it is on; a word holding an
+ * added-vocab match can split differently elsewhere, so it is never cached.
+ */
+void BPE::encode_words(const SymbolStream &symbols, float alpha,
+                       std::vector<int> &out)
+{
+    // BPE-dropout is random, so those calls never touch the cache
+    const bool use_cache = alpha <= 0.0f && m_word_cache.enabled();
+
+    thread_local std::vector<int> symbol_ids;
+
+    size_t begin = 0;
+    while (begin < symbols.size())
+    {
+        size_t end = begin + 1;
+        while (end < symbols.size() && !starts_word(symbols, end))
+        {
+            end++;
+        }
+
+        // Symbols are contiguous, so the word is a view into the stream
+        const std::string_view word = symbols.span(begin, end);
+        bool cacheable = use_cache;
+        for (size_t i = begin; i < end && cacheable; i++)
+        {
+            const std::string_view symbol = symbols.symbol(i);
+            cacheable = symbol.size() == utf8_char_length(symbol[0]);
+        }
+        if (cacheable && m_word_cache.lookup(word, out))
+        {
+            begin = end;
+            continue;
+        }
+
+        symbol_ids.clear();
+        for (size_t i = begin; i < end; i++)
+        {
+            symbol_ids.push_back(m_faster_bpe.symbol_id(symbols.symbol(i)));
+        }
+        const size_t word_start = out.size();
+        m_faster_bpe.encode_ids(symbol_ids.data(), symbol_ids.size(), alpha, out);
+        if (cacheable)
+        {
+            m_word_cache.insert(word, out.data() + word_start, out.size() - word_start);
+        }
+        begin = end;
+    }
+}
+
+// Final BPE stage of encode: token IDs of the normalized, added-vocab
+// merged `symbols`, appended to `out`.
+void BPE::encode_symbols(const SymbolStream &symbols, float alpha, std::vector<int> &out)
+{
+    if (m_split_words)
+    {
+        encode_words(symbols, alpha, out);
+        return;
+    }
+
+    thread_local std::vector<int> symbol_ids;
+    symbol_ids.clear();
+    for (size_t i = 0; i < symbols.size(); i++)
+    {
+        symbol_ids.push_back(m_faster_bpe.symbol_id(symbols.symbol(i)));
+    }
+    m_faster_bpe.encode_ids(symbol_ids.data(), symbol_ids.size(), alpha, out);
+}
+
+// Main encode function:
+//  1) Replace space -> "▁"
+//  2) Split into full UTF-8 chars
+//  3) Merge 'added_vocab'
+//  4) Run faster BPE merges (word by word unless word_split is Never)
+//  5) Return final token IDs (or subwords when tokenize is false)
+std::variant<std::vector<std::string>, std::vector<int>> BPE::encode(
+    const std::string &text,
+    float alpha,
+    bool tokenize)
+{
+    // 1-3) Replace spaces with "▁", apply m_token_replace_map and split
+    //      into full UTF-8 chars, in one pass
+    thread_local SymbolStream symbols;
+    m_normalizer.normalize(text, symbols);
+
+    // 4) Merge user-specified vocabulary first
+    m_added_vocab_matcher.merge(symbols);
+
+    // 5) Run the faster BPE merges (SentencePiece style). Token IDs come
+    //    straight out of the integer engine; unknown pieces map to 0.
+    if (tokenize)
+    {
+        std::vector<int> token_ids;
+        token_ids.reserve(symbols.size());
+        encode_symbols(symbols, alpha, token_ids);
+        return token_ids;
+    }
+
+    if (!m_split_words)
+    {
+        return m_faster_bpe.run_faster_bpe(symbols.strings(0, symbols.size()), alpha);
+    }
+    std::vector<std::string> pieces;
+    pieces.reserve(symbols.size());
+    for (size_t begin = 0, end; begin < symbols.size(); begin = end)
+    {
+        end = begin + 1;
+        while (end < symbols.size() && !starts_word(symbols, end))
+        {
+            end++;
+        }
+        for (auto &piece : m_faster_bpe.run_faster_bpe(symbols.strings(begin, end), alpha))
+        {
+            pieces.push_back(std::move(piece));
+        }
+    }
+    return pieces;
+}
+
+/**
+ * Batch version of encode (token IDs only). Each text is encoded exactly as
+ * encode would, on the shared ThreadPool; the word cache is shared by all
+ * threads.
+ */
+std::vector<std::vector<int>> BPE::encode_batch(
+    const std::vector<std::string> &texts,
+    size_t num_threads,
+    float alpha)
+{
+    std::vector<std::vector<int>> results(texts.size());
+    ThreadPool::instance().parallel_for(
+        texts.size(), num_threads,
+        [&](size_t i)
+        {
+            results[i] = std::get<std::vector<int>>(encode(texts[i], alpha, true));
+        });
+    return results;
+}
+
+/**
+ * Concatenates per-text results into `ids` (int or uint16_t) at their
+ * prefix-sum offsets, copying in parallel.
+ */
+template <typename T>
+static void flatten_results(const std::vector<std::vector<int>> &results,
+                            std::vector<T> &ids,
+                            std::vector<int64_t> &offsets,
+                            size_t num_threads)
+{
+    offsets.assign(results.size() + 1, 0);
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        offsets[i + 1] = offsets[i] + (int64_t)results[i].size();
+    }
+    ids.resize(offsets.back());
+    ThreadPool::instance().parallel_for(
+        results.size(), num_threads,
+        [&](size_t i)
+        {
+            std::copy(results[i].begin(), results[i].end(), ids.begin() + offsets[i]);
+        });
+}
+
+/**
+ * Flat version of encode_batch for zero-copy consumers: every result is
+ * copied once into `ids`, in parallel, at its prefix-sum offset.
+ */
+void BPE::encode_batch_flat(
+    const std::vector<std::string> &texts,
+    std::vector<int> &ids,
+    std::vector<int64_t> &offsets,
+    size_t num_threads,
+    float alpha)
+{
+    flatten_results(encode_batch(texts, num_threads, alpha), ids, offsets, num_threads);
+}
+
+void BPE::require_uint16() const
+{
+    if (!fits_uint16())
+    {
+        throw std::runtime_error("Model has token IDs up to " + std::to_string(max_token_id()) +
+                                 ", which do not fit in uint16; use int32 IDs");
+    }
+}
+
+/**
+ * Token IDs of `text` in a per-thread vector, valid until the next call on
+ * this thread. Every buffer involved is thread_local, so warm calls do not
+ * allocate.
+ */
+const std::vector<int> &BPE::encode_scratch(const std::string &text, float alpha)
+{
+    thread_local SymbolStream symbols;
+    m_normalizer.normalize(text, symbols);
+    m_added_vocab_matcher.merge(symbols);
+
+    thread_local std::vector<int> token_ids;
+    token_ids.clear();
+    encode_symbols(symbols, alpha, token_ids);
+    return token_ids;
+}
+
+std::vector<uint16_t> BPE::encode_uint16(const std::string &text, float alpha)
+{
+    require_uint16();
+    const std::vector<int> &token_ids = encode_scratch(text, alpha);
+    return std::vector<uint16_t>(token_ids.begin(), token_ids.end());
+}
+
+size_t BPE::encode_into(const std::string &text, int *out, size_t capacity, float alpha)
+{
+    const std::vector<int> &token_ids = encode_scratch(text, alpha);
+    std::copy_n(token_ids.begin(), std::min(capacity, token_ids.size()), out);
+    return token_ids.size();
+}
+
+size_t BPE::encode_into(const std::string &text, uint16_t *out, size_t capacity, float alpha)
+{
+    require_uint16();
+    const std::vector<int> &token_ids = encode_scratch(text, alpha);
+    std::copy_n(token_ids.begin(), std::min(capacity, token_ids.size()), out);
+    return token_ids.size();
+}
+
+void BPE::encode_batch_flat(
+    const std::vector<std::string> &texts,
+    std::vector<uint16_t> &ids,
+    std::vector<int64_t> &offsets,
+    size_t num_threads,
+    float alpha)
+{
+    require_uint16();
+    flatten_results(encode_batch(texts, num_threads, alpha), ids, offsets, num_threads);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                          Compiled Model Format                            //
+///////////////////////////////////////////////////////////////////////////////
+//
+// A compiled model is a fixed header followed by a sequence of arrays, each
+// written as [uint64 count][uint64 element size][elements], padded to 8
+// bytes. Arrays start 8-byte aligned in the file, and mmap returns page
+// aligned memory, so loading only checks sizes and points each FlatArray at
+// its elements. Arrays are read back in the order they were written.
+// Bump kModelVersion whenever that order or any element layout changes.
+//
+// The header also holds a checksum of everything after it. The tables are
+// trusted once loaded (IDs, offsets and automaton targets index other
+// tables unchecked), so load_compiled verifies it; attach skips it for a
+// sealed memfd, which only share() can have written.
+
+static const char kModelMagic[8] = {'A', 'D', 'A', 'P', 'T', 'B', 'P', 'E'};
+static const uint32_t kModelVersion = 3;
+static const uint32_t kModelByteOrder = 0x01020304; // reads differently on a foreign-endian host
+
+struct ModelHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t size;     // of the whole file, to catch truncation
+    uint64_t checksum; // FNV-1a of the bytes after the header
+};
+
+class ModelWriter
+{
+public:
+    ModelWriter()
+    {
+        ModelHeader header{};
+        std::memcpy(header.magic, kModelMagic, sizeof(kModelMagic));
+        header.version = kModelVersion;
+        header.byte_order = kModelByteOrder;
+        append(&header, sizeof(header));
+    }
+
+    template <typename T>
+    void array(const T *data, size_t count)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "arrays are written as raw bytes");
+        const uint64_t prefix[2] = {count, sizeof(T)};
+        append(prefix, sizeof(prefix));
+        append(data, count * sizeof(T));
+        m_bytes.resize((m_bytes.size() + 7) & ~size_t(7), '\0');
+    }
+
+    template <typename T>
+    void array(const FlatArray<T> &values) { array(values.data(), values.size()); }
+
+    template <typename T>
+    void value(const T &v) { array(&v, 1); }
+
+    void string(std::string_view s) { array(s.data(), s.size()); }
+
+    void write(const std::string &path)
+    {
+        finish();
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        file.write(m_bytes.data(), (std::streamsize)m_bytes.size());
+        if (!file)
+        {
+            throw std::runtime_error("Cannot write compiled model: " + path);
+        }
+    }
+
+    std::string_view bytes()
+    {
+        finish();
+        return m_bytes;
+    }
+
+    void write(int fd)
+    {
+        finish();
+        for (size_t done = 0; done < m_bytes.size();)
+        {
+            const ssize_t n = ::write(fd, m_bytes.data() + done, m_bytes.size() - done);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                throw std::runtime_error("Cannot write compiled model to shared memory");
+            }
+            done += (size_t)n;
+        }
+    }
+
+private:
+    void finish()
+    {
+        const uint64_t size = m_bytes.size();
+        std::memcpy(&m_bytes[offsetof(ModelHeader, size)], &size, sizeof(size));
+        const uint64_t checksum = fnv1a(std::string_view(m_bytes).substr(sizeof(ModelHeader)));
+        std::memcpy(&m_bytes[offsetof(ModelHeader, checksum)], &checksum, sizeof(checksum));
+    }
+
+    void append(const void *data, size_t size)
+    {
+        m_bytes.append(static_cast<const char *>(data), size);
+    }
+
+    std::string m_bytes;
+};
+
+class ModelReader
+{
+public:
+    ModelReader(const char *data, size_t size, bool verify)
+        : m_data(data), m_size(size), m_pos(sizeof(ModelHeader))
+    {
+        ModelHeader header;
+        if (size < sizeof(header))
+        {
+            throw std::runtime_error("Not a compiled BPE model (file too small)");
+        }
+        std::memcpy(&header, data, sizeof(header));
+        if (std::memcmp(header.magic, kModelMagic, sizeof(kModelMagic)) != 0)
+        {
+            throw std::runtime_error("Not a compiled BPE model (bad magic)");
+        }
+        if (header.byte_order != kModelByteOrder)
+        {
+            throw std::runtime_error("Compiled BPE model was written on a host with another byte order");
+        }
+        if (header.version != kModelVersion)
+        {
+            throw std::runtime_error("Compiled BPE model has format version " +
+                                     std::to_string(header.version) + ", expected " +
+                                     std::to_string(kModelVersion) + "; recompile it");
+        }
+        if (header.size != size)
+        {
+            throw std::runtime_error("Compiled BPE model is truncated");
+        }
+        if (verify && header.checksum != fnv1a(std::string_view(data, size).substr(sizeof(header))))
+        {
+            throw std::runtime_error("Compiled BPE model is corrupt (checksum mismatch)");
+        }
+    }
+
+    template <typename T>
+    FlatArray<T> array()
+    {
+        uint64_t prefix[2];
+        if (m_size - m_pos < sizeof(prefix))
+        {
+            throw std::runtime_error("Compiled BPE model is truncated");
+        }
+        std::memcpy(prefix, m_data + m_pos, sizeof(prefix));
+        m_pos += sizeof(prefix);
+        if (prefix[1] != sizeof(T))
+        {
+            throw std::runtime_error("Compiled BPE model is corrupt (unexpected element size)");
+        }
+        if (prefix[0] > (m_size - m_pos) / sizeof(T))
+        {
+            throw std::runtime_error("Compiled BPE model is truncated");
+        }
+        const T *data = reinterpret_cast<const T *>(m_data + m_pos);
+        m_pos = std::min(m_size, m_pos + ((prefix[0] * sizeof(T) + 7) & ~uint64_t(7)));
+        return FlatArray<T>::view(data, prefix[0]);
+    }
+
+    template <typename T>
+    T value()
+    {
+        const FlatArray<T> values = array<T>();
+        if (values.size() != 1)
+        {
+            throw std::runtime_error("Compiled BPE model is corrupt (expected a single value)");
+        }
+        return values[0];
+    }
+
+    std::string string()
+    {
+        const FlatArray<char> chars = array<char>();
+        return std::string(chars.data(), chars.size());
+    }
+
+private:
+    const char *m_data;
+    size_t m_size;
+    size_t m_pos;
+};
+
+// Throws unless `count` is a usable open-addressing table size.
+static void check_table_size(size_t count)
+{
+    if (count != 0 && (count & (count - 1)) != 0)
+    {
+        throw std::runtime_error("Compiled BPE model is corrupt (hash table size)");
+    }
+}
+
+/**
+ * Read-only, shared mapping of a whole file or memfd. Pages come from the
+ * page cache (or the memfd's shared memory), so every process mapping the
+ * same model shares one copy.
+ */
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::string &path)
+    {
+        const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            throw std::runtime_error("Cannot open compiled model: " + path);
+        }
+        try
+        {
+            map(fd, path);
+        }
+        catch (...)
+        {
+            ::close(fd);
+            throw;
+        }
+        ::close(fd); // the mapping keeps the file open
+    }
+
+    // Maps `fd` without taking ownership of it.
+    explicit MappedFile(int fd)
+    {
+        map(fd, "fd " + std::to_string(fd));
+    }
+
+    ~MappedFile()
+    {
+        ::munmap(const_cast<char *>(m_data), m_size);
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    const char *data() const { return m_data; }
+    size_t size() const { return m_size; }
+
+private:
+    void map(int fd, const std::string &name)
+    {
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || st.st_size <= 0)
+        {
+            throw std::runtime_error("Not a compiled BPE model (empty file): " + name);
+        }
+        m_size = (size_t)st.st_size;
+        void *data = ::mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            throw std::runtime_error("Cannot map compiled model: " + name);
+        }
+        m_data = static_cast<const char *>(data);
+    }
+
+    const char *m_data = nullptr;
+    size_t m_size = 0;
+};
+
+void StringTable::save(ModelWriter &out) const
+{
+    out.array(m_chars);
+    out.array(m_offsets);
+}
+
+void StringTable::load(ModelReader &in)
+{
+    m_chars = in.array<char>();
+    m_offsets = in.array<uint32_t>();
+    if (!m_offsets.empty() && (m_offsets[0] != 0 || m_offsets[m_offsets.size() - 1] > m_chars.size()))
+    {
+        throw std::runtime_error("Compiled BPE model is corrupt (string table)");
+    }
+}
+
+void SymbolTable::save(ModelWriter &out) const
+{
+    m_pieces.save(out);
+    out.array(m_alias_ids);
+    out.array(m_slots);
+}
+
+void SymbolTable::load(ModelReader &in)
+{
+    m_pieces.load(in);
+    m_alias_ids = in.array<int32_t>();
+    m_slots = in.array<uint32_t>();
+    check_table_size(m_slots.size());
+    if (m_alias_ids.size() > m_pieces.size())
+    {
+        throw std::runtime_error("Compiled BPE model is corrupt (symbol table)");
+    }
+}
+
+template <typename V>
+void PairMap<V>::save(ModelWriter &out) const
+{
+    out.array(m_slots);
+    out.value<uint64_t>(m_size);
+}
+
+template <typename V>
+void PairMap<V>::load(ModelReader &in)
+{
+    m_slots = in.array<Slot>();
+    m_size = in.value<uint64_t>();
+    check_table_size(m_slots.size());
+}
+
+void AhoCorasick::save(ModelWriter &out) const
+{
+    out.array(m_root_edges);
+    m_edges.save(out);
+    out.array(m_fail);
+    out.array(m_word_at);
+    out.array(m_output_link);
+    out.array(m_depth);
+}
+
+void AhoCorasick::load(ModelReader &in)
+{
+    m_root_edges = in.array<int32_t>();
+    m_edges.load(in);
+    m_fail = in.array<int32_t>();
+    m_word_at = in.array<int32_t>();
+    m_output_link = in.array<int32_t>();
+    m_depth = in.array<int32_t>();
+    if (m_root_edges.size() != 256 || m_word_at.empty())
+    {
+        throw std::runtime_error("Compiled BPE model is corrupt (added vocab automaton)");
+    }
+}
+
+void AddedVocabMatcher::save(ModelWriter &out) const
+{
+    m_words.save(out);
+    m_automaton.save(out);
+}
+
+void AddedVocabMatcher::load(ModelReader &in)
+{
+    m_words.load(in);
+    m_automaton.load(in);
+}
+
+void FasterBPE::save(ModelWriter &out) const
+{
+    out.value<int32_t>(m_vocab_size);
+    m_symbols.save(out);
+    out.array(m_merge_rank);
+    out.array(m_ascii_symbol_ids.data(), m_ascii_symbol_ids.size());
+    m_merges.save(out);
+    out.value<int32_t>(m_first_synthetic_id);
+
+    out.value<int32_t>(static_cast<int32_t>(m_engine));
+    out.array(m_piece_rank);
+    out.array(m_piece_split);
+    out.array(m_next_prefix);
+    m_trie_edges.save(out);
+    out.array(m_trie_piece);
+}
+
+void FasterBPE::load(ModelReader &in)
+{
+    m_vocab_size = in.value<int32_t>();
+    m_symbols.load(in);
+    m_merge_rank = in.array<int32_t>();
+    if (m_merge_rank.size() != m_symbols.entries())
+    {
+        throw std::runtime_error("Compiled BPE model is corrupt (merge ranks)");
+    }
+    const FlatArray<int> ascii_symbol_ids = in.array<int>();
+    if (ascii_symbol_ids.size() != m_ascii_symbol_ids.size())
+    {
+        throw std::runtime_error("Compiled BPE model is corrupt (ASCII symbol table)");
+    }
+    std::copy(ascii_symbol_ids.begin(), ascii_symbol_ids.end(), m_ascii_symbol_ids.begin());
+    m_merges.load(in);
+    m_first_synthetic_id = in.value<int32_t>();
+    const size_t num_ids = m_symbols.size();
+    if (m_vocab_size < 0 || m_first_synthetic_id < 0 ||
+        std::any_of(m_ascii_symbol_ids.begin(), m_ascii_symbol_ids.end(),
+                    [num_ids](int id) { return id < -1 || id >= (int64_t)num_ids; }))
+    {
+        throw std::runtime_error("Compiled BPE model is corrupt (symbol IDs)");
+    }
+
+    const int32_t engine = in.value<int32_t>();
+    if (engine != (int32_t)BPEEngine::PriorityQueue && engine != (int32_t)BPEEngine::Backtracking)
+    {
+        throw std::runtime_error("Compiled BPE model is corrupt (engine)");
+    }
+    m_engine = static_cast<BPEEngine>(engine);
+    m_piece_rank = in.array<int32_t>();
+    m_piece_split = in.array<IdPair>();
+    m_next_prefix = in.array<int32_t>();
+    m_trie_edges.load(in);
+    m_trie_piece = in.array<int32_t>();
+    // The backtracking tables are indexed by symbol ID; the trie has a root
+    const size_t engine_ids = (m_engine == BPEEngine::Backtracking) ? num_ids : 0;
+    if (m_piece_rank.size() != engine_ids || m_piece_split.size() != engine_ids ||
+        m_next_prefix.size() != engine_ids ||
+        (m_engine == BPEEngine::Backtracking && m_trie_piece.empty()))
+    {
+        throw std::runtime_error("Compiled BPE model is corrupt (backtracking tables)");
+    }
+}
+
+void BPE::save(ModelWriter &out) const
+{
+    out.string(m_special_character);
+    out.value<uint64_t>(m_token_replace_map.size());
+    for (const auto &[from, to] : m_token_replace_map)
+    {
+        out.string(from);
+        out.string(to);
+    }
+    m_added_vocab_matcher.save(out);
+    m_faster_bpe.save(out);
+    out.value<uint8_t>(m_words_are_independent);
+    m_decoded.save(out);
+    out.array(m_byte_fallback);
+    out.array(m_special_bits);
+}
+
+void BPE::compile(const std::string &path) const
+{
+    ModelWriter out;
+    save(out);
+    out.write(path);
+}
+
+uint64_t BPE::fingerprint() const
+{
+    ModelWriter out;
+    save(out);
+    return fnv1a(out.bytes());
+}
+
+int BPE::share() const
+{
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+    const int fd = ::memfd_create("adaptbpe-model", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0)
+    {
+        throw std::runtime_error("memfd_create failed: shared models need Linux 3.17 or later");
+    }
+    try
+    {
+        ModelWriter out;
+        save(out);
+        out.write(fd);
+    }
+    catch (...)
+    {
+        ::close(fd);
+        throw;
+    }
+    // Sealed, so no process can change the tables under another one's feet
+    ::fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+    return fd;
+#else
+    throw std::runtime_error("BPE::share needs memfd_create (Linux); use compile() and "
+                             "load_compiled() on a shared file instead");
+#endif
+}
+
+std::unique_ptr<BPE> BPE::attach(
+    int fd,
+    size_t cache_capacity,
+    CachePolicy cache_policy,
+    WordSplit word_split)
+{
+    // A sealed memfd comes from share() and cannot have changed since
+    bool verify = true;
+#if defined(__linux__) && defined(F_GET_SEALS)
+    const int seals = ::fcntl(fd, F_GET_SEALS);
+    verify = seals < 0 || !(seals & F_SEAL_WRITE);
+#endif
+    return std::unique_ptr<BPE>(new BPE(std::make_shared<const MappedFile>(fd), verify,
+                                        cache_capacity, cache_policy, word_split));
+}
+
+std::unique_ptr<BPE> BPE::load_compiled(
+    const std::string &path,
+    size_t cache_capacity,
+    CachePolicy cache_policy,
+    WordSplit word_split)
+{
+    return std::unique_ptr<BPE>(new BPE(std::make_shared<const MappedFile>(path), true,
+                                        cache_capacity, cache_policy, word_split));
+}
+
+/**
+ * Loading constructor: every table views the mapped file. Only the
+ * Normalizer is rebuilt, from the stored special character and replace map
+ * (it is a handful of entries).
+ */
+BPE::BPE(std::shared_ptr<const MappedFile> file,
+         bool verify,
+         size_t cache_capacity,
+         CachePolicy cache_policy,
+         WordSplit word_split) : m_word_cache(cache_capacity, cache_policy),
+                                 m_file(std::move(file))
+{
+    ModelReader in(m_file->data(), m_file->size(), verify);
+    m_special_character = in.string();
+    const uint64_t replacements = in.value<uint64_t>();
+    for (uint64_t i = 0; i < replacements; i++)
+    {
+        std::string from = in.string();
+        m_token_replace_map[from] = in.string();
+    }
+    m_normalizer = Normalizer(m_special_character, m_token_replace_map);
+    m_added_vocab_matcher.load(in);
+    m_faster_bpe.load(in);
+    m_words_are_independent = in.value<uint8_t>() != 0;
+    m_split_words = resolve_word_split(word_split, m_special_character, m_words_are_independent);
+    m_decoded.load(in);
+    m_byte_fallback = in.array<int16_t>();
+    m_special_bits = in.array<uint64_t>();
+    // Same size as build_decode_table makes them: one entry per vocab ID
+    const size_t num_decoded = std::min(m_faster_bpe.symbols().size(),
+                                        (size_t)m_faster_bpe.first_synthetic_id());
+    if (m_decoded.size() != num_decoded || m_byte_fallback.size() != num_decoded)
+    {
+        throw std::runtime_error("Compiled BPE model is corrupt (decode table)");
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                      Pretrained Loader (tokenizer.json)                   //
+///////////////////////////////////////////////////////////////////////////////
+
+static std::string join_path(const std::string &dir, const std::string &name)
+{
+    if (dir.empty() || dir.back() == '/')
+    {
+        return dir + name;
+    }
+    return dir + "/" + name;
+}
+
+static bool file_exists(const std::string &path)
+{
+    struct stat st;
+    return ::stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+}
+
+template <typename Json>
+static Json read_json_file(const std::string &path)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+    {
+        throw std::runtime_error("Cannot open " + path);
+    }
+    try
+    {
+        return Json::parse(file);
+    }
+    catch (const std::exception &e)
+    {
+        throw std::runtime_error("Cannot parse " + path + ": " + e.what());
+    }
+}
+
+// ASCII whitespace trimmed from both ends.
+static std::string_view strip(std::string_view s)
+{
+    const char *whitespace = " \t\n\r\f\v";
+    const size_t begin = s.find_first_not_of(whitespace);
+    if (begin == std::string_view::npos)
+    {
+        return std::string_view();
+    }
+    return s.substr(begin, s.find_last_not_of(whitespace) - begin + 1);
+}
 
-    for (int i = 0; i + 1 < (int)symbols.size(); i++)
+/**
+ * added_vocab.txt: one word per line (stripped, blank lines skipped).
+ * added_vocab.json: a list of words, or an object keyed by them.
+ */
+static std::vector<std::string> read_added_vocab(const std::string &dir)
+{
+    std::vector<std::string> words;
+    const std::string txt_path = join_path(dir, "added_vocab.txt");
+    const std::string json_path = join_path(dir, "added_vocab.json");
+    if (file_exists(txt_path))
+    {
+        std::ifstream file(txt_path, std::ios::binary);
+        std::string line;
+        while (std::getline(file, line))
+        {
+            const std::string_view word = strip(line);
+            if (!word.empty())
+            {
+                words.emplace_back(word);
+            }
+        }
+    }
+    else if (file_exists(json_path))
     {
-        MaybeAddNewSymbolPair(i, i + 1, symbols, agenda, symbol_pair_alloc);
+        const nlohmann::ordered_json added = read_json_file<nlohmann::ordered_json>(json_path);
+        if (added.is_array())
+        {
+            for (auto &word : added)
+            {
+                words.push_back(word.get<std::string>());
+            }
+        }
+        else if (added.is_object())
+        {
+            for (auto it = added.begin(); it != added.end(); ++it)
+            {
+                words.push_back(it.key());
+            }
+        }
+        else
+        {
+            throw std::invalid_argument(json_path + ": expected a list of words or an object");
+        }
     }
+    return words;
+}
 
-    // 3) BPE-dropout logic
-    auto skip_merge = [&](std::mt19937 &rng)
+std::unique_ptr<BPE> BPE::from_pretrained(
+    const std::string &path,
+    const std::vector<std::string> &added_vocab,
+    const std::string &special_character,
+    const std::map<std::string, std::string> &token_replace_map,
+    BPEEngine engine,
+    size_t cache_capacity,
+    CachePolicy cache_policy,
+    WordSplit word_split)
+{
+    // Special tokens in first-seen order: the config's, then tokenizer.json's
+    std::vector<std::pair<std::string, int>> special_tokens;
+    std::unordered_map<std::string, size_t> special_index;
+    std::map<std::string, int> vocab;
+    auto add_token = [&](const std::string &content, int id, bool special)
     {
-        if (alpha <= 0.0f)
-            return false;
-        if (alpha >= 1.0f)
-            return true;
-        std::uniform_real_distribution<> dist(0.0, 1.0);
-        return (dist(rng) < alpha);
+        if (!special)
+        {
+            vocab[content] = id;
+            return;
+        }
+        auto it = special_index.emplace(content, special_tokens.size());
+        if (it.second)
+        {
+            special_tokens.push_back({content, id});
+        }
+        else
+        {
+            special_tokens[it.first->second].second = id;
+        }
     };
-    std::random_device rd;
-    std::mt19937 rng(rd());
 
-    // 4) Repeatedly pop top pair, merge it, add new pairs
-    while (!agenda.empty())
+    const std::string config_path = join_path(path, "tokenizer_config.json");
+    if (file_exists(config_path))
     {
-        SymbolPair *top = agenda.top();
-        agenda.pop();
+        // ordered_json keeps added_tokens_decoder in file order
+        const nlohmann::ordered_json config = read_json_file<nlohmann::ordered_json>(config_path);
+        const auto decoder = config.find("added_tokens_decoder");
+        if (decoder != config.end())
+        {
+            for (auto it = decoder->begin(); it != decoder->end(); ++it)
+            {
+                add_token(it.value().at("content").get<std::string>(), std::stoi(it.key()),
+                          it.value().value("special", false));
+            }
+        }
+    }
 
-        int L = top->left;
-        int R = top->right;
-        if (L < 0 || R < 0)
-            continue;
+    const std::string tokenizer_path = join_path(path, "tokenizer.json");
+    if (!file_exists(tokenizer_path))
+    {
+        throw std::runtime_error("Tokenizer file not found at: " + tokenizer_path);
+    }
+    const nlohmann::json tokenizer = read_json_file<nlohmann::json>(tokenizer_path);
+    const auto added_tokens = tokenizer.find("added_tokens");
+    if (added_tokens != tokenizer.end() && added_tokens->is_array())
+    {
+        for (auto &token : *added_tokens)
+        {
+            add_token(token.at("content").get<std::string>(), token.at("id").get<int>(),
+                      token.value("special", false));
+        }
+    }
 
-        // Check if stale: maybe symbol was merged away
-        if (symbols[L].piece.empty() || symbols[R].piece.empty())
+    const nlohmann::json &model = tokenizer.at("model");
+    const nlohmann::json &model_vocab = model.at("vocab");
+    for (auto it = model_vocab.begin(); it != model_vocab.end(); ++it)
+    {
+        vocab[it.key()] = it.value().get<int>();
+    }
+
+    // Merges are either "left right" strings or [left, right] pairs; the
+    // rank is the position in the list
+    std::map<std::pair<std::string, std::string>, int> bpe_ranks;
+    const nlohmann::json &merges = model.at("merges");
+    for (size_t i = 0; i < merges.size(); i++)
+    {
+        const nlohmann::json &merge = merges[i];
+        if (merge.is_string())
         {
-            continue;
+            const std::string &pair = merge.get_ref<const std::string &>();
+            const size_t space = pair.find(' ');
+            if (space == std::string::npos)
+            {
+                throw std::invalid_argument(tokenizer_path + ": merge \"" + pair + "\" is not \"left right\"");
+            }
+            bpe_ranks[{pair.substr(0, space), pair.substr(space + 1)}] = (int)i;
         }
-        size_t expected_len = symbols[L].piece.size() + symbols[R].piece.size();
-        if (expected_len != top->size)
+        else if (merge.is_array() && merge.size() == 2)
         {
-            continue; // stale
+            bpe_ranks[{merge[0].get<std::string>(), merge[1].get<std::string>()}] = (int)i;
         }
-        // skip merge with probability alpha
-        if (skip_merge(rng))
+        else
         {
-            continue;
+            throw std::invalid_argument(tokenizer_path + ": merge #" + std::to_string(i) +
+                                        " is neither \"left right\" nor [left, right]");
         }
+    }
 
-        // Actually merge them
-        symbols[L].piece += symbols[R].piece;
-        symbols[R].piece.clear();
+    std::vector<std::string> words = read_added_vocab(path);
+    std::vector<int> special_token_ids;
+    for (auto &[content, id] : special_tokens)
+    {
+        vocab[content] = id;
+        words.push_back(content);
+        special_token_ids.push_back(id);
+    }
+    words.insert(words.end(), added_vocab.begin(), added_vocab.end());
+    std::map<std::string, std::string> reverse_tokens_replace_map;
+    for (auto &[from, to] : token_replace_map)
+    {
+        words.push_back(to);
+        reverse_tokens_replace_map[to] = from;
+    }
 
-        // fix next/prev pointers
-        int leftPrev = symbols[L].prev;
-        int rightNext = symbols[R].next;
+    return std::make_unique<BPE>(bpe_ranks, vocab, words, special_character, token_replace_map,
+                                 reverse_tokens_replace_map, engine, cache_capacity, cache_policy,
+                                 word_split, special_token_ids);
+}
 
-        symbols[L].next = rightNext;
-        if (rightNext != -1)
+///////////////////////////////////////////////////////////////////////////////
+//                        Streaming Encoder                                  //
+///////////////////////////////////////////////////////////////////////////////
+
+EncodeStream::EncodeStream(BPE &bpe)
+    : m_bpe(bpe),
+      m_incremental(bpe.m_split_words && bpe.m_normalizer.per_char())
+{
+    reset();
+}
+
+/**
+ * Normalizes m_raw onto m_symbols. A trailing UTF-8 sequence that is still
+ * missing continuation bytes stays in m_raw (a token_replace_map key could
+ * be split otherwise) unless this is the end of the text.
+ */
+void EncodeStream::normalize_raw(bool final)
+{
+    size_t keep = 0;
+    const size_t size = m_raw.size();
+    for (size_t back = 1; back <= 3 && back <= size && !final; back++)
+    {
+        const unsigned char c = static_cast<unsigned char>(m_raw[size - back]);
+        if ((c & 0xC0) == 0x80)
         {
-            symbols[rightNext].prev = L;
+            continue; // continuation byte, look further back for the lead
         }
-
-        // Possibly re-add new pairs
-        // (leftPrev, L) and (L, rightNext)
-        if (leftPrev != -1)
+        const size_t len = utf8_char_length(m_raw[size - back]);
+        if (c >= 0xC0 && len > back)
         {
-            MaybeAddNewSymbolPair(leftPrev, L, symbols, agenda, symbol_pair_alloc);
+            keep = back; // lead byte whose sequence is not complete yet
         }
-        if (rightNext != -1)
+        break;
+    }
+    if (keep == 0)
+    {
+        append_normalized(m_raw);
+        m_raw.clear();
+    }
+    else if (keep < size)
+    {
+        append_normalized(m_raw.substr(0, size - keep));
+        m_raw.erase(0, size - keep);
+    }
+    segment(final);
+}
+
+/**
+ * Normalizes `text` onto m_symbols. Char boundaries are those of the whole
+ * text: the normalizer's are reused when m_symbols ended on one, and the
+ * tail it may have split short is left to segment().
+ */
+void EncodeStream::append_normalized(const std::string &text)
+{
+    thread_local SymbolStream normalized;
+    m_bpe.m_normalizer.normalize(text, normalized);
+    if (m_symbols.bytes.size() + normalized.bytes.size() > std::numeric_limits<uint32_t>::max())
+    {
+        throw std::length_error("Word is too long to encode");
+    }
+
+    const uint32_t base = (uint32_t)m_symbols.bytes.size();
+    if (m_symbols.offsets.back() != base)
+    {
+        m_symbols.bytes += normalized.bytes;
+        return;
+    }
+    const size_t old_count = m_symbols.size();
+    m_symbols.bytes += normalized.bytes;
+    for (size_t i = 1; i < normalized.offsets.size(); i++)
+    {
+        m_symbols.offsets.push_back(base + normalized.offsets[i]);
+    }
+
+    // A lead byte cut short by the end of `text` (invalid input, split
+    // into single bytes there) may still get its continuation bytes
+    const size_t end = m_symbols.bytes.size();
+    size_t t = m_symbols.size();
+    while (t > old_count && m_symbols.offsets[t - 1] + 3 >= end)
+    {
+        t--;
+    }
+    for (; t < m_symbols.size(); t++)
+    {
+        const uint32_t begin = m_symbols.offsets[t];
+        if (begin + utf8_char_length(m_symbols.bytes[begin]) > end)
         {
-            MaybeAddNewSymbolPair(L, rightNext, symbols, agenda, symbol_pair_alloc);
+            m_symbols.offsets.resize(t + 1);
+            break;
         }
     }
+}
 
-    // 5) Re-segmentation for any out-of-vocab merges
-    //    If a merged piece is "unused," we look up rev_merge to see how to break it.
-    std::function<void(const std::string &, std::vector<std::string> &)> resegment;
-    resegment = [&](const std::string &w, std::vector<std::string> &out)
+/**
+ * Splits the bytes of m_symbols past its last boundary into UTF-8 chars,
+ * exactly like utf8_char_ends on the whole text: a char whose sequence
+ * runs past the available bytes waits for more, or at the end of the text
+ * falls back to a single byte.
+ */
+void EncodeStream::segment(bool final)
+{
+    const std::string &bytes = m_symbols.bytes;
+    size_t i = m_symbols.offsets.back();
+    while (i < bytes.size())
     {
-        // Check if it's in vocab
-        int id = piece_to_id(w);
-        if (id == -1 || is_unused_inlined(id, m_vocab_size))
+        size_t len = utf8_char_length(bytes[i]);
+        if (i + len > bytes.size())
         {
-            // See if we can break it further
-            auto it = rev_merge.find(w);
-            if (it == rev_merge.end())
+            if (!final)
             {
-                // No info => just keep it
-                out.push_back(w);
-                return;
+                break;
             }
-            // break it
-            resegment(it->second.first, out);
-            resegment(it->second.second, out);
+            len = 1;
         }
-        else
+        i += len;
+        m_symbols.offsets.push_back((uint32_t)i);
+    }
+}
+
+/**
+ * Last symbol of m_symbols where the text can be cut without changing its
+ * tokens, or 0. That is a word start (see BPE::starts_word) that no
+ * occurrence of an added-vocab word crosses, with at least the longest
+ * such word's bytes after it, so later input cannot add one that does.
+ * The symbols are still unmerged chars; a merged symbol starts and ends
+ * with the same chars, so the word starts are those of encode.
+ */
+size_t EncodeStream::find_cut()
+{
+    const AddedVocabMatcher &matcher = m_bpe.m_added_vocab_matcher;
+    const size_t lookahead = matcher.max_word_length();
+    const uint32_t end = m_symbols.offsets.back();
+    matcher.mark_crossed(m_symbols, m_crossed);
+    for (size_t t = m_symbols.size(); t-- > 1;)
+    {
+        if (end - m_symbols.offsets[t] < lookahead)
         {
-            // in vocab => done
-            out.push_back(w);
+            continue;
         }
-    };
+        if (!m_crossed[t] && m_bpe.starts_word(m_symbols, t))
+        {
+            return t;
+        }
+    }
+    return 0;
+}
 
-    // Collect final pieces in order
-    std::vector<std::string> result;
-    result.reserve(symbols.size());
+// Encodes the first `count` symbols of m_symbols into `out` and drops them.
+void EncodeStream::encode_prefix(size_t count, std::vector<int> &out)
+{
+    const uint32_t cut = m_symbols.offsets[count];
+    m_head.bytes.assign(m_symbols.bytes, 0, cut);
+    m_head.offsets.assign(m_symbols.offsets.begin(), m_symbols.offsets.begin() + count + 1);
+    m_bpe.m_added_vocab_matcher.merge(m_head);
+    m_bpe.encode_words(m_head, 0.0f, out);
+
+    m_symbols.bytes.erase(0, cut);
+    m_symbols.offsets.erase(m_symbols.offsets.begin(), m_symbols.offsets.begin() + count);
+    for (uint32_t &offset : m_symbols.offsets)
+    {
+        offset -= cut;
+    }
+}
 
-    // Start from index 0
-    int cur_idx = 0;
-    while (cur_idx != -1 && cur_idx < (int)symbols.size())
+/**
+ * Cuts are only looked for once the held text has doubled since the last
+ * attempt, so a word longer than many chunks costs linear time overall.
+ */
+std::vector<int> EncodeStream::step(const std::string &text)
+{
+    std::vector<int> ids;
+    m_raw += text;
+    if (!m_incremental)
     {
-        if (!symbols[cur_idx].piece.empty())
-        {
-            resegment(symbols[cur_idx].piece, result);
-        }
-        cur_idx = symbols[cur_idx].next;
+        return ids;
+    }
+    normalize_raw(false);
+    if (m_symbols.bytes.size() < m_next_cut)
+    {
+        return ids;
+    }
+    const size_t cut = find_cut();
+    if (cut > 0)
+    {
+        encode_prefix(cut, ids);
+    }
+    m_next_cut = 2 * m_symbols.bytes.size();
+    return ids;
+}
+
+std::vector<int> EncodeStream::finish()
+{
+    std::vector<int> ids;
+    if (!m_incremental)
+    {
+        ids = std::get<std::vector<int>>(m_bpe.encode(m_raw));
     }
+    else
+    {
+        normalize_raw(true);
+        encode_prefix(m_symbols.size(), ids);
+    }
+    reset();
+    return ids;
+}
 
-    return result;
+void EncodeStream::reset()
+{
+    m_raw.clear();
+    m_symbols.clear();
+    m_next_cut = 0;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-//                         BPE Wrapper Class                                 //
+//                        Streaming Decoder                                  //
 ///////////////////////////////////////////////////////////////////////////////
 
-BPE::BPE(
-    const std::map<std::pair<std::string, std::string>, int> &bpe_ranks,
-    const std::map<std::string, int> &vocab,
-    const std::vector<std::string> &added_vocab,
-    const std::string &special_character,
-    const std::map<std::string, std::string> &token_replace_map,
-    const std::map<std::string, std::string> &reverse_tokens_replace_map) : m_bpe_ranks(bpe_ranks),
-                                                                            m_vocab(vocab),
-                                                                            m_reverse_vocab(),
-                                                                            m_added_vocab(added_vocab),
-                                                                            m_special_character(special_character),
-                                                                            m_token_replace_map(token_replace_map),
-                                                                            m_reverse_tokens_replace_map(reverse_tokens_replace_map),
-                                                                            m_faster_bpe(bpe_ranks, vocab)
+DecodeStream::DecodeStream(const BPE &bpe, bool skip_leading_space, bool byte_fallback,
+                           const std::vector<std::string> &stop_strings,
+                           const std::vector<int> &stop_ids)
+    : m_bpe(bpe),
+      m_skip_leading_space(skip_leading_space),
+      m_byte_fallback(byte_fallback),
+      m_stop_automaton(stop_strings),
+      m_stop_ids(stop_ids)
 {
-    // Build the reverse vocabulary map during initialization
-    for (const auto &[token, id] : m_vocab)
+    for (const std::string &stop : stop_strings)
     {
-        m_reverse_vocab[id] = token;
+        if (stop.empty())
+        {
+            throw std::invalid_argument("Stop strings must not be empty");
+        }
+        m_stop_lengths.push_back(stop.size());
     }
+    std::sort(m_stop_ids.begin(), m_stop_ids.end());
+    reset();
 }
 
-std::string BPE::decode(const std::vector<int> &tokens)
+void DecodeStream::append(int id)
 {
-    if (tokens.empty())
+    const size_t before = m_pending.size();
+    const int byte = m_byte_fallback ? m_bpe.byte_fallback(id) : -1;
+    if (byte >= 0)
     {
-        return "";
+        m_pending.push_back(static_cast<char>(byte));
     }
-
-    // Estimate initial capacity to avoid reallocations
-    std::string result;
-    result.reserve(tokens.size() * 8); // Reasonable estimate for token length
-
-    const bool has_special_char = !m_special_character.empty();
-    const size_t special_char_len = has_special_char ? m_special_character.length() : 0;
-    for (const int id : tokens)
+    else
     {
-        const auto it = m_reverse_vocab.find(id);
-        if (it == m_reverse_vocab.end() || it->second.empty())
-            continue;
-
-        std::string token = it->second;
+        m_pending.append(m_bpe.decoded_token(id));
+    }
 
-        // Check if the token is in the m_reverse_tokens_replace_map
-        const auto replace_it = m_reverse_tokens_replace_map.find(token);
-        if (replace_it != m_reverse_tokens_replace_map.end())
+    if (m_at_start && m_pending.size() > before)
+    {
+        m_at_start = false;
+        if (m_skip_leading_space && m_pending[before] == ' ')
         {
-            // Use the replacement value from the map
-            token = replace_it->second;
+            m_pending.erase(before, 1);
         }
+    }
+}
 
-        if (!has_special_char)
+/**
+ * Feeds the new bytes of m_pending to the stop automaton. On the first
+ * match, cuts m_pending at the start of the longest stop string ending
+ * there and returns true.
+ */
+bool DecodeStream::scan_stop_strings()
+{
+    if (m_stop_lengths.empty())
+    {
+        return false;
+    }
+    for (; m_scanned < m_pending.size(); m_scanned++)
+    {
+        m_stop_node = m_stop_automaton.step(m_stop_node, static_cast<unsigned char>(m_pending[m_scanned]));
+        const int out = m_stop_automaton.first_output(m_stop_node);
+        if (out == -1)
         {
-            // Fast path: no replacements needed
-            result.append(token);
             continue;
         }
+        // The first output is the longest stop string ending here
+        m_stop_string = m_stop_automaton.word_at(out);
+        const size_t cut = m_scanned + 1 - m_stop_lengths[m_stop_string];
+        m_pending.resize(cut);
+        m_stopped = true;
+        m_stop_position = m_returned + cut;
+        return true;
+    }
+    return false;
+}
 
-        // Process token with possible replacements
-        size_t start = 0;
-        size_t pos = token.find(m_special_character);
+std::string DecodeStream::take(size_t count)
+{
+    std::string done;
+    if (count == m_pending.size())
+    {
+        done.swap(m_pending);
+    }
+    else
+    {
+        done.assign(m_pending, 0, count);
+        m_pending.erase(0, count);
+    }
+    m_scanned -= std::min(m_scanned, count);
+    m_returned += done.size();
+    return done;
+}
 
-        if (pos == std::string::npos)
+/**
+ * Takes everything but a trailing UTF-8 sequence that is still missing
+ * continuation bytes and the tail that may grow into a stop string. Only
+ * the last 3 bytes are inspected for the former and the automaton depth
+ * gives the latter, so a step costs O(bytes decoded in it).
+ */
+std::string DecodeStream::take_complete()
+{
+    size_t keep = 0;
+    const size_t size = m_pending.size();
+    for (size_t back = 1; back <= 3 && back <= size; back++)
+    {
+        const unsigned char c = static_cast<unsigned char>(m_pending[size - back]);
+        if ((c & 0xC0) == 0x80)
         {
-            // No special character found
-            result.append(token);
+            continue; // continuation byte, look further back for the lead
         }
-        else
+        const size_t len = utf8_char_length(m_pending[size - back]);
+        if (c >= 0xC0 && len > back)
         {
-            // Process all special character occurrences
-            do
-            {
-                // Append segment before special character
-                result.append(token, start, pos - start);
-                // Add space instead of special character
-                result.push_back(' ');
-                // Move start position
-                start = pos + special_char_len;
-                // Find next occurrence
-                pos = token.find(m_special_character, start);
-            } while (pos != std::string::npos);
-
-            // Append remaining part after last special character
-            if (start < token.length())
-            {
-                result.append(token, start, token.length() - start);
-            }
+            keep = back; // lead byte whose sequence is not complete yet
         }
+        break;
     }
-
-    return result;
+    keep = std::max(keep, (size_t)m_stop_automaton.depth(m_stop_node));
+    return take(size - std::min(keep, size));
 }
 
-// Main encode function:
-//  1) Replace space -> "▁"
-//  2) Split into full UTF-8 chars
-//  3) Merge 'added_vocab'
-//  4) Run faster BPE merges
-//  5) Return final subwords
-std::variant<std::vector<std::string>, std::vector<int>> BPE::encode(
-    const std::string &text,
-    float alpha,
-    bool tokenize)
+/**
+ * Decodes one ID into m_pending; returns true if it ends the stream (a stop
+ * ID, or a stop string completed by its bytes).
+ */
+bool DecodeStream::feed(int id)
 {
-    // 1) Replace spaces with "▁"
-    std::string replaced = replace_spaces_with_underline(text, m_special_character);
-
-    // 2) Replace characters according to m_token_replace_map for consistency
-    for (const auto &[original, replacement] : m_token_replace_map)
+    if (std::binary_search(m_stop_ids.begin(), m_stop_ids.end(), id))
     {
-        size_t pos = 0;
-        while ((pos = replaced.find(original, pos)) != std::string::npos)
-        {
-            replaced.replace(pos, original.length(), replacement);
-            pos += replacement.length();
-        }
+        m_stopped = true;
+        m_stop_id = id;
+        m_stop_position = m_returned + m_pending.size();
+        return true;
     }
+    append(id);
+    return scan_stop_strings();
+}
 
-    // 3) Convert to full UTF-8 chars
-    std::vector<std::string> tokens = utf8_to_chars(replaced);
-
-    // 4) Merge user-specified vocabulary first
-    tokens = merge_added_vocab(tokens, m_added_vocab);
-
-    // 5) Run the faster BPE merges (SentencePiece style)
-    tokens = m_faster_bpe.run_faster_bpe(tokens, alpha);
-
-    // 6) Convert tokens to token IDs if tokenize is true
-    if (tokenize)
+std::string DecodeStream::step(const std::vector<int> &ids)
+{
+    if (m_stopped)
     {
-        std::vector<int> token_ids;
-        token_ids.reserve(tokens.size());
-
-        for (const auto &token : tokens)
+        return std::string();
+    }
+    for (int id : ids)
+    {
+        if (feed(id))
         {
-            auto it = m_vocab.find(token);
-            if (it != m_vocab.end())
-            {
-                token_ids.push_back(it->second);
-            }
-            else
-            {
-                // Handle unknown tokens with 0
-                token_ids.push_back(0);
-            }
+            return take(m_pending.size());
         }
+    }
+    return take_complete();
+}
 
-        return token_ids;
+std::string DecodeStream::step(int id)
+{
+    if (m_stopped)
+    {
+        return std::string();
     }
+    return feed(id) ? take(m_pending.size()) : take_complete();
+}
+
+std::string DecodeStream::finish()
+{
+    std::string rest = take(m_pending.size());
+    reset();
+    return rest;
+}
 
-    return tokens;
-}
\ No newline at end of file
+void DecodeStream::reset()
+{
+    m_pending.clear();
+    m_at_start = true;
+    m_returned = 0;
+    m_stop_node = 0;
+    m_scanned = 0;
+    m_stopped = false;
+    m_stop_position = 0;
+    m_stop_string = -1;
+    m_stop_id = -1;
+}
@@ -2,11 +2,241 @@
 #define BPE_HPP
 
 #include <map>
+#include <array>
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+#include <deque>
+#include <cstdint>
+#include <string_view>
 #include <string>
 #include <vector>
 #include <variant>
+#include <memory>
+#include <type_traits>
 #include <unordered_map>
 
+/**
+ * Merge engine used by BPE::encode when producing token IDs.
+ *
+ * - PriorityQueue: SentencePiece-style agenda of candidate pairs, O(n log n).
+ * - Backtracking:  linear-time encoder over a vocab trie that keeps only
+ *                  "compatible" token pairs. Same output as PriorityQueue;
+ *                  calls with alpha > 0 (BPE-dropout) and words containing
+ *                  an added-vocab match use PriorityQueue.
+ */
+enum class BPEEngine
+{
+    PriorityQueue,
+    Backtracking
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//                               Flat tables                                 //
+///////////////////////////////////////////////////////////////////////////////
+//
+// Every lookup table used at encode/decode time is one of the containers
+// below. Each holds a few contiguous arrays of plain values, which either
+// live in a std::vector (tables built by the constructor) or point straight
+// into a compiled model file mapped with mmap (BPE::load_compiled).
+
+class ModelWriter;
+class ModelReader;
+class MappedFile;
+
+/**
+ * Read-only array that owns its elements or views mapped memory.
+ */
+template <typename T>
+class FlatArray
+{
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "FlatArray elements are stored in model files as raw bytes");
+
+public:
+    FlatArray() = default;
+    FlatArray(std::vector<T> values)
+        : m_owned(std::move(values)), m_data(m_owned.data()), m_size(m_owned.size()) {}
+
+    FlatArray(const FlatArray &other) { *this = other; }
+    FlatArray(FlatArray &&other) noexcept { *this = std::move(other); }
+    FlatArray &operator=(const FlatArray &other)
+    {
+        m_owned = other.m_owned;
+        m_data = other.m_mapped ? other.m_data : m_owned.data();
+        m_size = other.m_size;
+        m_mapped = other.m_mapped;
+        return *this;
+    }
+    FlatArray &operator=(FlatArray &&other) noexcept
+    {
+        m_owned = std::move(other.m_owned);
+        m_data = other.m_mapped ? other.m_data : m_owned.data();
+        m_size = other.m_size;
+        m_mapped = other.m_mapped;
+        other.m_data = nullptr;
+        other.m_size = 0;
+        return *this;
+    }
+
+    static FlatArray view(const T *data, size_t size)
+    {
+        FlatArray array;
+        array.m_data = data;
+        array.m_size = size;
+        array.m_mapped = true;
+        return array;
+    }
+
+    const T &operator[](size_t i) const { return m_data[i]; }
+    const T *data() const { return m_data; }
+    const T *begin() const { return m_data; }
+    const T *end() const { return m_data + m_size; }
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+    size_t memory_usage() const { return m_size * sizeof(T); }
+
+private:
+    std::vector<T> m_owned;
+    const T *m_data = nullptr;
+    size_t m_size = 0;
+    bool m_mapped = false;
+};
+
+/**
+ * Dense index => string table: all strings back to back in one arena.
+ */
+class StringTable
+{
+public:
+    StringTable() = default;
+    explicit StringTable(const std::vector<std::string> &strings);
+
+    std::string_view operator[](size_t i) const
+    {
+        return std::string_view(m_chars.data() + m_offsets[i], m_offsets[i + 1] - m_offsets[i]);
+    }
+    size_t size() const { return m_offsets.empty() ? 0 : m_offsets.size() - 1; }
+    bool empty() const { return size() == 0; }
+    size_t memory_usage() const { return m_chars.memory_usage() + m_offsets.memory_usage(); }
+
+    void save(ModelWriter &out) const;
+    void load(ModelReader &in);
+
+private:
+    FlatArray<char> m_chars;
+    FlatArray<uint32_t> m_offsets; // size() + 1 entries
+};
+
+/**
+ * Interned symbol strings, both ways: ID => piece as a dense StringTable
+ * (one arena, empty for unused IDs) and piece => ID by open addressing
+ * (linear probing) over the same arena. Pieces that share an ID with
+ * another one (aliases) are appended after the dense part. Slots hold an
+ * entry index + 1 (0 is empty); the hash is FNV-1a so the slot layout is
+ * the same in every build.
+ */
+class SymbolTable
+{
+public:
+    SymbolTable() = default;
+    // Unique pieces, IDs >= 0. For an ID with several pieces, the one listed
+    // last is what operator[] returns.
+    explicit SymbolTable(const std::vector<std::pair<std::string, int>> &entries);
+
+    // ID of `piece`, or -1.
+    int find(std::string_view piece) const
+    {
+        const int entry = find_entry(piece);
+        return entry < 0 ? -1 : entry_id(entry);
+    }
+
+    // Piece of an ID below size() (empty for unused IDs).
+    std::string_view operator[](size_t id) const { return m_pieces[id]; }
+    size_t size() const { return m_pieces.size() - m_alias_ids.size(); }
+
+    // Every interned piece, aliases included, as entries [0, entries()):
+    // entry i < size() is ID i.
+    int find_entry(std::string_view piece) const; // or -1
+    size_t entries() const { return m_pieces.size(); }
+    std::string_view entry_piece(size_t entry) const { return m_pieces[entry]; }
+    int entry_id(size_t entry) const
+    {
+        return entry < size() ? (int)entry : m_alias_ids[entry - size()];
+    }
+
+    size_t memory_usage() const;
+
+    void save(ModelWriter &out) const;
+    void load(ModelReader &in);
+
+private:
+    StringTable m_pieces;           // size() dense pieces, then aliases
+    FlatArray<int32_t> m_alias_ids; // ID of each alias
+    FlatArray<uint32_t> m_slots;    // power of two, at most half full
+};
+
+/**
+ * uint64 => V hash table with open addressing; the all-ones key marks an
+ * empty slot (it packs the pair (-1, -1), which never merges).
+ */
+template <typename V>
+class PairMap
+{
+public:
+    struct Slot
+    {
+        uint64_t key;
+        V value;
+    };
+
+    PairMap() = default;
+    explicit PairMap(const std::vector<Slot> &entries); // unique keys
+
+    const V *find(uint64_t key) const
+    {
+        if (m_slots.empty())
+        {
+            return nullptr;
+        }
+        const size_t mask = m_slots.size() - 1;
+        for (size_t i = hash(key) & mask;; i = (i + 1) & mask)
+        {
+            const Slot &slot = m_slots[i];
+            if (slot.key == key)
+            {
+                return &slot.value;
+            }
+            if (slot.key == kEmpty)
+            {
+                return nullptr;
+            }
+        }
+    }
+
+    size_t size() const { return m_size; }
+    size_t memory_usage() const { return m_slots.memory_usage(); }
+
+    void save(ModelWriter &out) const;
+    void load(ModelReader &in);
+
+private:
+    static constexpr uint64_t kEmpty = ~uint64_t(0);
+    static uint64_t hash(uint64_t key)
+    {
+        // splitmix64 finalizer
+        key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        key = (key ^ (key >> 27)) * 0x94d049bb133111ebULL;
+        return key ^ (key >> 31);
+    }
+
+    FlatArray<Slot> m_slots;
+    size_t m_size = 0;
+};
+
 /**
  * Internal BPE engine used by the wrapper class below.
  *
@@ -16,16 +246,396 @@
 class FasterBPE
 {
 public:
+    FasterBPE() = default; // empty, filled by load()
     FasterBPE(const std::map<std::pair<std::string, std::string>, int> &bpe_ranks,
-              const std::map<std::string, int> &vocab);
+              const std::map<std::string, int> &vocab,
+              const std::vector<std::string> &added_vocab = {},
+              BPEEngine engine = BPEEngine::PriorityQueue);
 
     std::vector<std::string> run_faster_bpe(const std::vector<std::string> &tokens,
                                             float alpha = 0.0f) const;
 
+    /**
+     * Integer-ID variant of run_faster_bpe. `symbols` are symbol IDs as
+     * returned by symbol_id(); the result holds final vocab IDs (0 for
+     * pieces that are not in the vocabulary), so no string is built,
+     * hashed or looked up while merging.
+     */
+    std::vector<int> run_faster_bpe_ids(const std::vector<int> &symbols,
+                                        float alpha = 0.0f) const;
+
+    /**
+     * Linear-time equivalent of run_faster_bpe_ids (alpha == 0). Only
+     * available when constructed with BPEEngine::Backtracking.
+     */
+    std::vector<int> run_backtracking_bpe_ids(const std::vector<int> &symbols) const;
+
+    // Runs the engine selected at construction, appending final IDs to `out`.
+    void encode_ids(const int *symbols, size_t count, float alpha,
+                    std::vector<int> &out) const;
+
+    // True if some merged piece contains `boundary` right after a codepoint
+    // that is not part of a `boundary` run, i.e. a merge can join two words.
+    bool merges_across(const std::string &boundary) const;
+
+    // Symbol ID of a piece: its vocab ID, a synthetic ID (>= m_first_synthetic_id)
+    // for pieces that only occur inside merges, or -1 if it can never merge.
+    int symbol_id(std::string_view piece) const;
+
+    int vocab_size() const { return m_vocab_size; }
+
+    // Merges the engine can apply (both sides and the result are known symbols).
+    size_t merge_count() const { return m_merges.size(); }
+
+    // Interned pieces: vocab pieces under their vocab ID, then the synthetic ones.
+    const SymbolTable &symbols() const { return m_symbols; }
+    int first_synthetic_id() const { return m_first_synthetic_id; }
+
+    // Bytes used by each table, added to `usage` under "engine.<table>".
+    void memory_usage(std::map<std::string, size_t> &usage) const;
+
+    void save(ModelWriter &out) const;
+    void load(ModelReader &in);
+
+private:
+    struct MergeEntry
+    {
+        int32_t rank;
+        int32_t merged_id;
+    };
+    struct IdPair
+    {
+        int32_t first;
+        int32_t second;
+    };
+
+    static uint64_t pack_pair(int left_id, int right_id)
+    {
+        return (static_cast<uint64_t>(static_cast<uint32_t>(left_id)) << 32) |
+               static_cast<uint32_t>(right_id);
+    }
+
+    void merge_symbol_ids(const int *symbols, size_t count, float alpha,
+                          std::vector<int> &out, std::pair<int, int> *last_merge) const;
+    void backtrack_symbol_ids(const int *symbols, size_t count, std::vector<int> &out) const;
+    void build_backtracking_tables();
+    int longest_match(const std::string &text, size_t pos) const;
+    bool is_valid_token_pair(int left_id, int right_id) const;
+
+    // Vocab ID of a piece, or -1.
+    int vocab_id(std::string_view piece) const
+    {
+        const int id = m_symbols.find(piece);
+        return id < m_first_synthetic_id ? id : -1;
+    }
+    // Rank of the merge that produces `piece`, or -1.
+    int merge_rank(std::string_view piece) const
+    {
+        const int entry = m_symbols.find_entry(piece);
+        return entry < 0 ? -1 : m_merge_rank[entry];
+    }
+
+    int m_vocab_size = 0;
+
+    SymbolTable m_symbols;                               // piece <=> symbol ID
+    FlatArray<int32_t> m_merge_rank;                     // symbol entry => rank of the merge producing it, or -1
+    std::array<int, 128> m_ascii_symbol_ids{};           // single ASCII byte => symbol ID
+    PairMap<MergeEntry> m_merges;                        // (left_id, right_id) => (rank, merged_id)
+    int m_first_synthetic_id = 0;
+
+    // Backtracking engine tables, indexed by symbol ID (empty for PriorityQueue)
+    BPEEngine m_engine = BPEEngine::PriorityQueue;
+    FlatArray<int32_t> m_piece_rank;                  // merge rank, -1 for base pieces
+    FlatArray<IdPair> m_piece_split;                  // last merge that forms the piece
+    FlatArray<int32_t> m_next_prefix;                 // longest trie piece that is a strict prefix
+    PairMap<int32_t> m_trie_edges;                    // (node << 8 | byte) => child node
+    FlatArray<int32_t> m_trie_piece;                  // node => piece ending there, or -1
+};
+
+/**
+ * Pre-tokenization in BPE::encode: split the symbol stream into words
+ * before each run of the special character and run BPE per word.
+ *
+ * - Auto:   split only if no merge of the table can join two words, which
+ *           makes the output identical to encoding the whole text.
+ * - Always: split even when such merges exist (opt-in, output may differ).
+ * - Never:  run BPE over the whole text at once (disables the word cache).
+ */
+enum class WordSplit
+{
+    Auto,
+    Always,
+    Never
+};
+
+/**
+ * Eviction policy of the word cache.
+ *
+ * - LRU: evict the least recently used word.
+ * - LFU: evict the least frequently used word (ties: least recently used),
+ *        so a burst of rare words cannot flush the common ones.
+ */
+enum class CachePolicy
+{
+    LRU,
+    LFU
+};
+
+/**
+ * Bounded, thread-safe cache from a pre-split word to its token IDs.
+ * A capacity of 0 disables it. Words are spread by hash over shards with
+ * their own lock and their own share of the capacity, so threads encoding
+ * different words rarely wait on each other; eviction order is per shard.
+ */
+class WordCache
+{
+public:
+    explicit WordCache(size_t capacity = 0, CachePolicy policy = CachePolicy::LRU);
+
+    bool enabled() const { return m_capacity > 0; }
+
+    // Appends the cached IDs of `word` to `out`; returns false on a miss.
+    bool lookup(std::string_view word, std::vector<int> &out);
+    void insert(std::string_view word, const int *ids, size_t count);
+    void clear();
+
+    size_t hits() const { return m_hits.load(std::memory_order_relaxed); }
+    size_t misses() const { return m_misses.load(std::memory_order_relaxed); }
+    size_t size() const;
+    size_t capacity() const { return m_capacity; }
+    CachePolicy policy() const { return m_policy; }
+
+private:
+    struct Entry
+    {
+        std::string word;
+        std::vector<int> ids;
+        size_t freq;
+    };
+    using EntryList = std::list<Entry>;
+
+    struct Shard
+    {
+        // Entries grouped by use count, most recent first. LRU keeps everything
+        // at count 1; LFU moves an entry up one list per hit.
+        std::unordered_map<size_t, EntryList> by_freq;
+        std::unordered_map<std::string_view, EntryList::iterator> index; // views into Entry::word
+        size_t min_freq = 1;
+        size_t capacity = 0;
+        mutable std::mutex mutex;
+    };
+
+    static constexpr size_t kMaxShards = 16;
+
+    Shard &shard(std::string_view word)
+    {
+        return m_shards[std::hash<std::string_view>()(word) % m_num_shards];
+    }
+
+    size_t m_capacity;
+    CachePolicy m_policy;
+    size_t m_num_shards;
+    std::unique_ptr<Shard[]> m_shards;
+    std::atomic<size_t> m_hits;
+    std::atomic<size_t> m_misses;
+};
+
+/**
+ * Normalized text as one byte buffer plus symbol boundaries: symbol i is
+ * bytes[offsets[i], offsets[i + 1]). The normalizer emits one symbol per
+ * UTF-8 char; merging symbols (added vocab) only drops boundaries.
+ */
+struct SymbolStream
+{
+    std::string bytes;
+    std::vector<uint32_t> offsets{0};
+
+    size_t size() const { return offsets.size() - 1; }
+
+    std::string_view symbol(size_t i) const
+    {
+        return std::string_view(bytes.data() + offsets[i], offsets[i + 1] - offsets[i]);
+    }
+
+    // Bytes of symbols [begin, end) as one view.
+    std::string_view span(size_t begin, size_t end) const
+    {
+        return std::string_view(bytes.data() + offsets[begin], offsets[end] - offsets[begin]);
+    }
+
+    std::vector<std::string> strings(size_t begin, size_t end) const
+    {
+        std::vector<std::string> out;
+        out.reserve(end - begin);
+        for (size_t i = begin; i < end; i++)
+        {
+            out.emplace_back(symbol(i));
+        }
+        return out;
+    }
+
+    void clear()
+    {
+        bytes.clear();
+        offsets.assign(1, 0);
+    }
+};
+
+/**
+ * The first stages of BPE::encode (space => special character, then
+ * token_replace_map, then UTF-8 splitting) fused into one table-driven pass.
+ * Falls back to the separate passes when token_replace_map has keys longer
+ * than one codepoint or the input is not valid UTF-8.
+ */
+class Normalizer
+{
+public:
+    Normalizer(const std::string &special_character = "\xE2\x96\x81",
+               const std::map<std::string, std::string> &token_replace_map = {});
+
+    // Normalized text, one symbol per UTF-8 char, into `out`.
+    void normalize(const std::string &text, SymbolStream &out) const;
+
+    // True if every UTF-8 char is normalized on its own, so that text cut
+    // between two chars can be normalized piece by piece.
+    bool per_char() const { return m_fused; }
+
+private:
+    struct Replacement
+    {
+        std::string bytes;
+        std::vector<uint32_t> ends; // end of each UTF-8 char within `bytes`
+    };
+
+    void normalize_slow(const std::string &text, SymbolStream &out) const;
+    void emit(const Replacement &replacement, SymbolStream &out) const;
+    static uint32_t pack_utf8(const char *bytes, size_t len);
+
+    std::string m_special_character;
+    std::map<std::string, std::string> m_token_replace_map;
+    bool m_fused;
+    size_t m_max_expansion;                           // longest replacement, in bytes
+    std::array<int, 128> m_ascii;                     // ASCII byte => replacement, -1 keeps it
+    std::array<uint8_t, 16> m_trigger_lo;             // ASCII bytes with a replacement, as
+    std::array<uint8_t, 16> m_trigger_hi;             //   nibble bitsets: lo[b & 15] & hi[b >> 4]
+    std::unordered_map<uint32_t, int> m_multibyte;    // packed UTF-8 sequence => replacement
+    std::vector<Replacement> m_replacements;
+};
+
+/**
+ * Byte-level Aho-Corasick automaton over a list of words: one pass over a
+ * text finds every occurrence of every word.
+ */
+class AhoCorasick
+{
+public:
+    explicit AhoCorasick(const std::vector<std::string> &words = {});
+
+    // Node reached from `node` on `byte`, following failure links; 0 is the root.
+    int step(int node, unsigned char byte) const;
+
+    // Words ending at a node: first_output(node), then next_output(out)
+    // until -1; word_at(out) gives the word index.
+    int first_output(int node) const { return (m_word_at[node] != -1) ? node : m_output_link[node]; }
+    int next_output(int out) const { return m_output_link[out]; }
+    int word_at(int out) const { return m_word_at[out]; }
+
+    // Length of the text a node stands for: the longest suffix read so far
+    // that is still a prefix of some word.
+    int depth(int node) const { return m_depth[node]; }
+
+    size_t memory_usage() const;
+
+    void save(ModelWriter &out) const;
+    void load(ModelReader &in);
+
+private:
+    int next_node(int node, unsigned char byte) const;
+
+    FlatArray<int32_t> m_root_edges;                  // root => child, dense (256 entries)
+    PairMap<int32_t> m_edges;                         // (node << 8 | byte) => child
+    FlatArray<int32_t> m_fail;                        // failure link
+    FlatArray<int32_t> m_word_at;                     // word ending at node, or -1
+    FlatArray<int32_t> m_output_link;                 // next node on the failure chain with a word
+    FlatArray<int32_t> m_depth;                       // bytes from the root
+};
+
+/**
+ * Added-vocab words compiled once into an Aho-Corasick automaton, so that
+ * merging them costs a single pass over the text.
+ */
+class AddedVocabMatcher
+{
+public:
+    explicit AddedVocabMatcher(const std::vector<std::string> &added_vocab = {});
+
+    // Merges every added-vocab word found in `symbols` (UTF-8 chars) into one symbol.
+    void merge(SymbolStream &symbols) const;
+
+    // Sets crossed[t] for every symbol boundary t that lies strictly inside
+    // an occurrence of a word (whether merge would accept it or not).
+    void mark_crossed(const SymbolStream &symbols, std::vector<uint8_t> &crossed) const;
+
+    // Bytes of the longest word, 0 without any.
+    size_t max_word_length() const { return m_words.empty() ? 0 : m_words[0].size(); }
+
+    size_t size() const { return m_words.size(); }
+
+    // Bytes used by each table, added to `usage` under "added_vocab.<table>".
+    void memory_usage(std::map<std::string, size_t> &usage) const;
+
+    void save(ModelWriter &out) const;
+    void load(ModelReader &in);
+
 private:
-    std::unordered_map<std::string, int> m_pieces; // "left+right" => rank
-    std::unordered_map<std::string, int> m_str2id; // piece => ID
-    int m_vocab_size;
+    struct Match
+    {
+        int word;  // priority: index in m_words
+        int begin; // first symbol
+        int end;   // one past the last symbol
+    };
+
+    // Every occurrence that starts and ends on a symbol boundary.
+    void find_matches(const SymbolStream &symbols, std::vector<Match> &matches) const;
+
+    StringTable m_words;                              // by priority: longest first
+    AhoCorasick m_automaton;
+};
+
+/**
+ * Persistent worker threads shared by the batch APIs. Workers are started
+ * on first use and kept for the lifetime of the process; a forked child
+ * starts with none and spawns its own.
+ */
+class ThreadPool
+{
+public:
+    ThreadPool() = default;
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    // Calls fn(i) for every i in [0, count) on up to `num_threads` threads
+    // (the calling one included, 0 = all cores) and waits for all of them.
+    // The first exception thrown by fn is rethrown here.
+    void parallel_for(size_t count, size_t num_threads,
+                      const std::function<void(size_t)> &fn);
+
+    size_t size() const;
+
+    static ThreadPool &instance();
+
+private:
+    void grow(size_t num_workers);
+    void worker_loop();
+
+    // Behind pointers so a forked child can swap in fresh ones (see instance())
+    std::unique_ptr<std::vector<std::thread>> m_workers = std::make_unique<std::vector<std::thread>>();
+    std::deque<std::function<void()>> m_tasks;
+    mutable std::mutex m_mutex;
+    std::unique_ptr<std::condition_variable> m_wakeup = std::make_unique<std::condition_variable>();
+    bool m_stop = false;
 };
 
 /**
@@ -40,7 +650,12 @@ public:
         const std::vector<std::string> &added_vocab = {},
         const std::string &special_character = "\xE2\x96\x81",
         const std::map<std::string, std::string> &token_replace_map = {},
-        const std::map<std::string, std::string> &reverse_tokens_replace_map = {}
+        const std::map<std::string, std::string> &reverse_tokens_replace_map = {},
+        BPEEngine engine = BPEEngine::PriorityQueue,
+        size_t cache_capacity = 0,
+        CachePolicy cache_policy = CachePolicy::LRU,
+        WordSplit word_split = WordSplit::Auto,
+        const std::vector<int> &special_token_ids = {}
     );
 
     std::variant<std::vector<std::string>, std::vector<int>> encode(
@@ -48,19 +663,316 @@ public:
         float alpha = 0.0f,
         bool tokenize = true);
 
+    // Encodes every text on the shared ThreadPool; results are in input order.
+    std::vector<std::vector<int>> encode_batch(
+        const std::vector<std::string> &texts,
+        size_t num_threads = 0,
+        float alpha = 0.0f);
+
+    // Same, concatenated: IDs of text i are ids[offsets[i], offsets[i + 1]).
+    void encode_batch_flat(
+        const std::vector<std::string> &texts,
+        std::vector<int> &ids,
+        std::vector<int64_t> &offsets,
+        size_t num_threads = 0,
+        float alpha = 0.0f);
+
+    // Largest ID encode can return (unknown pieces are 0), and whether every
+    // such ID fits in a uint16_t.
+    int max_token_id() const { return (int)m_decoded.size() - 1; }
+    bool fits_uint16() const { return max_token_id() <= 0xFFFF; }
+    void require_uint16() const; // throws unless fits_uint16()
+
+    // encode and encode_batch_flat with uint16_t IDs, half the size of the
+    // int ones. They check fits_uint16() once, up front, and throw if the
+    // model has larger IDs, so an ID is never silently truncated.
+    std::vector<uint16_t> encode_uint16(
+        const std::string &text,
+        float alpha = 0.0f);
+
+    void encode_batch_flat(
+        const std::vector<std::string> &texts,
+        std::vector<uint16_t> &ids,
+        std::vector<int64_t> &offsets,
+        size_t num_threads = 0,
+        float alpha = 0.0f);
+
+    /**
+     * Encodes `text` into a caller-owned buffer: writes the first
+     * min(count, capacity) IDs to `out` and returns count, the number of
+     * IDs of the whole text, like snprintf. A count above `capacity` means
+     * the rest did not fit (the caller may treat that as truncation or as
+     * an error). Working memory is per-thread scratch reused across calls,
+     * so a warm call allocates nothing.
+     */
+    size_t encode_into(
+        const std::string &text,
+        int *out,
+        size_t capacity,
+        float alpha = 0.0f);
+
+    // Same with uint16_t IDs; throws unless fits_uint16().
+    size_t encode_into(
+        const std::string &text,
+        uint16_t *out,
+        size_t capacity,
+        float alpha = 0.0f);
+
     std::string decode(
-        const std::vector<int> &tokens);
+        const std::vector<int> &tokens,
+        bool skip_special_tokens = false) const;
+
+    // Decodes every sequence on the shared ThreadPool, in input order.
+    std::vector<std::string> decode_batch(
+        const std::vector<std::vector<int>> &sequences,
+        bool skip_special_tokens = false,
+        size_t num_threads = 0) const;
+
+    // Same over a flat buffer: sequence i is ids[offsets[i], offsets[i + 1]),
+    // with `count` + 1 offsets.
+    std::vector<std::string> decode_batch(
+        const int *ids,
+        const int64_t *offsets,
+        size_t count,
+        bool skip_special_tokens = false,
+        size_t num_threads = 0) const;
+
+    bool is_special_token(int id) const
+    {
+        return id >= 0 && (size_t)id / 64 < m_special_bits.size() &&
+               ((m_special_bits[id / 64] >> (id % 64)) & 1);
+    }
+
+    // Decoded text of a single ID (empty for IDs not in the vocab).
+    std::string_view decoded_token(int id) const;
+
+    // Byte value of a byte-fallback piece such as "<0xE2>", or -1.
+    int byte_fallback(int id) const
+    {
+        return (id >= 0 && (size_t)id < m_byte_fallback.size()) ? m_byte_fallback[id] : -1;
+    }
+
+    WordCache &word_cache() { return m_word_cache; }
+
+    // Number of vocab entries the model was built with.
+    size_t vocab_size() const { return (size_t)m_faster_bpe.vocab_size(); }
+
+    // Added-vocab words (special tokens included) matched before BPE runs.
+    size_t added_vocab_size() const { return m_added_vocab_matcher.size(); }
+
+    size_t merge_count() const { return m_faster_bpe.merge_count(); }
+
+    // FNV-1a hash of the compiled model bytes: equal for models that encode
+    // and decode the same way, however they were loaded.
+    uint64_t fingerprint() const;
+
+    // Bytes used by each model table (mapped or owned), by table name.
+    std::map<std::string, size_t> memory_usage() const;
+
+    /**
+     * Writes the model to `path` in the compiled format: a versioned header
+     * followed by every lookup table as a flat array.
+     */
+    void compile(const std::string &path) const;
+
+    /**
+     * Loads a model written by compile(). The file is mapped read-only and
+     * the tables point straight into it, so loading costs a few pointer
+     * fix-ups plus one pass over the file to verify its checksum; a corrupt
+     * file throws here rather than crashing encode later. Cache and word
+     * splitting are runtime options, not part of the file.
+     */
+    static std::unique_ptr<BPE> load_compiled(
+        const std::string &path,
+        size_t cache_capacity = 0,
+        CachePolicy cache_policy = CachePolicy::LRU,
+        WordSplit word_split = WordSplit::Auto);
+
+    /**
+     * Writes the compiled model into a sealed, read-only memfd and returns
+     * its descriptor (owned by the caller). Workers map it with attach(),
+     * or with load_compiled("/proc/<pid>/fd/<fd>") when the descriptor was
+     * not inherited, and all of them share the same physical pages.
+     */
+    int share() const;
+
+    // Maps a compiled model from an open descriptor (see share()); the
+    // descriptor can be closed afterwards. Only a sealed memfd skips the
+    // checksum.
+    static std::unique_ptr<BPE> attach(
+        int fd,
+        size_t cache_capacity = 0,
+        CachePolicy cache_policy = CachePolicy::LRU,
+        WordSplit word_split = WordSplit::Auto);
+
+    /**
+     * Builds a model from a Hugging Face style directory: tokenizer.json
+     * (vocab, merges as "a b" or ["a", "b"], added_tokens),
+     * tokenizer_config.json (added_tokens_decoder, optional) and
+     * added_vocab.txt or added_vocab.json (optional). Special tokens are
+     * added to the vocab and the added vocab, as AdaptBPETokenizer does;
+     * `added_vocab` and the token_replace_map values are appended to it.
+     */
+    static std::unique_ptr<BPE> from_pretrained(
+        const std::string &path,
+        const std::vector<std::string> &added_vocab = {},
+        const std::string &special_character = "\xE2\x96\x81",
+        const std::map<std::string, std::string> &token_replace_map = {},
+        BPEEngine engine = BPEEngine::PriorityQueue,
+        size_t cache_capacity = 0,
+        CachePolicy cache_policy = CachePolicy::LRU,
+        WordSplit word_split = WordSplit::Auto);
 
 private:
-    std::map<std::pair<std::string, std::string>, int> m_bpe_ranks;
-    std::map<std::string, int> m_vocab;
-    std::map<int, std::string> m_reverse_vocab; // Added reverse vocabulary map
-    std::vector<std::string> m_added_vocab;
+    friend class EncodeStream;
+
+    BPE(std::shared_ptr<const MappedFile> file,
+        bool verify,
+        size_t cache_capacity,
+        CachePolicy cache_policy,
+        WordSplit word_split);
+
+    void save(ModelWriter &out) const;
+    void build_decode_table(const std::map<std::string, std::string> &reverse_tokens_replace_map);
+    std::string decode_ids(const int *ids, size_t count, bool skip_special_tokens) const;
+    void encode_symbols(const SymbolStream &symbols, float alpha, std::vector<int> &out);
+    const std::vector<int> &encode_scratch(const std::string &text, float alpha);
+    void encode_words(const SymbolStream &symbols, float alpha,
+                      std::vector<int> &out);
+    bool starts_word(const SymbolStream &symbols, size_t i) const;
+
+    // The model itself is immutable: pieces, IDs and merges live once, in
+    // m_faster_bpe's tables; the wrapper only adds what decode needs.
+    AddedVocabMatcher m_added_vocab_matcher;
     std::string m_special_character;
-    std::map<std::string, std::string> m_token_replace_map;
-    std::map<std::string, std::string> m_reverse_tokens_replace_map;
-    
+    std::map<std::string, std::string> m_token_replace_map; // for compile()
+    Normalizer m_normalizer;
+
     FasterBPE m_faster_bpe; // composition of the FasterBPE engine
+
+    // Words (split before each run of m_special_character) can be encoded
+    // independently only if no merge spans such a boundary.
+    bool m_words_are_independent;
+    bool m_split_words; // resolved WordSplit
+    WordCache m_word_cache;
+
+    StringTable m_decoded;                // decode table: ID => decoded bytes
+    FlatArray<int16_t> m_byte_fallback;   // ID => byte of a "<0xHH>" piece, or -1
+    FlatArray<uint64_t> m_special_bits;   // bitset of special token IDs
+
+    std::shared_ptr<const MappedFile> m_file; // compiled model the tables point into, or null
+};
+
+/**
+ * Incremental tokenizer for text that arrives in chunks or is too large to
+ * hold at once (log files, books). The IDs returned by all steps plus
+ * finish() are exactly BPE::encode of the concatenated text, but only the
+ * text whose tokens may still change is held back: an unfinished UTF-8
+ * char and the last word, plus room for an added-vocab word that crosses
+ * a word boundary. Memory then stays bounded by the longest word.
+ *
+ * Words are only emitted early when the model encodes word by word (see
+ * WordSplit) and token_replace_map maps single chars; otherwise the whole
+ * text is held and encoded by finish().
+ */
+class EncodeStream
+{
+public:
+    explicit EncodeStream(BPE &bpe);
+
+    // Appends `text` (any split of UTF-8 is fine) and returns the IDs of
+    // the words it completes (may be empty).
+    std::vector<int> step(const std::string &text);
+
+    // Encodes whatever is still held back and starts a new stream.
+    std::vector<int> finish();
+    void reset();
+
+    // Bytes held back so far (input and normalized text).
+    size_t pending() const { return m_raw.size() + m_symbols.bytes.size(); }
+
+private:
+    void normalize_raw(bool final);
+    void append_normalized(const std::string &text);
+    void segment(bool final);
+    size_t find_cut();
+    void encode_prefix(size_t count, std::vector<int> &out);
+
+    BPE &m_bpe;
+    bool m_incremental;       // words can be encoded as soon as they are complete
+    std::string m_raw;        // input not normalized yet
+    SymbolStream m_symbols;   // normalized, not encoded yet; bytes past
+                              //   offsets.back() are an unfinished char
+    SymbolStream m_head;      // words being encoded
+    size_t m_next_cut;        // normalized size at which to look for a cut again
+    std::vector<uint8_t> m_crossed; // scratch for find_cut
+};
+
+/**
+ * Incremental detokenizer for token-at-a-time generation. Feeding IDs one
+ * step at a time yields, in total, the same text as BPE::decode on the
+ * whole sequence, but each step only returns text that is complete:
+ * bytes of an unfinished UTF-8 sequence are held back until the rest
+ * arrives. With byte_fallback (off by default), pieces like "<0xE2>"
+ * contribute their raw byte instead of their text; BPE::decode has no such
+ * option, so the output then differs from it.
+ *
+ * Generation can stop on any of `stop_strings` (matched over the decoded
+ * bytes by an Aho-Corasick automaton, so the cost per byte does not depend
+ * on how many there are) or on any of `stop_ids`. Text that may still turn
+ * into a stop string is held back too, so a stop string is never returned;
+ * once stopped, step returns the text up to the cut and then nothing.
+ */
+class DecodeStream
+{
+public:
+    explicit DecodeStream(const BPE &bpe,
+                          bool skip_leading_space = false,
+                          bool byte_fallback = false,
+                          const std::vector<std::string> &stop_strings = {},
+                          const std::vector<int> &stop_ids = {});
+
+    // Appends the IDs and returns the newly completed text (may be empty).
+    std::string step(const std::vector<int> &ids);
+    std::string step(int id);
+
+    // Returns whatever is still held back (possibly invalid UTF-8) and
+    // starts a new stream.
+    std::string finish();
+    void reset();
+
+    bool stopped() const { return m_stopped; }
+    // Byte offset in the decoded text where it was cut (the start of the
+    // stop string, or the end of the text before the stop ID).
+    size_t stop_position() const { return m_stop_position; }
+    // Index into stop_strings of the match, or -1.
+    int stop_string() const { return m_stop_string; }
+    // The stop ID that ended the stream, or -1.
+    int stop_id() const { return m_stop_id; }
+
+private:
+    bool feed(int id);
+    void append(int id);
+    bool scan_stop_strings();
+    std::string take(size_t count);
+    std::string take_complete();
+
+    const BPE &m_bpe;
+    bool m_skip_leading_space; // drop the space the first "▁" decodes to
+    bool m_byte_fallback;
+    bool m_at_start;
+    std::string m_pending;     // decoded bytes not returned yet
+    size_t m_returned;         // decoded bytes returned so far
+
+    AhoCorasick m_stop_automaton;
+    std::vector<size_t> m_stop_lengths;
+    std::vector<int> m_stop_ids; // sorted
+    int m_stop_node;             // automaton state after the last scanned byte
+    size_t m_scanned;            // bytes of m_pending already fed to it
+    bool m_stopped;
+    size_t m_stop_position;
+    int m_stop_string;
+    int m_stop_id;
 };
 
 #endif
\ No newline at end of file
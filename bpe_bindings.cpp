@@ -1,6 +1,8 @@
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h> // for automatic conversion of STL types (e.g. std::vector<string>)
+#include <pybind11/numpy.h>
 #include "bpe.hpp"        // This is where your BPE are defined.
+#include "corpus.hpp"
 #include "inja.hpp"
 #include "json.hpp"
 #include <string>
@@ -108,6 +110,43 @@ std::string apply_chat_template(
 
 namespace py = pybind11;
 
+// Hands a vector's buffer to NumPy without copying: the vector moves into a
+// capsule that the array keeps alive.
+template <typename T>
+py::array_t<T> to_numpy(std::vector<T> &&values)
+{
+    auto *owner = new std::vector<T>(std::move(values));
+    py::capsule free_when_done(owner, [](void *p) { delete static_cast<std::vector<T> *>(p); });
+    return py::array_t<T>(owner->size(), owner->data(), free_when_done);
+}
+
+// Streamed text as str. Bytes that are not valid UTF-8 (a flushed partial
+// sequence, or broken byte-fallback pieces) become U+FFFD instead of raising.
+py::str to_str_lossy(const std::string &text)
+{
+    PyObject *obj = PyUnicode_DecodeUTF8(text.data(), (Py_ssize_t)text.size(), "replace");
+    if (!obj)
+    {
+        throw py::error_already_set();
+    }
+    return py::reinterpret_steal<py::str>(obj);
+}
+
+// Checks the dtype argument of the encode methods; true for "uint16".
+// Python ints have no width, so uint16 only applies to NumPy results.
+bool wants_uint16(const std::string &dtype, bool return_numpy)
+{
+    if (dtype != "int32" && dtype != "uint16")
+    {
+        throw std::invalid_argument("dtype must be \"int32\" or \"uint16\"");
+    }
+    if (dtype == "uint16" && !return_numpy)
+    {
+        throw std::invalid_argument("dtype=\"uint16\" requires return_numpy=True");
+    }
+    return dtype == "uint16";
+}
+
 PYBIND11_MODULE(bpe_module, m)
 {
     m.doc() = "Pybind11 wrapper for Faster BPE-like tokenizer";
@@ -117,6 +156,19 @@ PYBIND11_MODULE(bpe_module, m)
           py::arg("special_tokens_map") = std::map<std::string, std::string>(),
           "Apply a Jinja-like chat template to a conversation data structure");
 
+    py::enum_<BPEEngine>(m, "BPEEngine", "Merge engine used by BPE.encode")
+        .value("PriorityQueue", BPEEngine::PriorityQueue)
+        .value("Backtracking", BPEEngine::Backtracking);
+
+    py::enum_<CachePolicy>(m, "CachePolicy", "Eviction policy of the BPE word cache")
+        .value("LRU", CachePolicy::LRU)
+        .value("LFU", CachePolicy::LFU);
+
+    py::enum_<WordSplit>(m, "WordSplit", "Pre-tokenization of BPE.encode into words")
+        .value("Auto", WordSplit::Auto)
+        .value("Always", WordSplit::Always)
+        .value("Never", WordSplit::Never);
+
     // Now we wrap the BPE class. We'll expose the constructor and the encode method.
     py::class_<BPE>(m, "BPE")
         // Expose constructor. We pass in references to the needed data structures.
@@ -125,28 +177,380 @@ PYBIND11_MODULE(bpe_module, m)
                       const std::vector<std::string>&,
                       const std::string&,
                       const std::map<std::string, std::string>&,
-                      const std::map<std::string, std::string>&>(), // Added reverse_tokens_replace_map parameter
+                      const std::map<std::string, std::string>&,
+                      BPEEngine,
+                      size_t,
+                      CachePolicy,
+                      WordSplit,
+                      const std::vector<int>&>(),
              py::arg("bpe_ranks"),
              py::arg("vocab"),
              py::arg("added_vocab") = std::vector<std::string>(),
              py::arg("special_character") = "\xE2\x96\x81",
              py::arg("token_replace_map") = std::map<std::string, std::string>(),
-             py::arg("reverse_tokens_replace_map") = std::map<std::string, std::string>()
+             py::arg("reverse_tokens_replace_map") = std::map<std::string, std::string>(),
+             py::arg("engine") = BPEEngine::PriorityQueue,
+             py::arg("cache_capacity") = 0,
+             py::arg("cache_policy") = CachePolicy::LRU,
+             py::arg("word_split") = WordSplit::Auto,
+             py::arg("special_token_ids") = std::vector<int>()
         )
 
         // Expose the encode method
         .def("encode",
-             &BPE::encode,
-             "Encode a string using BPE",
+             [](BPE &self, const std::string &text, float alpha, bool tokenize, bool return_numpy,
+                const std::string &dtype) -> py::object
+             {
+                 if (return_numpy && !tokenize)
+                 {
+                     throw std::invalid_argument("return_numpy requires tokenize=True");
+                 }
+                 if (wants_uint16(dtype, return_numpy))
+                 {
+                     std::vector<uint16_t> ids;
+                     {
+                         py::gil_scoped_release release;
+                         ids = self.encode_uint16(text, alpha);
+                     }
+                     return to_numpy(std::move(ids));
+                 }
+                 std::variant<std::vector<std::string>, std::vector<int>> result;
+                 {
+                     py::gil_scoped_release release;
+                     result = self.encode(text, alpha, tokenize);
+                 }
+                 if (return_numpy)
+                 {
+                     return to_numpy(std::get<std::vector<int>>(std::move(result)));
+                 }
+                 return py::cast(std::move(result));
+             },
+             "Encode a string using BPE (return_numpy gives the IDs as an int32 or uint16 array)",
+             py::arg("text"),
+             py::arg("alpha") = 0.0f,
+             py::arg("tokenize") = true,
+             py::arg("return_numpy") = false,
+             py::arg("dtype") = "int32"
+        )
+
+        // Encode into a caller-owned, writable 1-D int32 or uint16 buffer (a
+        // NumPy array, or a CPU torch tensor through .numpy()), e.g. one
+        // pinned buffer reused per request slot. Returns the number of IDs
+        // written; if they do not all fit, raises unless truncate=True.
+        .def("encode_into",
+             [](BPE &self, const std::string &text, py::buffer out, bool truncate, float alpha)
+             {
+                 py::buffer_info info = out.request(true);
+                 const bool is_int32 = info.itemsize == 4 && info.format == py::format_descriptor<int32_t>::format();
+                 const bool is_uint16 = info.itemsize == 2 && info.format == py::format_descriptor<uint16_t>::format();
+                 if (info.ndim != 1 || (!is_int32 && !is_uint16) || (info.shape[0] > 1 && info.strides[0] != info.itemsize))
+                 {
+                     throw std::invalid_argument("encode_into: out must be a contiguous 1-D int32 or uint16 buffer");
+                 }
+                 const size_t capacity = (size_t)info.shape[0];
+                 size_t count = 0;
+                 {
+                     py::gil_scoped_release release;
+                     count = is_int32 ? self.encode_into(text, static_cast<int *>(info.ptr), capacity, alpha)
+                                      : self.encode_into(text, static_cast<uint16_t *>(info.ptr), capacity, alpha);
+                 }
+                 if (count > capacity && !truncate)
+                 {
+                     throw std::length_error("encode_into: text has " + std::to_string(count) +
+                                             " tokens, the buffer holds " + std::to_string(capacity));
+                 }
+                 return std::min(count, capacity);
+             },
+             "Encode a string into a preallocated int32/uint16 buffer; returns the IDs written",
              py::arg("text"),
+             py::arg("out"),
+             py::arg("truncate") = false,
+             py::arg("alpha") = 0.0f
+        )
+
+        // Batch encode: the texts are copied out, then encoded without the
+        // GIL on the native thread pool. With return_numpy the result is a
+        // flat int32 (or uint16) ID array plus int64 offsets (len(texts) + 1
+        // entries).
+        .def("encode_batch",
+             [](BPE &self, const std::vector<std::string> &texts, size_t num_threads,
+                float alpha, bool return_numpy, const std::string &dtype) -> py::object
+             {
+                 if (wants_uint16(dtype, return_numpy))
+                 {
+                     std::vector<uint16_t> ids;
+                     std::vector<int64_t> offsets;
+                     {
+                         py::gil_scoped_release release;
+                         self.encode_batch_flat(texts, ids, offsets, num_threads, alpha);
+                     }
+                     return py::make_tuple(to_numpy(std::move(ids)), to_numpy(std::move(offsets)));
+                 }
+                 if (!return_numpy)
+                 {
+                     std::vector<std::vector<int>> results;
+                     {
+                         py::gil_scoped_release release;
+                         results = self.encode_batch(texts, num_threads, alpha);
+                     }
+                     return py::cast(std::move(results));
+                 }
+                 std::vector<int> ids;
+                 std::vector<int64_t> offsets;
+                 {
+                     py::gil_scoped_release release;
+                     self.encode_batch_flat(texts, ids, offsets, num_threads, alpha);
+                 }
+                 return py::make_tuple(to_numpy(std::move(ids)), to_numpy(std::move(offsets)));
+             },
+             "Encode a list of strings to token IDs in parallel (num_threads=0 uses all cores)",
+             py::arg("texts"),
+             py::arg("num_threads") = 0,
              py::arg("alpha") = 0.0f,
-             py::arg("tokenize") = true
+             py::arg("return_numpy") = false,
+             py::arg("dtype") = "int32"
         )
 
+        // JSONL records in a bytes object: fields are pulled out with a SAX
+        // scan and encoded without the GIL, with no Python object per record
+        .def("encode_jsonl",
+             [](BPE &self, py::bytes data, const std::vector<std::string> &fields,
+                const std::string &separator, const std::string &prefix, size_t num_threads,
+                bool return_numpy, const std::string &dtype) -> py::object
+             {
+                 char *buffer = nullptr;
+                 Py_ssize_t size = 0;
+                 if (PyBytes_AsStringAndSize(data.ptr(), &buffer, &size) != 0)
+                 {
+                     throw py::error_already_set();
+                 }
+                 const JsonFieldExtractor extractor(fields, separator);
+                 if (wants_uint16(dtype, return_numpy))
+                 {
+                     std::vector<uint16_t> ids;
+                     std::vector<int64_t> offsets;
+                     {
+                         py::gil_scoped_release release;
+                         encode_jsonl(self, buffer, (size_t)size, extractor, ids, offsets, num_threads, prefix);
+                     }
+                     return py::make_tuple(to_numpy(std::move(ids)), to_numpy(std::move(offsets)));
+                 }
+                 std::vector<int> ids;
+                 std::vector<int64_t> offsets;
+                 {
+                     py::gil_scoped_release release; // `data` is immutable and kept alive
+                     encode_jsonl(self, buffer, (size_t)size, extractor, ids, offsets, num_threads, prefix);
+                 }
+                 if (return_numpy)
+                 {
+                     return py::make_tuple(to_numpy(std::move(ids)), to_numpy(std::move(offsets)));
+                 }
+                 py::list results(offsets.size() - 1);
+                 for (size_t i = 0; i + 1 < offsets.size(); i++)
+                 {
+                     results[i] = py::cast(std::vector<int>(ids.begin() + offsets[i], ids.begin() + offsets[i + 1]));
+                 }
+                 return results;
+             },
+             "Encode the fields of every JSONL record (blank lines skipped), like encode_batch",
+             py::arg("data"),
+             py::arg("fields") = std::vector<std::string>{"text"},
+             py::arg("separator") = "\n",
+             py::arg("prefix") = "",
+             py::arg("num_threads") = 0,
+             py::arg("return_numpy") = false,
+             py::arg("dtype") = "int32"
+        )
+
+        // Word cache statistics
+        .def("cache_info",
+             [](BPE &self)
+             {
+                 WordCache &cache = self.word_cache();
+                 py::dict info;
+                 info["hits"] = cache.hits();
+                 info["misses"] = cache.misses();
+                 info["size"] = cache.size();
+                 info["capacity"] = cache.capacity();
+                 info["policy"] = cache.policy();
+                 return info;
+             },
+             "Hit/miss counters and occupancy of the word cache")
+        .def("clear_cache",
+             [](BPE &self) { self.word_cache().clear(); },
+             "Drop all cached words and reset the counters")
+
+        .def("vocab_size", &BPE::vocab_size, "Number of vocab entries")
+        .def("added_vocab_size", &BPE::added_vocab_size, "Number of added-vocab words")
+        .def("merge_count", &BPE::merge_count, "Number of merges in the model")
+        .def("max_token_id", &BPE::max_token_id, "Largest ID encode can return")
+        .def("fits_uint16", &BPE::fits_uint16, "Whether encode(..., dtype=\"uint16\") is allowed")
+        .def("memory_usage", &BPE::memory_usage, "Bytes held by each model table")
+
+        // Compiled binary format, loaded with mmap
+        .def("compile",
+             &BPE::compile,
+             "Write the model to a compiled file for BPE.load_compiled",
+             py::arg("path"),
+             py::call_guard<py::gil_scoped_release>())
+        .def_static("load_compiled",
+                    &BPE::load_compiled,
+                    "Map a file written by compile() and use its tables in place",
+                    py::arg("path"),
+                    py::arg("cache_capacity") = 0,
+                    py::arg("cache_policy") = CachePolicy::LRU,
+                    py::arg("word_split") = WordSplit::Auto,
+                    py::call_guard<py::gil_scoped_release>())
+        .def("share",
+             &BPE::share,
+             "Copy the compiled model into a sealed memfd and return its descriptor")
+        .def_static("attach",
+                    &BPE::attach,
+                    "Map a compiled model from an open descriptor (see share())",
+                    py::arg("fd"),
+                    py::arg("cache_capacity") = 0,
+                    py::arg("cache_policy") = CachePolicy::LRU,
+                    py::arg("word_split") = WordSplit::Auto,
+                    py::call_guard<py::gil_scoped_release>())
+        .def_static("from_pretrained",
+                    &BPE::from_pretrained,
+                    "Build a model from tokenizer.json, tokenizer_config.json and added_vocab.txt/.json in `path`",
+                    py::arg("path"),
+                    py::arg("added_vocab") = std::vector<std::string>(),
+                    py::arg("special_character") = "\xE2\x96\x81",
+                    py::arg("token_replace_map") = std::map<std::string, std::string>(),
+                    py::arg("engine") = BPEEngine::PriorityQueue,
+                    py::arg("cache_capacity") = 0,
+                    py::arg("cache_policy") = CachePolicy::LRU,
+                    py::arg("word_split") = WordSplit::Auto,
+                    py::call_guard<py::gil_scoped_release>())
+
         // Expose the decode method
         .def("decode",
              &BPE::decode,
              "Decode a list of token IDs back into strings",
-             py::arg("tokens")
+             py::arg("tokens"),
+             py::arg("skip_special_tokens") = false,
+             py::call_guard<py::gil_scoped_release>()
+        )
+
+        // Batch decode on the native thread pool, from a list of sequences...
+        .def("decode_batch",
+             py::overload_cast<const std::vector<std::vector<int>> &, bool, size_t>(&BPE::decode_batch, py::const_),
+             "Decode a list of token ID sequences in parallel (num_threads=0 uses all cores)",
+             py::arg("sequences"),
+             py::arg("skip_special_tokens") = false,
+             py::arg("num_threads") = 0,
+             py::call_guard<py::gil_scoped_release>()
+        )
+        // ...or from a flat ID array plus offsets (as returned by encode_batch
+        // with return_numpy), read in place without per-element conversion
+        .def("decode_batch",
+             [](const BPE &self,
+                py::array_t<int, py::array::c_style | py::array::forcecast> ids,
+                py::array_t<int64_t, py::array::c_style | py::array::forcecast> offsets,
+                bool skip_special_tokens, size_t num_threads)
+             {
+                 if (ids.ndim() != 1 || offsets.ndim() != 1 || offsets.size() == 0)
+                 {
+                     throw std::invalid_argument("decode_batch: ids and offsets must be 1-D, offsets non-empty");
+                 }
+                 const int64_t *offset_data = offsets.data();
+                 const size_t count = (size_t)offsets.size() - 1;
+                 if (offset_data[count] > (int64_t)ids.size())
+                 {
+                     throw std::invalid_argument("decode_batch: offsets run past the end of ids");
+                 }
+                 std::vector<std::string> results;
+                 {
+                     py::gil_scoped_release release;
+                     results = self.decode_batch(ids.data(), offset_data, count, skip_special_tokens, num_threads);
+                 }
+                 return results;
+             },
+             "Decode a flat ID array split by offsets (len(offsets) - 1 sequences) in parallel",
+             py::arg("ids"),
+             py::arg("offsets"),
+             py::arg("skip_special_tokens") = false,
+             py::arg("num_threads") = 0
         );
+
+    py::class_<EncodeStream>(m, "EncodeStream")
+        .def(py::init<BPE &>(),
+             py::arg("bpe"),
+             py::keep_alive<1, 2>() // the stream encodes with the BPE's tables
+        )
+        .def("step",
+             &EncodeStream::step,
+             "Feed a chunk of text (str or UTF-8 bytes); returns the IDs of the words it completes",
+             py::arg("text"),
+             py::call_guard<py::gil_scoped_release>())
+        .def("finish",
+             &EncodeStream::finish,
+             "Encode the held-back text and start a new stream",
+             py::call_guard<py::gil_scoped_release>())
+        .def("reset", &EncodeStream::reset, "Drop held-back text and start a new stream")
+        .def_property_readonly("pending", &EncodeStream::pending,
+                               "Bytes of text held back so far");
+
+    py::class_<DecodeStream>(m, "DecodeStream")
+        .def(py::init<const BPE &, bool, bool, const std::vector<std::string> &, const std::vector<int> &>(),
+             py::arg("bpe"),
+             py::arg("skip_leading_space") = false,
+             py::arg("byte_fallback") = false,
+             py::arg("stop_strings") = std::vector<std::string>(),
+             py::arg("stop_ids") = std::vector<int>(),
+             py::keep_alive<1, 2>() // the stream reads the BPE's decode table
+        )
+        .def("step",
+             [](DecodeStream &self, int id) { return to_str_lossy(self.step(id)); },
+             "Feed one token ID; returns the text it completes",
+             py::arg("id"))
+        .def("step",
+             [](DecodeStream &self, const std::vector<int> &ids) { return to_str_lossy(self.step(ids)); },
+             "Feed several token IDs; returns the text they complete",
+             py::arg("ids"))
+        .def("finish",
+             [](DecodeStream &self) { return to_str_lossy(self.finish()); },
+             "Flush held-back bytes and start a new stream")
+        .def("reset", &DecodeStream::reset, "Drop held-back bytes and start a new stream")
+        .def_property_readonly("stopped", &DecodeStream::stopped)
+        .def_property_readonly("stop_position", &DecodeStream::stop_position,
+                               "UTF-8 byte offset in the decoded text where it was cut")
+        .def_property_readonly("stop_string", &DecodeStream::stop_string,
+                               "Index of the matched stop string, or -1")
+        .def_property_readonly("stop_id", &DecodeStream::stop_id,
+                               "Stop token ID that ended the stream, or -1");
+
+    // Reads datasets written by tokenize_corpus (uint16, uint32 or
+    // stream-vbyte) into NumPy arrays for a training loader
+    py::class_<IndexedDatasetReader>(m, "IndexedDataset")
+        .def(py::init<const std::string &>(), py::arg("prefix"))
+        .def("__len__", &IndexedDatasetReader::documents)
+        .def("length", &IndexedDatasetReader::length, "Tokens in a document", py::arg("index"))
+        .def("read",
+             [](const IndexedDatasetReader &self, size_t index, const std::string &dtype) -> py::object
+             {
+                 if (dtype != "uint16" && dtype != "uint32")
+                 {
+                     throw std::invalid_argument("dtype must be \"uint16\" or \"uint32\"");
+                 }
+                 const size_t length = self.length(index);
+                 if (dtype == "uint16")
+                 {
+                     py::array_t<uint16_t> ids(length);
+                     uint16_t *out = ids.mutable_data();
+                     py::gil_scoped_release release;
+                     self.read(index, out);
+                     return std::move(ids);
+                 }
+                 py::array_t<uint32_t> ids(length);
+                 uint32_t *out = ids.mutable_data();
+                 py::gil_scoped_release release;
+                 self.read(index, out);
+                 return std::move(ids);
+             },
+             "Token IDs of a document as a NumPy array (uint16 raises if an ID does not fit)",
+             py::arg("index"),
+             py::arg("dtype") = "uint32");
 }
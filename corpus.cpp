@@ -0,0 +1,1496 @@
+#include "corpus.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "json.hpp"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define BPE_X86_SIMD
+#endif
+
+using json = nlohmann::json;
+
+///////////////////////////////////////////////////////////////////////////////
+//                             Stream VByte                                  //
+///////////////////////////////////////////////////////////////////////////////
+
+// Per control byte: data bytes of its group, and the pshufb masks that
+// spread them into four uint32 or four uint16 lanes (0x80 zeroes a byte).
+struct StreamVByteTables
+{
+    uint8_t length[256];
+    uint8_t shuffle32[256][16];
+    uint8_t shuffle16[256][16];
+};
+
+static const StreamVByteTables &stream_vbyte_tables()
+{
+    static const StreamVByteTables tables = []
+    {
+        StreamVByteTables t;
+        std::memset(t.shuffle32, 0x80, sizeof(t.shuffle32));
+        std::memset(t.shuffle16, 0x80, sizeof(t.shuffle16));
+        for (int control = 0; control < 256; control++)
+        {
+            uint8_t offset = 0;
+            for (int j = 0; j < 4; j++)
+            {
+                const int length = ((control >> (2 * j)) & 3) + 1;
+                for (int b = 0; b < length; b++)
+                {
+                    t.shuffle32[control][4 * j + b] = (uint8_t)(offset + b);
+                    if (b < 2)
+                    {
+                        t.shuffle16[control][2 * j + b] = (uint8_t)(offset + b);
+                    }
+                }
+                offset += length;
+            }
+            t.length[control] = offset;
+        }
+        return t;
+    }();
+    return tables;
+}
+
+size_t stream_vbyte_max_size(size_t count)
+{
+    return (count + 3) / 4 + 4 * count;
+}
+
+size_t stream_vbyte_encode(const int *ids, size_t count, uint8_t *out)
+{
+    if (count == 0)
+    {
+        return 0;
+    }
+    uint8_t *control = out;
+    uint8_t *data = out + (count + 3) / 4;
+    std::memset(control, 0, (count + 3) / 4);
+    for (size_t i = 0; i < count; i++)
+    {
+        const uint32_t value = (uint32_t)ids[i];
+        const int code = (value < (1u << 8)) ? 0 : (value < (1u << 16)) ? 1 : (value < (1u << 24)) ? 2 : 3;
+        control[i / 4] |= (uint8_t)(code << (2 * (i % 4)));
+        for (int b = 0; b <= code; b++)
+        {
+            *data++ = (uint8_t)(value >> (8 * b));
+        }
+    }
+    return data - out;
+}
+
+static void stream_vbyte_corrupt()
+{
+    throw std::runtime_error("Corrupt stream-vbyte data");
+}
+
+/**
+ * Decodes IDs [4 * first_group, count) one at a time, checking every
+ * length against `end`. Finishes what the SIMD loops leave: the last
+ * partial group, groups near the end of the input, and (uint16) groups
+ * with wide IDs, which it rejects.
+ */
+template <typename T>
+static void stream_vbyte_decode_scalar(const uint8_t *control, const uint8_t *data, const uint8_t *end,
+                                       size_t first_group, size_t count, T *out)
+{
+    for (size_t i = 4 * first_group; i < count; i++)
+    {
+        const size_t length = ((control[i / 4] >> (2 * (i % 4))) & 3) + 1;
+        if ((size_t)(end - data) < length)
+        {
+            stream_vbyte_corrupt();
+        }
+        if (length > sizeof(T))
+        {
+            throw std::runtime_error("Token ID does not fit in uint16; read it as uint32");
+        }
+        uint32_t value = 0;
+        for (size_t b = 0; b < length; b++)
+        {
+            value |= (uint32_t)data[b] << (8 * b);
+        }
+        out[i] = (T)value;
+        data += length;
+    }
+    if (data != end)
+    {
+        stream_vbyte_corrupt();
+    }
+}
+
+// Decodes whole groups while a 16-byte load stays inside the input;
+// returns how many, with `data` moved past them.
+using StreamVByteGroups32 = size_t (*)(const uint8_t *control, const uint8_t *&data, const uint8_t *end,
+                                       size_t groups, uint32_t *out);
+using StreamVByteGroups16 = size_t (*)(const uint8_t *control, const uint8_t *&data, const uint8_t *end,
+                                       size_t groups, uint16_t *out);
+
+static size_t stream_vbyte_groups_none32(const uint8_t *, const uint8_t *&, const uint8_t *, size_t, uint32_t *)
+{
+    return 0;
+}
+
+static size_t stream_vbyte_groups_none16(const uint8_t *, const uint8_t *&, const uint8_t *, size_t, uint16_t *)
+{
+    return 0;
+}
+
+#ifdef BPE_X86_SIMD
+// One pshufb per group of four: the control byte picks the mask that moves
+// each ID's bytes into its lane and zero-fills the rest.
+__attribute__((target("ssse3")))
+static size_t stream_vbyte_groups_ssse3_32(const uint8_t *control, const uint8_t *&data, const uint8_t *end,
+                                           size_t groups, uint32_t *out)
+{
+    const StreamVByteTables &tables = stream_vbyte_tables();
+    size_t g = 0;
+    for (; g < groups && end - data >= 16; g++)
+    {
+        const uint8_t c = control[g];
+        const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data));
+        const __m128i mask = _mm_loadu_si128(reinterpret_cast<const __m128i *>(tables.shuffle32[c]));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 4 * g), _mm_shuffle_epi8(bytes, mask));
+        data += tables.length[c];
+    }
+    return g;
+}
+
+// Same into uint16 lanes; stops at the first group with an ID of 3 or 4
+// bytes (the encoder uses the fewest bytes, so that ID is over 0xFFFF).
+__attribute__((target("ssse3")))
+static size_t stream_vbyte_groups_ssse3_16(const uint8_t *control, const uint8_t *&data, const uint8_t *end,
+                                           size_t groups, uint16_t *out)
+{
+    const StreamVByteTables &tables = stream_vbyte_tables();
+    size_t g = 0;
+    for (; g < groups && end - data >= 16; g++)
+    {
+        const uint8_t c = control[g];
+        if (c & 0xAA)
+        {
+            break;
+        }
+        const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data));
+        const __m128i mask = _mm_loadu_si128(reinterpret_cast<const __m128i *>(tables.shuffle16[c]));
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(out + 4 * g), _mm_shuffle_epi8(bytes, mask));
+        data += tables.length[c];
+    }
+    return g;
+}
+#endif
+
+static bool stream_vbyte_has_ssse3()
+{
+#ifdef BPE_X86_SIMD
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("ssse3");
+#else
+    return false;
+#endif
+}
+
+static StreamVByteGroups32 select_stream_vbyte_groups32()
+{
+#ifdef BPE_X86_SIMD
+    if (stream_vbyte_has_ssse3())
+    {
+        return stream_vbyte_groups_ssse3_32;
+    }
+#endif
+    return stream_vbyte_groups_none32;
+}
+
+static StreamVByteGroups16 select_stream_vbyte_groups16()
+{
+#ifdef BPE_X86_SIMD
+    if (stream_vbyte_has_ssse3())
+    {
+        return stream_vbyte_groups_ssse3_16;
+    }
+#endif
+    return stream_vbyte_groups_none16;
+}
+
+static const StreamVByteGroups32 stream_vbyte_groups32 = select_stream_vbyte_groups32();
+static const StreamVByteGroups16 stream_vbyte_groups16 = select_stream_vbyte_groups16();
+
+template <typename T, typename Groups>
+static void stream_vbyte_decode_with(Groups groups, const uint8_t *in, size_t size, size_t count, T *out)
+{
+    const size_t control_size = (count + 3) / 4;
+    if (size < control_size)
+    {
+        stream_vbyte_corrupt();
+    }
+    const uint8_t *data = in + control_size;
+    const uint8_t *end = in + size;
+    const size_t done = groups(in, data, end, count / 4, out);
+    stream_vbyte_decode_scalar(in, data, end, done, count, out);
+}
+
+void stream_vbyte_decode(const uint8_t *in, size_t size, size_t count, uint32_t *out)
+{
+    stream_vbyte_decode_with(stream_vbyte_groups32, in, size, count, out);
+}
+
+void stream_vbyte_decode(const uint8_t *in, size_t size, size_t count, uint16_t *out)
+{
+    stream_vbyte_decode_with(stream_vbyte_groups16, in, size, count, out);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                        Indexed Dataset Writer                             //
+///////////////////////////////////////////////////////////////////////////////
+
+// Header of a Megatron-LM .idx file, followed by a uint64 version (1).
+static const char kIndexMagic[9] = {'M', 'M', 'I', 'D', 'I', 'D', 'X', '\0', '\0'};
+
+static std::FILE *open_file(const std::string &path, const char *mode)
+{
+    std::FILE *file = std::fopen(path.c_str(), mode);
+    if (!file)
+    {
+        throw std::runtime_error("Cannot open " + path + ": " + std::strerror(errno));
+    }
+    return file;
+}
+
+static void write_all(std::FILE *file, const void *data, size_t size, const std::string &path)
+{
+    if (size > 0 && std::fwrite(data, 1, size, file) != size)
+    {
+        throw std::runtime_error("Cannot write " + path + ": " + std::strerror(errno));
+    }
+}
+
+// Megatron dtype code of each TokenDType. 64 is not a Megatron code, so
+// Megatron rejects stream-vbyte datasets instead of misreading them.
+static uint8_t dtype_code(TokenDType dtype)
+{
+    return (dtype == TokenDType::UInt16) ? 8 : (dtype == TokenDType::UInt32) ? 4 : 64;
+}
+
+IndexedDatasetWriter::IndexedDatasetWriter(const std::string &prefix, TokenDType dtype)
+    : m_prefix(prefix),
+      m_dtype(dtype),
+      m_bin(open_file(prefix + ".bin", "wb")),
+      m_pointers{0},
+      m_tokens(0)
+{
+    std::setvbuf(m_bin, nullptr, _IOFBF, 1 << 20);
+}
+
+IndexedDatasetWriter::~IndexedDatasetWriter()
+{
+    if (m_bin)
+    {
+        std::fclose(m_bin);
+    }
+}
+
+void IndexedDatasetWriter::add_document(const int *ids, size_t count)
+{
+    if (count > (size_t)std::numeric_limits<int32_t>::max())
+    {
+        throw std::length_error("Document has too many tokens for an indexed dataset");
+    }
+    const std::string path = m_prefix + ".bin";
+    size_t bytes = 0;
+    if (m_dtype == TokenDType::UInt32)
+    {
+        bytes = count * sizeof(int);
+        write_all(m_bin, ids, bytes, path);
+    }
+    else if (m_dtype == TokenDType::UInt16)
+    {
+        m_narrow.resize(count);
+        for (size_t i = 0; i < count; i++)
+        {
+            if ((unsigned)ids[i] > 0xFFFF)
+            {
+                throw std::runtime_error("Token ID " + std::to_string(ids[i]) +
+                                         " does not fit in uint16; use uint32 output");
+            }
+            m_narrow[i] = (uint16_t)ids[i];
+        }
+        bytes = count * sizeof(uint16_t);
+        write_all(m_bin, m_narrow.data(), bytes, path);
+    }
+    else
+    {
+        m_packed.resize(stream_vbyte_max_size(count));
+        bytes = stream_vbyte_encode(ids, count, m_packed.data());
+        write_all(m_bin, m_packed.data(), bytes, path);
+    }
+    m_lengths.push_back((int32_t)count);
+    m_pointers.push_back(m_pointers.back() + (int64_t)bytes);
+    m_tokens += count;
+}
+
+void IndexedDatasetWriter::finish()
+{
+    const std::string bin_path = m_prefix + ".bin";
+    const int closed = std::fclose(m_bin);
+    m_bin = nullptr;
+    if (closed != 0)
+    {
+        throw std::runtime_error("Cannot write " + bin_path + ": " + std::strerror(errno));
+    }
+
+    const std::string path = m_prefix + ".idx";
+    std::FILE *idx = open_file(path, "wb");
+    try
+    {
+        const uint64_t version = 1;
+        const uint8_t code = dtype_code(m_dtype);
+        const uint64_t sequences = m_lengths.size();
+        const uint64_t documents = sequences + 1; // document i is sequence i
+        write_all(idx, kIndexMagic, sizeof(kIndexMagic), path);
+        write_all(idx, &version, sizeof(version), path);
+        write_all(idx, &code, sizeof(code), path);
+        write_all(idx, &sequences, sizeof(sequences), path);
+        write_all(idx, &documents, sizeof(documents), path);
+        write_all(idx, m_lengths.data(), m_lengths.size() * sizeof(int32_t), path);
+        write_all(idx, m_pointers.data(), sequences * sizeof(int64_t), path);
+
+        std::vector<int64_t> starts(sequences + 1);
+        for (size_t i = 0; i <= sequences; i++)
+        {
+            starts[i] = (int64_t)i;
+        }
+        write_all(idx, starts.data(), starts.size() * sizeof(int64_t), path); // document starts
+    }
+    catch (...)
+    {
+        std::fclose(idx);
+        throw;
+    }
+    if (std::fclose(idx) != 0)
+    {
+        throw std::runtime_error("Cannot write " + path + ": " + std::strerror(errno));
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                        Indexed Dataset Reader                             //
+///////////////////////////////////////////////////////////////////////////////
+
+IndexedDatasetReader::IndexedDatasetReader(const std::string &prefix)
+{
+    // The index is small next to the data and read in full
+    const std::string idx_path = prefix + ".idx";
+    std::ifstream idx(idx_path, std::ios::binary);
+    if (!idx)
+    {
+        throw std::runtime_error("Cannot open " + idx_path + ": " + std::strerror(errno));
+    }
+    char magic[sizeof(kIndexMagic)];
+    uint64_t version = 0;
+    uint8_t code = 0;
+    uint64_t sequences = 0;
+    uint64_t documents = 0;
+    idx.read(magic, sizeof(magic));
+    idx.read(reinterpret_cast<char *>(&version), sizeof(version));
+    idx.read(reinterpret_cast<char *>(&code), sizeof(code));
+    idx.read(reinterpret_cast<char *>(&sequences), sizeof(sequences));
+    idx.read(reinterpret_cast<char *>(&documents), sizeof(documents));
+    if (!idx || std::memcmp(magic, kIndexMagic, sizeof(magic)) != 0 || version != 1)
+    {
+        throw std::runtime_error("Not an indexed dataset: " + idx_path);
+    }
+    if (code != dtype_code(TokenDType::UInt16) && code != dtype_code(TokenDType::UInt32) &&
+        code != dtype_code(TokenDType::StreamVByte))
+    {
+        throw std::runtime_error("Unsupported dtype code " + std::to_string(code) + " in " + idx_path);
+    }
+    m_dtype = (code == 8) ? TokenDType::UInt16 : (code == 4) ? TokenDType::UInt32 : TokenDType::StreamVByte;
+    if (sequences > (uint64_t)std::numeric_limits<int32_t>::max())
+    {
+        throw std::runtime_error("Corrupt index: " + idx_path);
+    }
+    m_lengths.resize(sequences);
+    m_pointers.resize(sequences + 1);
+    idx.read(reinterpret_cast<char *>(m_lengths.data()), sequences * sizeof(int32_t));
+    idx.read(reinterpret_cast<char *>(m_pointers.data()), sequences * sizeof(int64_t));
+    if (!idx)
+    {
+        throw std::runtime_error("Corrupt index: " + idx_path);
+    }
+
+    const std::string bin_path = prefix + ".bin";
+    const int fd = ::open(bin_path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (fd < 0 || ::fstat(fd, &info) != 0)
+    {
+        const int error = errno;
+        if (fd >= 0)
+        {
+            ::close(fd);
+        }
+        throw std::runtime_error("Cannot open " + bin_path + ": " + std::strerror(error));
+    }
+    m_bin_size = (size_t)info.st_size;
+    if (m_bin_size > 0)
+    {
+        void *data = ::mmap(nullptr, m_bin_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            const int error = errno;
+            ::close(fd);
+            throw std::runtime_error("Cannot map " + bin_path + ": " + std::strerror(error));
+        }
+        m_bin = static_cast<const uint8_t *>(data);
+    }
+    ::close(fd); // the mapping keeps the file open
+
+    // Every document has to lie inside the .bin, so reads need no checks
+    const size_t item_size = (m_dtype == TokenDType::UInt16) ? 2 : 4;
+    m_pointers[sequences] = (int64_t)m_bin_size;
+    for (size_t i = 0; i < sequences; i++)
+    {
+        const bool inside = m_pointers[i] >= 0 && m_pointers[i] <= m_pointers[i + 1] &&
+                            m_pointers[i + 1] <= (int64_t)m_bin_size;
+        const bool fits = inside && (m_dtype == TokenDType::StreamVByte ||
+                                     (uint64_t)(m_pointers[i + 1] - m_pointers[i]) >=
+                                         (uint64_t)m_lengths[i] * item_size);
+        if (m_lengths[i] < 0 || !fits)
+        {
+            throw std::runtime_error("Corrupt index: " + idx_path + " does not match " + bin_path);
+        }
+    }
+}
+
+IndexedDatasetReader::~IndexedDatasetReader()
+{
+    if (m_bin)
+    {
+        ::munmap(const_cast<uint8_t *>(m_bin), m_bin_size);
+    }
+}
+
+size_t IndexedDatasetReader::length(size_t index) const
+{
+    if (index >= m_lengths.size())
+    {
+        throw std::out_of_range("Document index out of range");
+    }
+    return (size_t)m_lengths[index];
+}
+
+template <typename T>
+void IndexedDatasetReader::read_ids(size_t index, T *out) const
+{
+    const size_t count = length(index);
+    const uint8_t *begin = m_bin + m_pointers[index];
+    if (m_dtype == TokenDType::StreamVByte)
+    {
+        stream_vbyte_decode(begin, (size_t)(m_pointers[index + 1] - m_pointers[index]), count, out);
+    }
+    else if (m_dtype == TokenDType::UInt16)
+    {
+        const uint16_t *ids = reinterpret_cast<const uint16_t *>(begin);
+        std::copy(ids, ids + count, out);
+    }
+    else
+    {
+        const uint32_t *ids = reinterpret_cast<const uint32_t *>(begin);
+        if (sizeof(T) < sizeof(uint32_t) &&
+            std::any_of(ids, ids + count, [](uint32_t id) { return id > std::numeric_limits<T>::max(); }))
+        {
+            throw std::runtime_error("Token ID does not fit in uint16; read it as uint32");
+        }
+        std::copy(ids, ids + count, out);
+    }
+}
+
+void IndexedDatasetReader::read(size_t index, uint32_t *out) const
+{
+    read_ids(index, out);
+}
+
+void IndexedDatasetReader::read(size_t index, uint16_t *out) const
+{
+    read_ids(index, out);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                         JSON Field Extraction                             //
+///////////////////////////////////////////////////////////////////////////////
+
+static bool is_blank(const char *begin, const char *end)
+{
+    for (; begin != end; begin++)
+    {
+        if (*begin != ' ' && *begin != '\t' && *begin != '\r')
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * SAX handler for JsonFieldExtractor. Only the string values of the
+ * wanted top-level keys are kept; everything else is checked by the
+ * parser and dropped. Returning false stops the parse with `error` set.
+ */
+class FieldScanner
+{
+public:
+    using number_integer_t = json::number_integer_t;
+    using number_unsigned_t = json::number_unsigned_t;
+    using number_float_t = json::number_float_t;
+    using string_t = json::string_t;
+    using binary_t = json::binary_t;
+
+    FieldScanner(const std::vector<std::string> &keys, std::vector<std::string> &values,
+                 std::vector<char> &found)
+        : m_keys(keys), m_values(values), m_found(found)
+    {
+    }
+
+    bool null()
+    {
+        return value(true); // a null field counts as missing
+    }
+    bool boolean(bool) { return value(false); }
+    bool number_integer(number_integer_t) { return value(false); }
+    bool number_unsigned(number_unsigned_t) { return value(false); }
+    bool number_float(number_float_t, const string_t &) { return value(false); }
+    bool binary(binary_t &) { return value(false); }
+
+    bool string(string_t &text)
+    {
+        if (m_depth == 1 && m_field >= 0)
+        {
+            m_values[m_field] = std::move(text);
+            m_found[m_field] = 1;
+        }
+        return value(true);
+    }
+
+    bool key(string_t &name)
+    {
+        if (m_depth == 1)
+        {
+            auto it = std::find(m_keys.begin(), m_keys.end(), name);
+            m_field = (it == m_keys.end()) ? -1 : (int)(it - m_keys.begin());
+        }
+        return true;
+    }
+
+    bool start_object(size_t)
+    {
+        if (m_depth > 0 && !value(false))
+        {
+            return false;
+        }
+        m_depth++;
+        return true;
+    }
+
+    bool start_array(size_t)
+    {
+        if (!value(false))
+        {
+            return false;
+        }
+        m_depth++;
+        return true;
+    }
+
+    bool end_object()
+    {
+        m_depth--;
+        return true;
+    }
+
+    bool end_array()
+    {
+        m_depth--;
+        return true;
+    }
+
+    bool parse_error(size_t, const std::string &, const nlohmann::detail::exception &e)
+    {
+        error = e.what();
+        return false;
+    }
+
+    std::string error;
+
+private:
+    // Checks a value (or the start of a container) at the current depth.
+    bool value(bool allowed)
+    {
+        if (m_depth == 0)
+        {
+            error = "record is not a JSON object";
+            return false;
+        }
+        if (m_depth == 1 && m_field >= 0 && !allowed)
+        {
+            error = "field \"" + m_keys[m_field] + "\" is not a string";
+            return false;
+        }
+        return true;
+    }
+
+    const std::vector<std::string> &m_keys;
+    std::vector<std::string> &m_values;
+    std::vector<char> &m_found;
+    size_t m_depth = 0;
+    int m_field = -1; // index in m_keys of the value being read at depth 1
+};
+
+JsonFieldExtractor::JsonFieldExtractor(const std::vector<std::string> &keys, const std::string &separator)
+    : m_keys(keys), m_separator(separator)
+{
+    if (m_keys.empty())
+    {
+        throw std::invalid_argument("JsonFieldExtractor needs at least one key");
+    }
+}
+
+void JsonFieldExtractor::extract(const char *begin, const char *end, std::string &text) const
+{
+    thread_local std::vector<std::string> values;
+    thread_local std::vector<char> found;
+    values.resize(m_keys.size());
+    found.assign(m_keys.size(), 0);
+
+    FieldScanner scanner(m_keys, values, found);
+    if (!json::sax_parse(begin, end, &scanner))
+    {
+        throw std::runtime_error(scanner.error);
+    }
+
+    bool any = false;
+    for (size_t i = 0; i < m_keys.size(); i++)
+    {
+        if (found[i])
+        {
+            text.append(any ? m_separator : std::string()).append(values[i]);
+            any = true;
+        }
+    }
+    if (!any)
+    {
+        std::string names;
+        for (const std::string &key : m_keys)
+        {
+            names += (names.empty() ? "\"" : " or \"") + key + "\"";
+        }
+        throw std::runtime_error("no string field " + names);
+    }
+}
+
+template <typename T>
+static void encode_jsonl_into(BPE &bpe,
+                              const char *data,
+                              size_t size,
+                              const JsonFieldExtractor &fields,
+                              std::vector<T> &ids,
+                              std::vector<int64_t> &offsets,
+                              size_t num_threads,
+                              const std::string &prefix)
+{
+    struct Record
+    {
+        const char *begin;
+        const char *end;
+    };
+    std::vector<Record> records;
+    for (const char *begin = data, *limit = data + size; begin < limit;)
+    {
+        const char *newline = (const char *)std::memchr(begin, '\n', limit - begin);
+        const char *end = newline ? newline : limit;
+        if (!is_blank(begin, end))
+        {
+            records.push_back(Record{begin, end});
+        }
+        begin = end + 1;
+    }
+
+    std::vector<std::vector<int>> results(records.size());
+    ThreadPool::instance().parallel_for(
+        records.size(), num_threads,
+        [&](size_t i)
+        {
+            thread_local std::string text;
+            text = prefix;
+            try
+            {
+                fields.extract(records[i].begin, records[i].end, text);
+            }
+            catch (const std::runtime_error &e)
+            {
+                throw std::runtime_error("JSONL record at byte " + std::to_string(records[i].begin - data) +
+                                         ": " + e.what());
+            }
+            results[i] = std::get<std::vector<int>>(bpe.encode(text));
+        });
+
+    offsets.assign(results.size() + 1, 0);
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        offsets[i + 1] = offsets[i] + (int64_t)results[i].size();
+    }
+    ids.resize(offsets.back());
+    ThreadPool::instance().parallel_for(
+        results.size(), num_threads,
+        [&](size_t i)
+        {
+            std::copy(results[i].begin(), results[i].end(), ids.begin() + offsets[i]);
+        });
+}
+
+void encode_jsonl(BPE &bpe,
+                  const char *data,
+                  size_t size,
+                  const JsonFieldExtractor &fields,
+                  std::vector<int> &ids,
+                  std::vector<int64_t> &offsets,
+                  size_t num_threads,
+                  const std::string &prefix)
+{
+    encode_jsonl_into(bpe, data, size, fields, ids, offsets, num_threads, prefix);
+}
+
+void encode_jsonl(BPE &bpe,
+                  const char *data,
+                  size_t size,
+                  const JsonFieldExtractor &fields,
+                  std::vector<uint16_t> &ids,
+                  std::vector<int64_t> &offsets,
+                  size_t num_threads,
+                  const std::string &prefix)
+{
+    bpe.require_uint16();
+    encode_jsonl_into(bpe, data, size, fields, ids, offsets, num_threads, prefix);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                           Corpus Pipeline                                 //
+///////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Queue between two pipeline stages. push blocks while it is full, pop
+ * while it is empty; close() ends the stream once it is drained and
+ * abort() ends it at once (both unblock every waiter).
+ */
+template <typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity) : m_capacity(capacity) {}
+
+    bool push(T item)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_not_full.wait(lock, [this] { return m_items.size() < m_capacity || m_closed; });
+        if (m_closed)
+        {
+            return false;
+        }
+        m_items.push_back(std::move(item));
+        m_not_empty.notify_one();
+        return true;
+    }
+
+    bool pop(T &item)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_not_empty.wait(lock, [this] { return !m_items.empty() || m_closed; });
+        if (m_items.empty())
+        {
+            return false;
+        }
+        item = std::move(m_items.front());
+        m_items.pop_front();
+        m_not_full.notify_one();
+        return true;
+    }
+
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_closed = true;
+        m_not_empty.notify_all();
+        m_not_full.notify_all();
+    }
+
+    void abort()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_items.clear();
+        m_closed = true;
+        m_not_empty.notify_all();
+        m_not_full.notify_all();
+    }
+
+private:
+    std::deque<T> m_items;
+    size_t m_capacity;
+    bool m_closed = false;
+    std::mutex m_mutex;
+    std::condition_variable m_not_empty;
+    std::condition_variable m_not_full;
+};
+
+// A byte range of an input file. It holds the lines that start inside
+// [begin, end); the last one may run past `end`.
+struct InputRange
+{
+    std::string path;
+    uint64_t begin = 0;
+    uint64_t end = std::numeric_limits<uint64_t>::max();
+    size_t shard = 0; // job shard the range belongs to
+};
+
+// Input lines read in one go: lines[i] is data[begin, end).
+struct InputBatch
+{
+    struct Line
+    {
+        size_t begin;
+        size_t end;
+        uint64_t offset; // in the file, for error messages
+    };
+    std::string data;
+    std::vector<Line> lines;
+    std::string path;
+    size_t shard = 0;
+    bool last = false; // last batch of its range
+};
+
+struct EncodedBatch
+{
+    std::vector<std::vector<int>> documents;
+    uint64_t input_bytes = 0;
+    size_t shard = 0;
+    bool last = false;
+};
+
+using RangeSource = std::function<bool(InputRange &)>;
+using BatchSink = std::function<void(const EncodedBatch &)>;
+
+/**
+ * Reads up to `size` more bytes of `file` onto `data`; returns false at
+ * the end of the file.
+ */
+static bool read_more(std::FILE *file, const std::string &path, std::string &data, size_t size)
+{
+    const size_t old_size = data.size();
+    data.resize(old_size + size);
+    const size_t got = std::fread(&data[old_size], 1, size, file);
+    data.resize(old_size + got);
+    if (got < size && std::ferror(file))
+    {
+        throw std::runtime_error("Cannot read " + path + ": " + std::strerror(errno));
+    }
+    return got == size;
+}
+
+/**
+ * Queues the lines of `range` in blocks of about `batch_bytes`, each cut
+ * after its last complete line (a longer line grows the block). Returns
+ * false if the pipeline was aborted.
+ */
+static bool read_range(const InputRange &range, size_t batch_bytes, BoundedQueue<InputBatch> &out)
+{
+    std::FILE *file = open_file(range.path, "rb");
+    try
+    {
+        // A range that does not start a line starts after the next newline
+        uint64_t position = range.begin;
+        std::string data;
+        bool more = true;
+        if (position > 0)
+        {
+            if (fseeko(file, (off_t)(position - 1), SEEK_SET) != 0)
+            {
+                throw std::runtime_error("Cannot seek in " + range.path + ": " + std::strerror(errno));
+            }
+            position--;
+            for (size_t newline = std::string::npos; newline == std::string::npos && more;)
+            {
+                data.clear();
+                more = read_more(file, range.path, data, 1 << 16);
+                newline = data.find('\n');
+                position += (newline == std::string::npos) ? data.size() : newline + 1;
+                data.erase(0, (newline == std::string::npos) ? data.size() : newline + 1);
+            }
+        }
+
+        bool done = false;
+        while (!done)
+        {
+            InputBatch batch;
+            batch.path = range.path;
+            batch.shard = range.shard;
+            batch.data.swap(data);
+
+            // Read up to a newline, but not far past the end of the range
+            size_t cut = std::string::npos;
+            while (cut == std::string::npos && more)
+            {
+                const size_t old_size = batch.data.size();
+                const uint64_t left = range.end - std::min(range.end, position + old_size);
+                more = read_more(file, range.path, batch.data,
+                                 (size_t)std::min<uint64_t>(batch_bytes, std::max<uint64_t>(left, 1 << 16)));
+                for (size_t i = batch.data.size(); i > old_size; i--)
+                {
+                    if (batch.data[i - 1] == '\n')
+                    {
+                        cut = i;
+                        break;
+                    }
+                }
+            }
+            if (cut == std::string::npos)
+            {
+                cut = batch.data.size();
+            }
+            data.assign(batch.data, cut, std::string::npos);
+            batch.data.resize(cut);
+
+            for (size_t begin = 0; begin < batch.data.size();)
+            {
+                if (position + begin >= range.end)
+                {
+                    batch.data.resize(begin); // the next range's lines
+                    done = true;
+                    break;
+                }
+                const char *start = batch.data.data() + begin;
+                const void *newline = std::memchr(start, '\n', batch.data.size() - begin);
+                const size_t end = newline ? (const char *)newline - batch.data.data() : batch.data.size();
+                if (!is_blank(start, batch.data.data() + end))
+                {
+                    batch.lines.push_back(InputBatch::Line{begin, end, position + begin});
+                }
+                begin = end + 1;
+            }
+            position += cut;
+            done = done || (data.empty() && !more);
+            batch.last = done;
+            if (!out.push(std::move(batch)))
+            {
+                std::fclose(file);
+                return false;
+            }
+        }
+    }
+    catch (...)
+    {
+        std::fclose(file);
+        throw;
+    }
+    std::fclose(file);
+    return true;
+}
+
+// Encodes the documents of one batch on the shared ThreadPool.
+static EncodedBatch encode_lines(BPE &bpe, const InputBatch &batch, const CorpusOptions &options,
+                                 const JsonFieldExtractor &fields)
+{
+    EncodedBatch encoded;
+    encoded.input_bytes = batch.data.size();
+    encoded.shard = batch.shard;
+    encoded.last = batch.last;
+    encoded.documents.resize(batch.lines.size());
+    ThreadPool::instance().parallel_for(
+        batch.lines.size(), options.num_threads,
+        [&](size_t i)
+        {
+            const InputBatch::Line &line = batch.lines[i];
+            const char *begin = batch.data.data() + line.begin;
+            const char *end = batch.data.data() + line.end;
+            thread_local std::string text;
+            text.clear();
+            if (options.format == CorpusFormat::JSONL)
+            {
+                try
+                {
+                    fields.extract(begin, end, text);
+                }
+                catch (const std::runtime_error &e)
+                {
+                    throw std::runtime_error(batch.path + " at byte " + std::to_string(line.offset) + ": " +
+                                             e.what());
+                }
+            }
+            else
+            {
+                text.assign(begin, end);
+            }
+            std::vector<int> &ids = encoded.documents[i];
+            ids = std::get<std::vector<int>>(bpe.encode(text));
+            if (!ids.empty() && options.append_eod >= 0)
+            {
+                ids.push_back(options.append_eod);
+            }
+        });
+    return encoded;
+}
+
+/**
+ * Runs the reader, encoder and writer stages: the ranges given by
+ * `next_range` are read on one thread, encoded on the calling one (and
+ * the ThreadPool), and handed to `write` in order on a third. The first
+ * error of any stage stops the others and is rethrown here.
+ */
+static void run_pipeline(BPE &bpe, const RangeSource &next_range, const BatchSink &write,
+                         const CorpusOptions &options)
+{
+    if (options.batch_bytes == 0)
+    {
+        throw std::invalid_argument("batch_bytes must be positive");
+    }
+
+    if (options.dtype == TokenDType::UInt16 && (!bpe.fits_uint16() || options.append_eod > 0xFFFF))
+    {
+        // Fail before reading anything rather than at the first large ID
+        throw std::invalid_argument("Model has token IDs up to " +
+                                    std::to_string(std::max(bpe.max_token_id(), options.append_eod)) +
+                                    ", which do not fit in uint16; use uint32 output");
+    }
+    const JsonFieldExtractor fields(options.json_keys, options.json_separator);
+
+    // Two batches in flight per queue: one being handed over, one ready
+    BoundedQueue<InputBatch> read_queue(2);
+    BoundedQueue<EncodedBatch> write_queue(2);
+    std::mutex error_mutex;
+    std::exception_ptr error;
+    auto fail = [&]()
+    {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (!error)
+        {
+            error = std::current_exception();
+        }
+        read_queue.abort();
+        write_queue.abort();
+    };
+
+    std::thread reader([&]()
+                       {
+                           try
+                           {
+                               InputRange range;
+                               while (next_range(range) && read_range(range, options.batch_bytes, read_queue))
+                               {
+                               }
+                           }
+                           catch (...)
+                           {
+                               fail();
+                           }
+                           read_queue.close();
+                       });
+    std::thread writer([&]()
+                       {
+                           try
+                           {
+                               EncodedBatch batch;
+                               while (write_queue.pop(batch))
+                               {
+                                   write(batch);
+                               }
+                           }
+                           catch (...)
+                           {
+                               fail();
+                           }
+                       });
+
+    InputBatch batch;
+    try
+    {
+        while (read_queue.pop(batch))
+        {
+            if (!write_queue.push(encode_lines(bpe, batch, options, fields)))
+            {
+                break;
+            }
+        }
+    }
+    catch (...)
+    {
+        fail();
+    }
+    write_queue.close();
+    reader.join();
+    writer.join();
+    if (error)
+    {
+        std::rethrow_exception(error);
+    }
+}
+
+static std::string shard_name(const std::string &prefix, size_t index)
+{
+    char suffix[24]; // "_" plus any size_t
+    std::snprintf(suffix, sizeof(suffix), "_%05zu", index);
+    return prefix + suffix;
+}
+
+CorpusStats tokenize_corpus(BPE &bpe,
+                            const std::vector<std::string> &inputs,
+                            const std::string &output_prefix,
+                            const CorpusOptions &options)
+{
+    size_t next_input = 0;
+    RangeSource next_range = [&](InputRange &range)
+    {
+        if (next_input == inputs.size())
+        {
+            return false;
+        }
+        range = InputRange();
+        range.path = inputs[next_input++];
+        return true;
+    };
+
+    // Starts a new shard before the first document past shard_bytes;
+    // documents without tokens are skipped
+    CorpusStats stats;
+    std::unique_ptr<IndexedDatasetWriter> writer;
+    auto open_shard = [&]()
+    {
+        stats.shards.push_back(options.shard_bytes == 0 ? output_prefix
+                                                        : shard_name(output_prefix, stats.shards.size()));
+        writer = std::make_unique<IndexedDatasetWriter>(stats.shards.back(), options.dtype);
+    };
+    BatchSink write = [&](const EncodedBatch &batch)
+    {
+        stats.input_bytes += batch.input_bytes;
+        for (const std::vector<int> &ids : batch.documents)
+        {
+            if (ids.empty())
+            {
+                stats.skipped++;
+                continue;
+            }
+            if (writer && options.shard_bytes > 0 && writer->bin_bytes() >= options.shard_bytes)
+            {
+                writer->finish();
+                writer.reset();
+            }
+            if (!writer)
+            {
+                open_shard();
+            }
+            writer->add_document(ids.data(), ids.size());
+            stats.documents++;
+            stats.tokens += ids.size();
+        }
+    };
+
+    run_pipeline(bpe, next_range, write, options);
+    if (!writer && stats.shards.empty())
+    {
+        open_shard(); // an empty corpus still gets a (valid, empty) dataset
+    }
+    if (writer)
+    {
+        writer->finish();
+    }
+    return stats;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                             Corpus Jobs                                   //
+///////////////////////////////////////////////////////////////////////////////
+
+static std::string job_path(const std::string &job_dir, const std::string &name)
+{
+    return job_dir + "/" + name;
+}
+
+// Open descriptor holding an advisory lock; the lock goes away with the
+// descriptor, also when the process dies.
+class FileLock
+{
+public:
+    FileLock() = default;
+    FileLock(const FileLock &) = delete;
+    FileLock &operator=(const FileLock &) = delete;
+    ~FileLock() { release(); }
+
+    // Blocks until the lock is held, or returns false if `wait` is false
+    // and another process holds it.
+    bool acquire(const std::string &path, bool wait)
+    {
+        release();
+        m_fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (m_fd < 0)
+        {
+            throw std::runtime_error("Cannot open " + path + ": " + std::strerror(errno));
+        }
+        while (::flock(m_fd, wait ? LOCK_EX : LOCK_EX | LOCK_NB) != 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            const int error = errno;
+            release();
+            if (error == EWOULDBLOCK)
+            {
+                return false;
+            }
+            throw std::runtime_error("Cannot lock " + path + ": " + std::strerror(error));
+        }
+        return true;
+    }
+
+    void release()
+    {
+        if (m_fd >= 0)
+        {
+            ::close(m_fd);
+            m_fd = -1;
+        }
+    }
+
+private:
+    int m_fd = -1;
+};
+
+/**
+ * Reads the manifest, lets `update` change it and writes it back through a
+ * rename, all under the manifest lock; returns the result. `update`
+ * returns false when it made no change. A missing manifest reads as null.
+ */
+static json update_manifest(const std::string &job_dir, const std::function<bool(json &)> &update)
+{
+    FileLock lock;
+    lock.acquire(job_path(job_dir, "manifest.lock"), true);
+
+    const std::string path = job_path(job_dir, "manifest.json");
+    json manifest;
+    std::ifstream in(path);
+    if (in)
+    {
+        try
+        {
+            manifest = json::parse(in);
+        }
+        catch (const json::exception &e)
+        {
+            throw std::runtime_error("Invalid " + path + ": " + e.what());
+        }
+    }
+    if (!update(manifest))
+    {
+        return manifest;
+    }
+
+    const std::string temp = path + ".tmp";
+    const std::string text = manifest.dump(1) + "\n";
+    std::FILE *out = open_file(temp, "wb");
+    const bool written = std::fwrite(text.data(), 1, text.size(), out) == text.size() &&
+                         std::fflush(out) == 0 && ::fsync(fileno(out)) == 0;
+    if (std::fclose(out) != 0 || !written || std::rename(temp.c_str(), path.c_str()) != 0)
+    {
+        throw std::runtime_error("Cannot write " + path + ": " + std::strerror(errno));
+    }
+    return manifest;
+}
+
+// Everything the output of a job depends on, besides the model tables.
+static json job_config(BPE &bpe, const std::vector<std::string> &inputs, const CorpusOptions &options)
+{
+    json files = json::array();
+    for (const std::string &path : inputs)
+    {
+        struct stat info;
+        if (::stat(path.c_str(), &info) != 0)
+        {
+            throw std::runtime_error("Cannot open " + path + ": " + std::strerror(errno));
+        }
+        files.push_back({{"path", path}, {"size", (uint64_t)info.st_size}});
+    }
+    return {{"inputs", files},
+            {"range_bytes", options.range_bytes},
+            {"format", options.format == CorpusFormat::JSONL ? "jsonl" : "text"},
+            {"json_keys", options.json_keys},
+            {"json_separator", options.json_separator},
+            {"dtype", options.dtype == TokenDType::UInt16   ? "uint16"
+                      : options.dtype == TokenDType::UInt32 ? "uint32"
+                                                            : "stream-vbyte"},
+            {"append_eod", options.append_eod},
+            {"vocab_size", bpe.vocab_size()},
+            {"model", bpe.fingerprint()}};
+}
+
+CorpusStats run_corpus_job(BPE &bpe,
+                           const std::vector<std::string> &inputs,
+                           const std::string &job_dir,
+                           const CorpusOptions &options)
+{
+    if (options.range_bytes == 0)
+    {
+        throw std::invalid_argument("range_bytes must be positive");
+    }
+    if (::mkdir(job_dir.c_str(), 0755) != 0 && errno != EEXIST)
+    {
+        throw std::runtime_error("Cannot create " + job_dir + ": " + std::strerror(errno));
+    }
+
+    // The first process plans the shards; the others check they were
+    // started on the same job
+    const json config = job_config(bpe, inputs, options);
+    const json plan = update_manifest(job_dir, [&](json &manifest)
+    {
+        if (!manifest.is_null())
+        {
+            if (manifest["config"] != config)
+            {
+                throw std::runtime_error(job_dir + " holds a job with other inputs or options");
+            }
+            return false;
+        }
+        json shards = json::array();
+        for (size_t input = 0; input < inputs.size(); input++)
+        {
+            const uint64_t size = config["inputs"][input]["size"];
+            for (uint64_t begin = 0; begin < size; begin += options.range_bytes)
+            {
+                shards.push_back({{"input", input},
+                                  {"begin", begin},
+                                  {"end", std::min(size, begin + options.range_bytes)},
+                                  {"done", false}});
+            }
+        }
+        manifest = {{"version", 1}, {"config", config}, {"shards", shards}};
+        return true;
+    });
+    const json &shards = plan["shards"];
+
+    // Shards are claimed one at a time with a lock file each, so processes
+    // sharing the job never work on the same one; a crashed process's
+    // locks are dropped with it and its shards are redone
+    std::mutex claims_mutex;
+    std::map<size_t, std::unique_ptr<FileLock>> claims;
+    size_t next_shard = 0;
+    RangeSource next_range = [&](InputRange &range)
+    {
+        for (; next_shard < shards.size(); next_shard++)
+        {
+            const size_t index = next_shard;
+            if (shards[index]["done"])
+            {
+                continue;
+            }
+            auto lock = std::make_unique<FileLock>();
+            if (!lock->acquire(job_path(job_dir, shard_name("shard", index) + ".lock"), false))
+            {
+                continue;
+            }
+            const json current = update_manifest(job_dir, [](json &) { return false; });
+            if (current["shards"][index]["done"])
+            {
+                continue;
+            }
+            range.path = inputs[shards[index]["input"].get<size_t>()];
+            range.begin = shards[index]["begin"];
+            range.end = shards[index]["end"];
+            range.shard = index;
+            std::lock_guard<std::mutex> guard(claims_mutex);
+            claims[index] = std::move(lock);
+            next_shard++;
+            return true;
+        }
+        return false;
+    };
+
+    // Each shard is written under a temporary name, renamed when complete
+    // and then marked done with its counts
+    CorpusStats stats;
+    std::unique_ptr<IndexedDatasetWriter> writer;
+    uint64_t documents = 0, skipped = 0, tokens = 0;
+    BatchSink write = [&](const EncodedBatch &batch)
+    {
+        const std::string prefix = job_path(job_dir, shard_name("shard", batch.shard));
+        if (!writer)
+        {
+            writer = std::make_unique<IndexedDatasetWriter>(prefix + ".partial", options.dtype);
+            documents = skipped = tokens = 0;
+        }
+        stats.input_bytes += batch.input_bytes;
+        for (const std::vector<int> &ids : batch.documents)
+        {
+            if (ids.empty())
+            {
+                skipped++;
+                continue;
+            }
+            writer->add_document(ids.data(), ids.size());
+            documents++;
+            tokens += ids.size();
+        }
+        if (!batch.last)
+        {
+            return;
+        }
+
+        writer->finish();
+        writer.reset();
+        for (const char *extension : {".bin", ".idx"})
+        {
+            if (std::rename((prefix + ".partial" + extension).c_str(), (prefix + extension).c_str()) != 0)
+            {
+                throw std::runtime_error("Cannot rename " + prefix + ".partial" + extension + ": " +
+                                         std::strerror(errno));
+            }
+        }
+        update_manifest(job_dir, [&](json &manifest)
+        {
+            json &shard = manifest["shards"][batch.shard];
+            shard["done"] = true;
+            shard["documents"] = documents;
+            shard["skipped"] = skipped;
+            shard["tokens"] = tokens;
+            return true;
+        });
+        std::lock_guard<std::mutex> guard(claims_mutex);
+        claims.erase(batch.shard);
+
+        stats.shards.push_back(prefix);
+        stats.documents += documents;
+        stats.skipped += skipped;
+        stats.tokens += tokens;
+    };
+
+    run_pipeline(bpe, next_range, write, options);
+
+    const json manifest = update_manifest(job_dir, [](json &) { return false; });
+    for (const json &shard : manifest["shards"])
+    {
+        stats.pending_shards += shard["done"] ? 0 : 1;
+    }
+    return stats;
+}
@@ -0,0 +1,227 @@
+#ifndef CORPUS_HPP
+#define CORPUS_HPP
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "bpe.hpp"
+
+/**
+ * Input layout of a corpus file.
+ *
+ * - JSONL: one JSON object per line, the document is made of its string fields.
+ * - Text:  one document per line.
+ *
+ * Blank lines are skipped in both.
+ */
+enum class CorpusFormat
+{
+    JSONL,
+    Text
+};
+
+/**
+ * Storage of the token IDs in a .bin file. UInt16 and UInt32 use the
+ * Megatron dtype codes 8 and 4 (IDs are never negative, so uint32 IDs are
+ * stored under the int32 code). StreamVByte packs each document with
+ * stream_vbyte_encode; its .idx holds the byte offset of every document
+ * under code 64, which Megatron readers reject rather than misread.
+ */
+enum class TokenDType
+{
+    UInt16,
+    UInt32,
+    StreamVByte
+};
+
+/**
+ * Stream VByte packing of token IDs (Lemire, Kurz and Rupp): every ID takes
+ * 1-4 bytes, and one control byte holds the lengths of a group of four.
+ * All control bytes come first, then the data bytes, so the decoder turns
+ * a group into four IDs with one SSSE3 shuffle where available.
+ */
+size_t stream_vbyte_max_size(size_t count);
+
+// Packs `count` IDs into `out` (stream_vbyte_max_size(count) bytes) and
+// returns the bytes used.
+size_t stream_vbyte_encode(const int *ids, size_t count, uint8_t *out);
+
+// Unpacks `count` IDs from in[0, size). Throws std::runtime_error unless
+// the input holds exactly `count` IDs, or (uint16) if an ID does not fit.
+void stream_vbyte_decode(const uint8_t *in, size_t size, size_t count, uint32_t *out);
+void stream_vbyte_decode(const uint8_t *in, size_t size, size_t count, uint16_t *out);
+
+/**
+ * Megatron-LM "MMIDIDX" indexed dataset: `prefix.bin` holds the token IDs
+ * of every document back to back, `prefix.idx` their lengths and byte
+ * offsets. Each document is one sequence.
+ */
+class IndexedDatasetWriter
+{
+public:
+    IndexedDatasetWriter(const std::string &prefix, TokenDType dtype);
+    ~IndexedDatasetWriter();
+
+    IndexedDatasetWriter(const IndexedDatasetWriter &) = delete;
+    IndexedDatasetWriter &operator=(const IndexedDatasetWriter &) = delete;
+
+    // Appends one document. Throws if an ID does not fit the dtype.
+    void add_document(const int *ids, size_t count);
+
+    // Writes the index and closes both files.
+    void finish();
+
+    size_t documents() const { return m_lengths.size(); }
+    uint64_t tokens() const { return m_tokens; }
+    uint64_t bin_bytes() const { return (uint64_t)m_pointers.back(); }
+
+private:
+    std::string m_prefix;
+    TokenDType m_dtype;
+    std::FILE *m_bin;
+    std::vector<int32_t> m_lengths;   // tokens per document
+    std::vector<int64_t> m_pointers;  // .bin offset of every document, plus the end
+    std::vector<uint16_t> m_narrow;   // scratch for uint16 output
+    std::vector<uint8_t> m_packed;    // scratch for stream-vbyte output
+    uint64_t m_tokens;
+};
+
+/**
+ * Reads an indexed dataset of any TokenDType, e.g. for a training loader.
+ * The .bin is mapped, so documents come straight from the page cache and
+ * processes reading the same files share it.
+ */
+class IndexedDatasetReader
+{
+public:
+    explicit IndexedDatasetReader(const std::string &prefix);
+    ~IndexedDatasetReader();
+
+    IndexedDatasetReader(const IndexedDatasetReader &) = delete;
+    IndexedDatasetReader &operator=(const IndexedDatasetReader &) = delete;
+
+    TokenDType dtype() const { return m_dtype; }
+    size_t documents() const { return m_lengths.size(); }
+    size_t length(size_t index) const;
+
+    // Writes the IDs of document `index` to out[0, length(index)). The
+    // uint16 version throws if an ID does not fit.
+    void read(size_t index, uint32_t *out) const;
+    void read(size_t index, uint16_t *out) const;
+
+private:
+    template <typename T>
+    void read_ids(size_t index, T *out) const;
+
+    TokenDType m_dtype;
+    std::vector<int32_t> m_lengths;
+    std::vector<int64_t> m_pointers;  // as in the writer
+    const uint8_t *m_bin = nullptr;
+    size_t m_bin_size = 0;
+};
+
+/**
+ * Pulls string fields out of one JSON record with a SAX scan: no DOM is
+ * built, and the values of other keys are only validated. The document
+ * is the fields found, in the order of `keys`, joined by `separator`; a
+ * null field counts as missing.
+ */
+class JsonFieldExtractor
+{
+public:
+    explicit JsonFieldExtractor(const std::vector<std::string> &keys, const std::string &separator = "\n");
+
+    // Appends the document of the record in [begin, end) to `text`. Throws
+    // std::runtime_error on invalid JSON, a record that is not an object,
+    // a field that is not a string, or a record with none of the fields.
+    void extract(const char *begin, const char *end, std::string &text) const;
+
+private:
+    std::vector<std::string> m_keys;
+    std::string m_separator;
+};
+
+/**
+ * Encodes the JSONL records in data[0, size) (blank lines skipped) like
+ * BPE::encode_batch_flat: the IDs of record i are ids[offsets[i],
+ * offsets[i + 1]). Fields are extracted and encoded on the shared
+ * ThreadPool; `prefix` is put before every document.
+ */
+void encode_jsonl(BPE &bpe,
+                  const char *data,
+                  size_t size,
+                  const JsonFieldExtractor &fields,
+                  std::vector<int> &ids,
+                  std::vector<int64_t> &offsets,
+                  size_t num_threads = 0,
+                  const std::string &prefix = "");
+
+// Same with uint16_t IDs; throws unless bpe.fits_uint16().
+void encode_jsonl(BPE &bpe,
+                  const char *data,
+                  size_t size,
+                  const JsonFieldExtractor &fields,
+                  std::vector<uint16_t> &ids,
+                  std::vector<int64_t> &offsets,
+                  size_t num_threads = 0,
+                  const std::string &prefix = "");
+
+struct CorpusOptions
+{
+    CorpusFormat format = CorpusFormat::JSONL;
+    std::vector<std::string> json_keys = {"text"}; // JSONL fields making up the document
+    std::string json_separator = "\n";             // between the fields of a record
+    TokenDType dtype = TokenDType::UInt32;
+    int append_eod = -1;               // ID appended to every document, or -1
+    size_t num_threads = 0;            // encoder threads, 0 = all cores
+    size_t batch_bytes = 16 << 20;     // input read and encoded per batch
+    uint64_t shard_bytes = 0;          // start a new shard past this .bin size, 0 = one file
+    uint64_t range_bytes = 256 << 20;  // input bytes per shard of a job
+};
+
+struct CorpusStats
+{
+    uint64_t input_bytes = 0;
+    uint64_t documents = 0;
+    uint64_t skipped = 0;              // documents without any token
+    uint64_t tokens = 0;
+    std::vector<std::string> shards;   // output prefixes, in order
+    size_t pending_shards = 0;         // job shards not done yet
+};
+
+/**
+ * Tokenizes `inputs` into Megatron indexed datasets under `output_prefix`
+ * (`prefix.bin/.idx`, or `prefix_00000.bin/.idx`, ... with shard_bytes).
+ * Reading, encoding and writing run as a pipeline on their own threads:
+ * while one batch is encoded on the shared ThreadPool, the next is read
+ * and the previous one written. Documents keep their input order.
+ */
+CorpusStats tokenize_corpus(BPE &bpe,
+                            const std::vector<std::string> &inputs,
+                            const std::string &output_prefix,
+                            const CorpusOptions &options = {});
+
+/**
+ * Resumable version of tokenize_corpus. The inputs are cut into shards of
+ * `range_bytes` (a shard holds the lines starting in its range), and
+ * shard i is written to `job_dir/shard_NNNNN.bin/.idx`; the shards in
+ * index order hold the same documents as tokenize_corpus would write.
+ *
+ * `job_dir/manifest.json` records the job's inputs, options and model
+ * fingerprint (BPE::fingerprint) and, per shard, whether it is done with
+ * its document and token counts. Running the job again (after a crash, or
+ * from several processes at once) encodes only the shards that are neither
+ * done nor being encoded by another process. Throws if `job_dir` holds a
+ * job with other inputs, options or model. The output does not depend on
+ * num_threads or batch_bytes.
+ *
+ * The returned stats cover the shards done by this call.
+ */
+CorpusStats run_corpus_job(BPE &bpe,
+                           const std::vector<std::string> &inputs,
+                           const std::string &job_dir,
+                           const CorpusOptions &options = {});
+
+#endif // CORPUS_HPP
@@ -13,11 +13,11 @@ def get_pybind_include():
 ext_modules = [
     Extension(
         name="bpe_module",
-        sources=["bpe_bindings.cpp", "bpe.cpp"],
+        sources=["bpe_bindings.cpp", "bpe.cpp", "corpus.cpp"],
         include_dirs=get_pybind_include() + ["."],  # "." if your .hpp files are local
         language="c++",
-        extra_compile_args=["-std=c++17"],
-        extra_link_args=[],
+        extra_compile_args=["-std=c++17", "-pthread"],
+        extra_link_args=["-pthread"],
     ),
 ]
 
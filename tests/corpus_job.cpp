@@ -0,0 +1,231 @@
+// Checks that run_corpus_job writes, across its shards, exactly what
+// tokenize_corpus writes, whatever num_threads and batch_bytes are; that a
+// rerun only encodes the shards that are not done; and that a job directory
+// refuses a different model.
+
+#include "corpus.hpp"
+#include "json.hpp"
+#include "train.hpp"
+
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <stdexcept>
+#include <unistd.h>
+
+namespace
+{
+
+const std::vector<std::string> kAlphabet = {
+    "a", "b", "c", "d", "e", "\xC3\xA9", "\xE8\xAA\x9E", "\xE2\x96\x81"};
+
+int failures = 0;
+
+void fail(const std::string &what)
+{
+    if (failures++ < 10)
+        std::fprintf(stderr, "%s\n", what.c_str());
+}
+
+std::string read_file(const std::string &path)
+{
+    std::ifstream file(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+void write_file(const std::string &path, const std::string &bytes)
+{
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file.write(bytes.data(), (std::streamsize)bytes.size());
+}
+
+// JSONL records of random words, with blank lines and empty documents.
+std::string random_jsonl(std::mt19937 &rng, size_t records)
+{
+    std::string jsonl;
+    for (size_t r = 0; r < records; r++)
+    {
+        if (rng() % 20 == 0)
+        {
+            jsonl += "\n";
+            continue;
+        }
+        std::string text;
+        size_t words = rng() % 40;
+        for (size_t w = 0; w < words; w++)
+        {
+            if (w)
+                text += ' ';
+            size_t len = 1 + rng() % 6;
+            for (size_t i = 0; i < len; i++)
+                text += kAlphabet[rng() % (kAlphabet.size() - 1)];
+        }
+        jsonl += "{\"id\": " + std::to_string(r) + ", \"text\": \"" + text + "\"}\n";
+    }
+    return jsonl;
+}
+
+BPE make_bpe(std::mt19937 &rng, int num_merges)
+{
+    std::vector<std::vector<std::string>> words;
+    for (int i = 0; i < 2000; i++)
+        words.push_back(random_symbols(rng, kAlphabet, kAlphabet.size() - 1, 6, {kAlphabet.back()}));
+    Model m = train(kAlphabet, words, num_merges);
+    return BPE(m.ranks, m.vocab, {}, kAlphabet.back());
+}
+
+std::string shard_prefix(const std::string &job_dir, size_t index)
+{
+    char name[32];
+    std::snprintf(name, sizeof(name), "/shard_%05zu", index);
+    return job_dir + name;
+}
+
+nlohmann::json read_manifest(const std::string &job_dir)
+{
+    return nlohmann::json::parse(read_file(job_dir + "/manifest.json"));
+}
+
+// The .bin of every shard, in order; each document is stored on its own,
+// so this is byte for byte the .bin of tokenize_corpus.
+std::string concatenated_bins(const std::string &job_dir)
+{
+    std::string bin;
+    const size_t shards = read_manifest(job_dir)["shards"].size();
+    for (size_t i = 0; i < shards; i++)
+        bin += read_file(shard_prefix(job_dir, i) + ".bin");
+    return bin;
+}
+
+size_t concatenated_documents(const std::string &job_dir)
+{
+    size_t documents = 0;
+    const size_t shards = read_manifest(job_dir)["shards"].size();
+    for (size_t i = 0; i < shards; i++)
+        documents += IndexedDatasetReader(shard_prefix(job_dir, i)).documents();
+    return documents;
+}
+
+void remove_job(const std::string &job_dir)
+{
+    const size_t shards = read_manifest(job_dir)["shards"].size();
+    for (size_t i = 0; i < shards; i++)
+    {
+        for (const char *extension : {".bin", ".idx", ".lock"})
+            std::remove((shard_prefix(job_dir, i) + extension).c_str());
+    }
+    std::remove((job_dir + "/manifest.json").c_str());
+    std::remove((job_dir + "/manifest.lock").c_str());
+    ::rmdir(job_dir.c_str());
+}
+
+// Marks shards 1 and 3 of a finished job as not done and deletes their
+// output, as if the job had stopped before them, then reruns it.
+void check_rerun(BPE &bpe, const std::vector<std::string> &inputs,
+                 const std::string &job_dir, const CorpusOptions &options,
+                 const std::string &expected)
+{
+    nlohmann::json manifest = read_manifest(job_dir);
+    for (size_t index : {1, 3})
+    {
+        manifest["shards"][index]["done"] = false;
+        std::remove((shard_prefix(job_dir, index) + ".bin").c_str());
+        std::remove((shard_prefix(job_dir, index) + ".idx").c_str());
+    }
+    write_file(job_dir + "/manifest.json", manifest.dump(1) + "\n");
+
+    CorpusStats stats = run_corpus_job(bpe, inputs, job_dir, options);
+    if (stats.shards != std::vector<std::string>{shard_prefix(job_dir, 1), shard_prefix(job_dir, 3)} ||
+        stats.pending_shards != 0)
+        fail("rerun encoded " + std::to_string(stats.shards.size()) + " shards");
+    if (concatenated_bins(job_dir) != expected)
+        fail("rerun output differs from tokenize_corpus");
+}
+
+} // namespace
+
+int main()
+{
+    std::mt19937 rng(1357);
+    BPE bpe = make_bpe(rng, 200);
+
+    char dir[] = "/tmp/corpus_job_XXXXXX";
+    if (!mkdtemp(dir))
+    {
+        std::perror("mkdtemp");
+        return 1;
+    }
+    const std::string root = dir;
+    const std::vector<std::string> inputs = {root + "/a.jsonl", root + "/b.jsonl"};
+    write_file(inputs[0], random_jsonl(rng, 400));
+    write_file(inputs[1], random_jsonl(rng, 150));
+
+    struct Run
+    {
+        size_t num_threads;
+        size_t batch_bytes;
+    };
+    const Run runs[] = {{1, 64}, {3, 700}, {0, 16 << 20}};
+
+    for (TokenDType dtype : {TokenDType::UInt32, TokenDType::StreamVByte})
+    {
+        CorpusOptions options;
+        options.dtype = dtype;
+        options.append_eod = 0;
+        const CorpusStats reference = tokenize_corpus(bpe, inputs, root + "/reference", options);
+        const std::string expected = read_file(root + "/reference.bin");
+
+        for (const Run &run : runs)
+        {
+            const std::string job_dir = root + "/job";
+            options.num_threads = run.num_threads;
+            options.batch_bytes = run.batch_bytes;
+            options.range_bytes = 500;
+            CorpusStats stats = run_corpus_job(bpe, inputs, job_dir, options);
+            if (stats.pending_shards != 0 || stats.documents != reference.documents ||
+                stats.tokens != reference.tokens || stats.skipped != reference.skipped)
+                fail("job counts differ from tokenize_corpus");
+            if (concatenated_bins(job_dir) != expected ||
+                concatenated_documents(job_dir) != reference.documents)
+                fail("job output differs from tokenize_corpus (num_threads " +
+                     std::to_string(run.num_threads) + ", batch_bytes " +
+                     std::to_string(run.batch_bytes) + ")");
+
+            check_rerun(bpe, inputs, job_dir, options, expected);
+            remove_job(job_dir);
+        }
+        std::remove((root + "/reference.bin").c_str());
+        std::remove((root + "/reference.idx").c_str());
+    }
+
+    // A job directory belongs to one model
+    {
+        const std::string job_dir = root + "/job";
+        CorpusOptions options;
+        options.range_bytes = 4096;
+        run_corpus_job(bpe, inputs, job_dir, options);
+        BPE other = make_bpe(rng, 150);
+        try
+        {
+            run_corpus_job(other, inputs, job_dir, options);
+            fail("a job directory accepted a different model");
+        }
+        catch (const std::runtime_error &)
+        {
+        }
+        remove_job(job_dir);
+    }
+
+    for (const std::string &input : inputs)
+        std::remove(input.c_str());
+    ::rmdir(dir);
+
+    if (failures)
+    {
+        std::fprintf(stderr, "corpus_job: %d failures\n", failures);
+        return 1;
+    }
+    std::printf("corpus_job: OK\n");
+    return 0;
+}
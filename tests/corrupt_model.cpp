@@ -0,0 +1,122 @@
+// Checks that load_compiled rejects a compiled model with any single byte
+// flipped, instead of handing out tables that crash encode or decode, and
+// that attach still maps the sealed memfd from share().
+
+#include "bpe.hpp"
+#include "train.hpp"
+
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <unistd.h>
+#include <variant>
+
+namespace
+{
+
+const std::vector<std::string> kAlphabet = {
+    "a", "b", "c", "d", "e", "\xC3\xA9", "\xE8\xAA\x9E", "\xE2\x96\x81"};
+
+const std::string kText = "abc dé 語 ab cde a";
+
+std::string read_file(const std::string &path)
+{
+    std::ifstream file(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+void write_file(const std::string &path, const std::string &bytes)
+{
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file.write(bytes.data(), (std::streamsize)bytes.size());
+}
+
+// Flips one bit in every 7th byte of the compiled model in turn.
+int check_flips(BPE &bpe, const std::string &path)
+{
+    bpe.compile(path);
+    const std::string good = read_file(path);
+    auto expected = std::get<std::vector<int>>(bpe.encode(kText));
+
+    int failures = 0;
+    for (size_t pos = 0; pos < good.size(); pos += 7)
+    {
+        std::string bad = good;
+        bad[pos] ^= (char)(1 << (pos % 8));
+        write_file(path, bad);
+        try
+        {
+            auto loaded = BPE::load_compiled(path);
+            // Not rejected: this is where a corrupt table would crash
+            loaded->decode(std::get<std::vector<int>>(loaded->encode(kText)));
+            if (failures++ < 5)
+                std::fprintf(stderr, "flip at byte %zu was not detected\n", pos);
+        }
+        catch (const std::runtime_error &)
+        {
+        }
+    }
+
+    write_file(path, good);
+    auto loaded = BPE::load_compiled(path);
+    if (std::get<std::vector<int>>(loaded->encode(kText)) != expected)
+    {
+        std::fprintf(stderr, "intact model encodes differently\n");
+        failures++;
+    }
+    return failures;
+}
+
+int check_attach(BPE &bpe)
+{
+    const int fd = bpe.share();
+    auto attached = BPE::attach(fd);
+    ::close(fd);
+    if (attached->encode(kText) != bpe.encode(kText))
+    {
+        std::fprintf(stderr, "attached model encodes differently\n");
+        return 1;
+    }
+    return 0;
+}
+
+} // namespace
+
+int main()
+{
+    std::mt19937 rng(99);
+    std::vector<std::vector<std::string>> words;
+    for (int i = 0; i < 2000; i++)
+        words.push_back(random_symbols(rng, kAlphabet, kAlphabet.size() - 1, 6, {kAlphabet.back()}));
+    Model m = train(kAlphabet, words, 150);
+    const std::vector<std::string> added_vocab = {"ab", "\xC3\xA9\xE8\xAA\x9E"};
+    for (const auto &word : added_vocab)
+        m.vocab.emplace(word, (int)m.vocab.size());
+
+    char path[] = "/tmp/corrupt_model_XXXXXX";
+    const int fd = mkstemp(path);
+    if (fd < 0)
+    {
+        std::perror("mkstemp");
+        return 1;
+    }
+    ::close(fd);
+
+    int failures = 0;
+    for (BPEEngine engine : {BPEEngine::PriorityQueue, BPEEngine::Backtracking})
+    {
+        BPE bpe(m.ranks, m.vocab, added_vocab, kAlphabet.back(), {{"d", "e"}}, {}, engine);
+        failures += check_flips(bpe, path);
+        failures += check_attach(bpe);
+    }
+    ::unlink(path);
+
+    if (failures)
+    {
+        std::fprintf(stderr, "corrupt_model: %d failures\n", failures);
+        return 1;
+    }
+    std::printf("corrupt_model: OK\n");
+    return 0;
+}
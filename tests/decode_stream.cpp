@@ -0,0 +1,140 @@
+// Checks DecodeStream's stop strings and stop IDs, fed one ID at a time, on a
+// hand-made vocab with byte-fallback pieces.
+
+#include "bpe.hpp"
+
+#include <cstdio>
+
+namespace
+{
+
+enum : int
+{
+    kSpaceA, // " a"
+    kE2,
+    k82,
+    kAC,
+    k0A,
+    kB,
+    kC,
+    kD,
+    kEos,
+    kS,
+    kTO,
+    kP,
+};
+
+BPE make_bpe()
+{
+    std::map<std::string, int> vocab = {
+        {"\xE2\x96\x81" "a", kSpaceA}, {"<0xE2>", kE2}, {"<0x82>", k82},
+        {"<0xAC>", kAC}, {"<0x0A>", k0A}, {"b", kB}, {"c", kC}, {"d", kD},
+        {"</s>", kEos}, {"S", kS}, {"TO", kTO}, {"P", kP}};
+    return BPE({}, vocab);
+}
+
+struct Result
+{
+    std::string text;
+    bool stopped;
+    size_t stop_position;
+    int stop_string;
+    int stop_id;
+};
+
+// Feeds `ids` one at a time, then reads the stop state before finish(),
+// which resets it.
+Result run(DecodeStream &stream, const std::vector<int> &ids)
+{
+    Result r;
+    for (int id : ids)
+        r.text += stream.step(id);
+    r.stopped = stream.stopped();
+    r.stop_position = stream.stop_position();
+    r.stop_string = stream.stop_string();
+    r.stop_id = stream.stop_id();
+    r.text += stream.finish();
+    return r;
+}
+
+int failures = 0;
+
+void expect(const char *name, const Result &r, const std::string &text,
+            bool stopped, size_t position, int stop_string, int stop_id)
+{
+    if (r.text != text || r.stopped != stopped || r.stop_position != position ||
+        r.stop_string != stop_string || r.stop_id != stop_id)
+    {
+        std::fprintf(stderr,
+                     "%s: got \"%s\" stopped=%d position=%zu string=%d id=%d\n",
+                     name, r.text.c_str(), (int)r.stopped, r.stop_position,
+                     r.stop_string, r.stop_id);
+        failures++;
+    }
+}
+
+} // namespace
+
+int main()
+{
+    BPE bpe = make_bpe();
+    const std::vector<int> euro = {kSpaceA, kE2, k82, kAC, k0A, kB};
+
+    {
+        // By default the pieces decode as text, like BPE::decode
+        DecodeStream stream(bpe);
+        expect("default", run(stream, euro), bpe.decode(euro), false, 0, -1, -1);
+    }
+    {
+        // "STOP" spread over three tokens is held back, never returned
+        DecodeStream stream(bpe, false, false, {"STOP"});
+        expect("split", run(stream, {kSpaceA, kS, kTO, kP, kB}), " a", true, 2, 0, -1);
+    }
+    {
+        // Spelled by byte pieces: "€" then "\n"
+        DecodeStream stream(bpe, false, true, {"\n", "\xE2\x82\xAC"});
+        expect("bytes", run(stream, euro), " a", true, 2, 1, -1);
+        DecodeStream newline(bpe, false, true, {"\n"});
+        expect("newline", run(newline, euro), " a\xE2\x82\xAC", true, 5, 0, -1);
+    }
+    {
+        // Both end at "c": the longer one wins
+        DecodeStream stream(bpe, false, false, {"bc", " abc"});
+        expect("longest", run(stream, {kSpaceA, kB, kC, kD}), "", true, 0, 1, -1);
+        // "bc" ends before " abcd" does, so it wins despite being shorter
+        DecodeStream earliest(bpe, false, false, {" abcd", "bc"});
+        expect("earliest", run(earliest, {kSpaceA, kB, kC, kD}), " a", true, 2, 1, -1);
+    }
+    {
+        // The stop ID flushes held-back bytes, even an unfinished UTF-8 char
+        DecodeStream stream(bpe, false, true, {"STOP"}, {kEos});
+        expect("stop id", run(stream, {kSpaceA, kS, kE2, kEos, kB}),
+               " aS\xE2", true, 4, -1, kEos);
+    }
+    {
+        // Nothing after the stop is returned, and finish() starts over
+        DecodeStream stream(bpe, false, false, {"b"});
+        std::string text = stream.step(std::vector<int>{kSpaceA, kB, kC});
+        text += stream.step(kC);
+        if (text != " a" || !stream.stopped() || stream.stop_position() != 2)
+        {
+            std::fprintf(stderr, "after stop: got \"%s\"\n", text.c_str());
+            failures++;
+        }
+        stream.finish();
+        if (stream.stopped() || stream.stop_position() != 0 || stream.stop_string() != -1)
+        {
+            std::fprintf(stderr, "finish: stop state was not reset\n");
+            failures++;
+        }
+        expect("restart", run(stream, {kC, kD}), "cd", false, 0, -1, -1);
+    }
+
+    if (failures)
+    {
+        std::fprintf(stderr, "decode_stream: %d failures\n", failures);
+        return 1;
+    }
+    std::printf("decode_stream: OK\n");
+    return 0;
+}
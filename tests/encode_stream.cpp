@@ -0,0 +1,125 @@
+// Checks that EncodeStream, fed random chunks, returns exactly the IDs of
+// one-shot BPE::encode: chunks split inside UTF-8 chars, invalid UTF-8,
+// added-vocab words across word boundaries, and a token_replace_map with a
+// multi-char key (which makes the stream hold everything until finish()).
+
+#include "bpe.hpp"
+#include "train.hpp"
+
+#include <cstdio>
+#include <random>
+#include <variant>
+
+namespace
+{
+
+const std::vector<std::string> kAlphabet = {
+    "a", "b", "c", "d", "e", "\xC3\xA9", "\xE8\xAA\x9E", "\xE2\x96\x81"};
+
+// Besides the alphabet: spaces, stray continuation bytes, a truncated
+// 3-byte char and bytes that never occur in UTF-8.
+const std::vector<std::string> kExtras = {
+    " ", " ", " ", "  ", "\x80", "\xE8\xAA", "\xFF", "\xC3"};
+
+std::string random_text(std::mt19937 &rng)
+{
+    std::string text;
+    size_t pieces = rng() % 60;
+    for (size_t i = 0; i < pieces; i++)
+    {
+        if (rng() % 4 == 0)
+            text += kExtras[rng() % kExtras.size()];
+        else
+            text += kAlphabet[rng() % (kAlphabet.size() - 1)];
+    }
+    return text;
+}
+
+// Feeds `text` in chunks of 1..max_chunk bytes, cut anywhere.
+std::vector<int> encode_in_chunks(EncodeStream &stream, const std::string &text,
+                                  std::mt19937 &rng, size_t max_chunk, size_t &early)
+{
+    std::vector<int> ids;
+    for (size_t pos = 0; pos < text.size();)
+    {
+        size_t len = 1 + rng() % max_chunk;
+        auto step = stream.step(text.substr(pos, len));
+        early += step.size();
+        ids.insert(ids.end(), step.begin(), step.end());
+        pos += len;
+    }
+    auto rest = stream.finish();
+    ids.insert(ids.end(), rest.begin(), rest.end());
+    return ids;
+}
+
+int compare(const char *name, BPE &bpe, bool incremental, std::mt19937 &rng, int samples)
+{
+    EncodeStream stream(bpe);
+    int failures = 0;
+    size_t early = 0;
+    for (int i = 0; i < samples; i++)
+    {
+        std::string text = random_text(rng);
+        auto expected = std::get<std::vector<int>>(bpe.encode(text));
+        auto actual = encode_in_chunks(stream, text, rng, 1 + rng() % 12, early);
+        if (expected != actual)
+        {
+            if (failures++ < 5)
+                std::fprintf(stderr, "%s: mismatch on \"%s\"\n", name, text.c_str());
+        }
+    }
+    // Either words were emitted before finish(), or the stream must hold all
+    if ((early > 0) != incremental)
+    {
+        std::fprintf(stderr, "%s: %zu IDs returned before finish()\n", name, early);
+        failures++;
+    }
+    return failures;
+}
+
+} // namespace
+
+int main()
+{
+    std::mt19937 rng(2468);
+    std::vector<std::vector<std::string>> words;
+    for (int i = 0; i < 2000; i++)
+        words.push_back(random_symbols(rng, kAlphabet, kAlphabet.size() - 1, 6, {kAlphabet.back()}));
+    Model m = train(kAlphabet, words, 200);
+
+    // Added words that span "▁", i.e. a word boundary
+    const std::vector<std::string> added_vocab = {
+        "ab", "e\xE2\x96\x81" "a", "\xE2\x96\x81\xE2\x96\x81" "c", "d\xE2\x96\x81\xE8\xAA\x9E" "b"};
+    Model with_added = m;
+    for (const auto &word : added_vocab)
+        with_added.vocab.emplace(word, (int)with_added.vocab.size());
+
+    const std::string space = kAlphabet.back();
+    int failures = 0;
+    {
+        BPE bpe(m.ranks, m.vocab, {}, space);
+        failures += compare("plain", bpe, true, rng, 3000);
+    }
+    for (BPEEngine engine : {BPEEngine::PriorityQueue, BPEEngine::Backtracking})
+    {
+        BPE bpe(with_added.ranks, with_added.vocab, added_vocab, space, {}, {}, engine);
+        failures += compare("added vocab", bpe, true, rng, 3000);
+    }
+    {
+        BPE bpe(with_added.ranks, with_added.vocab, added_vocab, space, {{"d", "\xC3\xA9"}});
+        failures += compare("single-char replace", bpe, true, rng, 3000);
+    }
+    {
+        BPE bpe(with_added.ranks, with_added.vocab, added_vocab, space, {{"ab", "\xE8\xAA\x9E"}});
+        failures += compare("multi-char replace", bpe, false, rng, 3000);
+    }
+
+    if (failures)
+    {
+        std::fprintf(stderr, "encode_stream: %d failures\n", failures);
+        return 1;
+    }
+    std::printf("encode_stream: OK\n");
+    return 0;
+}
@@ -0,0 +1,95 @@
+// Checks that BPEEngine::Backtracking returns the same IDs as
+// BPEEngine::PriorityQueue, with and without added vocab, on a small model
+// trained here over a mixed ASCII / multi-byte alphabet.
+
+#include "bpe.hpp"
+#include "train.hpp"
+
+#include <cstdio>
+#include <random>
+#include <variant>
+
+namespace
+{
+
+const std::vector<std::string> kAlphabet = {
+    "a", "b", "c", "d", "e", "\xC3\xA9", "\xE8\xAA\x9E", "\xE2\x96\x81"};
+
+std::vector<std::string> random_word(std::mt19937 &rng, size_t max_len)
+{
+    return random_symbols(rng, kAlphabet, kAlphabet.size() - 1, max_len, {kAlphabet.back()});
+}
+
+Model train(std::mt19937 &rng, int num_merges)
+{
+    std::vector<std::vector<std::string>> words;
+    for (int i = 0; i < 2000; i++)
+        words.push_back(random_word(rng, 6));
+    return ::train(kAlphabet, words, num_merges);
+}
+
+std::string random_text(std::mt19937 &rng,
+                        const std::vector<std::string> &added_vocab)
+{
+    std::string text;
+    size_t words = 1 + rng() % 6;
+    for (size_t i = 0; i < words; i++)
+    {
+        if (i)
+            text += ' ';
+        size_t len = 1 + rng() % 8;
+        for (size_t j = 0; j < len; j++)
+        {
+            if (!added_vocab.empty() && rng() % 4 == 0)
+                text += added_vocab[rng() % added_vocab.size()];
+            else
+                text += kAlphabet[rng() % (kAlphabet.size() - 1)];
+        }
+    }
+    return text;
+}
+
+int compare(const Model &model, const std::vector<std::string> &added_vocab,
+            std::mt19937 &rng, int samples)
+{
+    Model m = model;
+    for (const auto &word : added_vocab)
+        m.vocab.emplace(word, (int)m.vocab.size());
+
+    BPE queue(m.ranks, m.vocab, added_vocab, "\xE2\x96\x81", {}, {},
+              BPEEngine::PriorityQueue);
+    BPE backtracking(m.ranks, m.vocab, added_vocab, "\xE2\x96\x81", {}, {},
+                     BPEEngine::Backtracking);
+
+    int failures = 0;
+    for (int i = 0; i < samples; i++)
+    {
+        std::string text = random_text(rng, added_vocab);
+        auto expected = std::get<std::vector<int>>(queue.encode(text));
+        auto actual = std::get<std::vector<int>>(backtracking.encode(text));
+        if (expected != actual)
+        {
+            if (failures++ < 5)
+                std::fprintf(stderr, "mismatch on \"%s\"\n", text.c_str());
+        }
+    }
+    return failures;
+}
+
+} // namespace
+
+int main()
+{
+    std::mt19937 rng(1234);
+    Model model = train(rng, 200);
+
+    int failures = compare(model, {}, rng, 5000);
+    failures += compare(model, {"ab", "cde", "\xC3\xA9\xE8\xAA\x9E", "b\xC3\xA9"}, rng, 5000);
+    if (failures)
+    {
+        std::fprintf(stderr, "engine_equivalence: %d mismatches\n", failures);
+        return 1;
+    }
+    std::printf("engine_equivalence: OK\n");
+    return 0;
+}
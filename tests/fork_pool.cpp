@@ -0,0 +1,59 @@
+// Checks that the shared ThreadPool keeps working in a child forked after
+// the parent has started its workers (the child must not wait for threads
+// that only exist in the parent).
+
+#include "bpe.hpp"
+
+#include <atomic>
+#include <cstdio>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace
+{
+
+bool sum_in_parallel()
+{
+    std::atomic<size_t> sum{0};
+    ThreadPool::instance().parallel_for(1000, 4, [&sum](size_t i) { sum += i; });
+    return sum == 1000 * 999 / 2;
+}
+
+} // namespace
+
+int main()
+{
+    if (!sum_in_parallel() || ThreadPool::instance().size() == 0)
+    {
+        std::fprintf(stderr, "fork_pool: parent pool did not run\n");
+        return 1;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        std::perror("fork");
+        return 1;
+    }
+    if (pid == 0)
+    {
+        alarm(30); // a hang in the child is the failure being tested
+        bool ok = ThreadPool::instance().size() == 0 && sum_in_parallel() &&
+                  sum_in_parallel();
+        _exit(ok ? 0 : 1);
+    }
+
+    int status = 0;
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        std::fprintf(stderr, "fork_pool: child failed (status %d)\n", status);
+        return 1;
+    }
+    if (!sum_in_parallel())
+    {
+        std::fprintf(stderr, "fork_pool: parent pool broken after fork\n");
+        return 1;
+    }
+    std::printf("fork_pool: OK\n");
+    return 0;
+}
@@ -0,0 +1,159 @@
+// Checks the stream-vbyte round trip (group tails, every value width, the
+// errors it must raise) and that IndexedDatasetReader returns what
+// IndexedDatasetWriter stored, for every TokenDType.
+
+#include "corpus.hpp"
+
+#include <cstdio>
+#include <random>
+#include <stdexcept>
+#include <unistd.h>
+
+namespace
+{
+
+int failures = 0;
+
+void fail(const char *what, size_t n)
+{
+    if (failures++ < 10)
+        std::fprintf(stderr, "%s (n = %zu)\n", what, n);
+}
+
+// Random IDs of 1, 2, 3 and 4 bytes, or below 2^16 with `narrow`.
+std::vector<int> random_ids(std::mt19937 &rng, size_t count, bool narrow)
+{
+    static const uint32_t limits[] = {1u << 8, 1u << 16, 1u << 24, 1u << 31};
+    std::vector<int> ids(count);
+    for (size_t i = 0; i < count; i++)
+        ids[i] = (int)(rng() % limits[narrow ? rng() % 2 : rng() % 4]);
+    return ids;
+}
+
+std::vector<uint8_t> pack(const std::vector<int> &ids)
+{
+    std::vector<uint8_t> packed(stream_vbyte_max_size(ids.size()));
+    packed.resize(stream_vbyte_encode(ids.data(), ids.size(), packed.data()));
+    return packed;
+}
+
+template <typename T>
+bool throws(const std::vector<uint8_t> &packed, size_t size, size_t count)
+{
+    std::vector<T> out(count);
+    try
+    {
+        stream_vbyte_decode(packed.data(), size, count, out.data());
+    }
+    catch (const std::runtime_error &)
+    {
+        return true;
+    }
+    return false;
+}
+
+void check_stream_vbyte(std::mt19937 &rng)
+{
+    for (size_t n : {0, 1, 3, 4, 5, 8, 1000, 4099})
+    {
+        std::vector<int> ids = random_ids(rng, n, false);
+        std::vector<uint8_t> packed = pack(ids);
+        std::vector<uint32_t> out(n);
+        stream_vbyte_decode(packed.data(), packed.size(), n, out.data());
+        if (std::vector<int>(out.begin(), out.end()) != ids)
+            fail("uint32 round trip", n);
+
+        std::vector<int> narrow = random_ids(rng, n, true);
+        std::vector<uint8_t> narrow_packed = pack(narrow);
+        std::vector<uint16_t> narrow_out(n);
+        stream_vbyte_decode(narrow_packed.data(), narrow_packed.size(), n, narrow_out.data());
+        if (std::vector<int>(narrow_out.begin(), narrow_out.end()) != narrow)
+            fail("uint16 round trip", n);
+
+        if (n == 0)
+            continue;
+        if (!throws<uint32_t>(packed, packed.size() - 1, n))
+            fail("truncated input was accepted", n);
+        if (!throws<uint32_t>(packed, packed.size(), n + 1))
+            fail("too few IDs were accepted", n);
+        if (!throws<uint32_t>(packed, packed.size(), n - 1))
+            fail("trailing bytes were accepted", n);
+    }
+
+    // Largest ID that fits, then the smallest that does not
+    std::vector<uint8_t> packed = pack({1, 65535, 2});
+    if (throws<uint16_t>(packed, packed.size(), 3))
+        fail("65535 does not fit uint16", 3);
+    packed = pack({1, 65536, 2});
+    if (!throws<uint16_t>(packed, packed.size(), 3))
+        fail("65536 fits uint16", 3);
+}
+
+void check_dataset(const std::string &prefix, TokenDType dtype, std::mt19937 &rng)
+{
+    const bool narrow = dtype == TokenDType::UInt16;
+    std::vector<std::vector<int>> docs;
+    for (size_t n : {5, 0, 1, 4, 1000, 3, 70})
+        docs.push_back(random_ids(rng, n, narrow));
+
+    IndexedDatasetWriter writer(prefix, dtype);
+    for (const auto &doc : docs)
+        writer.add_document(doc.data(), doc.size());
+    writer.finish();
+
+    IndexedDatasetReader reader(prefix);
+    if (reader.dtype() != dtype || reader.documents() != docs.size())
+    {
+        fail("dataset header", docs.size());
+        return;
+    }
+    for (size_t d = 0; d < docs.size(); d++)
+    {
+        if (reader.length(d) != docs[d].size())
+        {
+            fail("document length", d);
+            continue;
+        }
+        std::vector<uint32_t> ids(docs[d].size());
+        reader.read(d, ids.data());
+        if (std::vector<int>(ids.begin(), ids.end()) != docs[d])
+            fail("document IDs", d);
+        if (narrow)
+        {
+            std::vector<uint16_t> narrow_ids(docs[d].size());
+            reader.read(d, narrow_ids.data());
+            if (std::vector<int>(narrow_ids.begin(), narrow_ids.end()) != docs[d])
+                fail("document uint16 IDs", d);
+        }
+    }
+    std::remove((prefix + ".bin").c_str());
+    std::remove((prefix + ".idx").c_str());
+}
+
+} // namespace
+
+int main()
+{
+    std::mt19937 rng(7);
+    check_stream_vbyte(rng);
+
+    char dir[] = "/tmp/token_storage_XXXXXX";
+    if (!mkdtemp(dir))
+    {
+        std::perror("mkdtemp");
+        return 1;
+    }
+    const std::string prefix = std::string(dir) + "/data";
+    check_dataset(prefix, TokenDType::UInt16, rng);
+    check_dataset(prefix, TokenDType::UInt32, rng);
+    check_dataset(prefix, TokenDType::StreamVByte, rng);
+    ::rmdir(dir);
+
+    if (failures)
+    {
+        std::fprintf(stderr, "token_storage: %d failures\n", failures);
+        return 1;
+    }
+    std::printf("token_storage: OK\n");
+    return 0;
+}
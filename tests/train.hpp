@@ -0,0 +1,76 @@
+// Tiny BPE trainer shared by the tests, so they need no model files.
+
+#ifndef TESTS_TRAIN_HPP
+#define TESTS_TRAIN_HPP
+
+#include <map>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+struct Model
+{
+    std::map<std::pair<std::string, std::string>, int> ranks;
+    std::map<std::string, int> vocab;
+};
+
+// A word of 1..max_len symbols from alphabet[0, count), after `prefix`.
+inline std::vector<std::string> random_symbols(std::mt19937 &rng,
+                                               const std::vector<std::string> &alphabet,
+                                               size_t count, size_t max_len,
+                                               std::vector<std::string> prefix = {})
+{
+    size_t len = 1 + rng() % max_len;
+    for (size_t i = 0; i < len; i++)
+        prefix.push_back(alphabet[rng() % count]);
+    return prefix;
+}
+
+// Plain BPE training: repeatedly merges the most frequent adjacent pair of
+// `words`, each a sequence of alphabet symbols.
+inline Model train(const std::vector<std::string> &alphabet,
+                   std::vector<std::vector<std::string>> words, int num_merges)
+{
+    Model model;
+    for (const auto &ch : alphabet)
+        model.vocab.emplace(ch, (int)model.vocab.size());
+
+    auto apply = [&words](const std::pair<std::string, std::string> &pair,
+                          const std::string &merged)
+    {
+        for (auto &w : words)
+            for (size_t i = 0; i + 1 < w.size(); i++)
+                if (w[i] == pair.first && w[i + 1] == pair.second)
+                {
+                    w[i] = merged;
+                    w.erase(w.begin() + i + 1);
+                }
+    };
+
+    for (int m = 0; m < num_merges; m++)
+    {
+        std::map<std::pair<std::string, std::string>, int> counts;
+        for (const auto &w : words)
+            for (size_t i = 0; i + 1 < w.size(); i++)
+                counts[{w[i], w[i + 1]}]++;
+        if (counts.empty())
+            break;
+        auto best = counts.begin();
+        for (auto it = counts.begin(); it != counts.end(); ++it)
+            if (it->second > best->second)
+                best = it;
+        auto pair = best->first;
+        std::string merged = pair.first + pair.second;
+        if (!model.vocab.count(merged))
+        {
+            model.ranks.emplace(pair, m);
+            model.vocab.emplace(merged, (int)model.vocab.size());
+        }
+        // Otherwise it is already reachable through another split
+        apply(pair, merged);
+    }
+    return model;
+}
+
+#endif // TESTS_TRAIN_HPP
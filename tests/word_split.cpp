@@ -0,0 +1,113 @@
+// Checks that WordSplit::Auto returns the same IDs as WordSplit::Never, both
+// on a Llama-style model, where Auto splits at "▁", and on a model with
+// merges across "▁", where Auto must encode the text whole.
+
+#include "bpe.hpp"
+#include "train.hpp"
+
+#include <cstdio>
+#include <random>
+#include <variant>
+
+namespace
+{
+
+const std::vector<std::string> kAlphabet = {
+    "a", "b", "c", "d", "e", "\xC3\xA9", "\xE8\xAA\x9E", "\xE2\x96\x81"};
+
+const std::string kSpace = kAlphabet.back();
+
+std::vector<std::string> random_word(std::mt19937 &rng)
+{
+    return random_symbols(rng, kAlphabet, kAlphabet.size() - 1, 6, {kSpace});
+}
+
+// Every word trained on its own, so "▁" only ever starts a piece.
+Model train_llama(std::mt19937 &rng)
+{
+    std::vector<std::vector<std::string>> words;
+    for (int i = 0; i < 2000; i++)
+        words.push_back(random_word(rng));
+    return train(kAlphabet, words, 200);
+}
+
+// Whole sentences trained at once, which yields merges such as (x, "▁").
+Model train_sentences(std::mt19937 &rng)
+{
+    std::vector<std::vector<std::string>> sentences;
+    for (int i = 0; i < 400; i++)
+    {
+        std::vector<std::string> sentence;
+        size_t words = 1 + rng() % 6;
+        for (size_t w = 0; w < words; w++)
+        {
+            auto word = random_word(rng);
+            sentence.insert(sentence.end(), word.begin(), word.end());
+        }
+        sentences.push_back(sentence);
+    }
+    return train(kAlphabet, sentences, 200);
+}
+
+std::string random_text(std::mt19937 &rng)
+{
+    std::string text;
+    size_t words = 1 + rng() % 8;
+    for (size_t i = 0; i < words; i++)
+    {
+        if (i || rng() % 4 == 0)
+            text += rng() % 5 ? " " : "  ";
+        size_t len = 1 + rng() % 8;
+        for (size_t j = 0; j < len; j++)
+            text += kAlphabet[rng() % (kAlphabet.size() - 1)];
+    }
+    return text;
+}
+
+int compare(const char *name, const Model &m, bool expect_split,
+            std::mt19937 &rng, int samples)
+{
+    BPE never(m.ranks, m.vocab, {}, kSpace, {}, {}, BPEEngine::PriorityQueue,
+              0, CachePolicy::LRU, WordSplit::Never);
+    // The word cache is only used when the text is split into words
+    BPE autos(m.ranks, m.vocab, {}, kSpace, {}, {}, BPEEngine::PriorityQueue,
+              1 << 16, CachePolicy::LRU, WordSplit::Auto);
+
+    int failures = 0;
+    for (int i = 0; i < samples; i++)
+    {
+        std::string text = random_text(rng);
+        auto expected = std::get<std::vector<int>>(never.encode(text));
+        auto actual = std::get<std::vector<int>>(autos.encode(text));
+        if (expected != actual)
+        {
+            if (failures++ < 5)
+                std::fprintf(stderr, "%s: mismatch on \"%s\"\n", name, text.c_str());
+        }
+    }
+
+    bool split = autos.word_cache().size() > 0;
+    if (split != expect_split)
+    {
+        std::fprintf(stderr, "%s: Auto %s the text into words\n", name,
+                     split ? "split" : "did not split");
+        failures++;
+    }
+    return failures;
+}
+
+} // namespace
+
+int main()
+{
+    std::mt19937 rng(4321);
+    int failures = compare("llama", train_llama(rng), true, rng, 5000);
+    failures += compare("sentences", train_sentences(rng), false, rng, 5000);
+    if (failures)
+    {
+        std::fprintf(stderr, "word_split: %d failures\n", failures);
+        return 1;
+    }
+    std::printf("word_split: OK\n");
+    return 0;
+}
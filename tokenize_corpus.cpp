@@ -0,0 +1,260 @@
+// Command-line corpus tokenizer: text or JSONL in, Megatron-LM indexed
+// datasets (.bin + .idx) out. Build with `make tokenize_corpus`.
+
+#include "bpe.hpp"
+#include "corpus.hpp"
+#include "json.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using json = nlohmann::json;
+
+static const char *kUsage =
+    "usage: tokenize_corpus (--model DIR | --compiled FILE) (--output PREFIX | --job DIR) [options] INPUT...\n"
+    "\n"
+    "model:\n"
+    "  --model DIR               tokenizer.json, tokenizer_config.json, added_vocab.txt/.json\n"
+    "  --compiled FILE           model written by BPE.compile (options below are ignored)\n"
+    "  --special-character STR   word boundary marker (default \xE2\x96\x81)\n"
+    "  --replace-map FILE        token_replace_map as a JSON object\n"
+    "  --engine NAME             priority-queue (default) or backtracking\n"
+    "  --cache-capacity N        word cache entries (default 0, off)\n"
+    "\n"
+    "input:\n"
+    "  --format NAME             jsonl (default) or text, one document per line\n"
+    "  --json-key KEY            JSONL field holding the document (default text); repeat\n"
+    "                            to join several fields, in order\n"
+    "  --json-separator STR      put between joined fields (default newline)\n"
+    "\n"
+    "output:\n"
+    "  --output PREFIX           writes PREFIX.bin and PREFIX.idx\n"
+    "  --dtype NAME              uint32 (default), uint16, or stream-vbyte (packed, not\n"
+    "                            readable by Megatron; see IndexedDatasetReader)\n"
+    "  --append-eod ID           token ID appended to every document\n"
+    "  --shard-size BYTES        new PREFIX_NNNNN shard past this .bin size (K/M/G suffix)\n"
+    "\n"
+    "resumable job:\n"
+    "  --job DIR                 writes DIR/shard_NNNNN.bin/.idx and DIR/manifest.json; rerun\n"
+    "                            (or run several at once) to finish the shards not done yet\n"
+    "  --input-shard-size BYTES  input bytes per job shard (default 256M)\n"
+    "\n"
+    "  --threads N               encoder threads (default 0, all cores)\n"
+    "  --batch-size BYTES        input read and encoded per batch (default 16M)\n";
+
+// Parses a byte count such as 4096, 512K, 64M or 2G.
+static uint64_t parse_size(const std::string &text)
+{
+    size_t used = 0;
+    const unsigned long long value = std::stoull(text, &used);
+    uint64_t unit = 1;
+    const std::string suffix = text.substr(used);
+    if (suffix == "K" || suffix == "k")
+    {
+        unit = uint64_t(1) << 10;
+    }
+    else if (suffix == "M" || suffix == "m")
+    {
+        unit = uint64_t(1) << 20;
+    }
+    else if (suffix == "G" || suffix == "g")
+    {
+        unit = uint64_t(1) << 30;
+    }
+    else if (!suffix.empty())
+    {
+        throw std::invalid_argument("Invalid size: " + text);
+    }
+    return value * unit;
+}
+
+static std::map<std::string, std::string> read_replace_map(const std::string &path)
+{
+    std::ifstream file(path);
+    if (!file)
+    {
+        throw std::runtime_error("Cannot open " + path);
+    }
+    return json::parse(file).get<std::map<std::string, std::string>>();
+}
+
+int main(int argc, char **argv)
+{
+    std::string model_dir;
+    std::string compiled;
+    std::string output;
+    std::string job_dir;
+    std::string special_character = "\xE2\x96\x81";
+    std::map<std::string, std::string> token_replace_map;
+    BPEEngine engine = BPEEngine::PriorityQueue;
+    size_t cache_capacity = 0;
+    CorpusOptions options;
+    std::vector<std::string> inputs;
+    std::vector<std::string> json_keys;
+
+    try
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            const std::string arg = argv[i];
+            if (arg == "-h" || arg == "--help")
+            {
+                std::cout << kUsage;
+                return 0;
+            }
+            if (arg.rfind("--", 0) != 0)
+            {
+                inputs.push_back(arg);
+                continue;
+            }
+            if (i + 1 >= argc)
+            {
+                throw std::invalid_argument("Missing value for " + arg);
+            }
+            const std::string value = argv[++i];
+            if (arg == "--model")
+            {
+                model_dir = value;
+            }
+            else if (arg == "--compiled")
+            {
+                compiled = value;
+            }
+            else if (arg == "--output")
+            {
+                output = value;
+            }
+            else if (arg == "--job")
+            {
+                job_dir = value;
+            }
+            else if (arg == "--input-shard-size")
+            {
+                options.range_bytes = parse_size(value);
+            }
+            else if (arg == "--special-character")
+            {
+                special_character = value;
+            }
+            else if (arg == "--replace-map")
+            {
+                token_replace_map = read_replace_map(value);
+            }
+            else if (arg == "--engine")
+            {
+                if (value != "priority-queue" && value != "backtracking")
+                {
+                    throw std::invalid_argument("Unknown engine: " + value);
+                }
+                engine = (value == "backtracking") ? BPEEngine::Backtracking : BPEEngine::PriorityQueue;
+            }
+            else if (arg == "--cache-capacity")
+            {
+                cache_capacity = std::stoul(value);
+            }
+            else if (arg == "--format")
+            {
+                if (value != "jsonl" && value != "text")
+                {
+                    throw std::invalid_argument("Unknown format: " + value);
+                }
+                options.format = (value == "text") ? CorpusFormat::Text : CorpusFormat::JSONL;
+            }
+            else if (arg == "--json-key")
+            {
+                json_keys.push_back(value);
+            }
+            else if (arg == "--json-separator")
+            {
+                options.json_separator = value;
+            }
+            else if (arg == "--dtype")
+            {
+                if (value != "uint16" && value != "uint32" && value != "stream-vbyte")
+                {
+                    throw std::invalid_argument("Unknown dtype: " + value);
+                }
+                options.dtype = (value == "uint16")   ? TokenDType::UInt16
+                                : (value == "uint32") ? TokenDType::UInt32
+                                                      : TokenDType::StreamVByte;
+            }
+            else if (arg == "--append-eod")
+            {
+                options.append_eod = std::stoi(value);
+            }
+            else if (arg == "--shard-size")
+            {
+                options.shard_bytes = parse_size(value);
+            }
+            else if (arg == "--threads")
+            {
+                options.num_threads = std::stoul(value);
+            }
+            else if (arg == "--batch-size")
+            {
+                options.batch_bytes = parse_size(value);
+            }
+            else
+            {
+                throw std::invalid_argument("Unknown option: " + arg);
+            }
+        }
+        if (!json_keys.empty())
+        {
+            options.json_keys = json_keys;
+        }
+        if (model_dir.empty() == compiled.empty() || output.empty() == job_dir.empty() || inputs.empty())
+        {
+            std::cerr << kUsage;
+            return 2;
+        }
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "tokenize_corpus: " << e.what() << "\n\n" << kUsage;
+        return 2;
+    }
+
+    try
+    {
+        const auto start = std::chrono::steady_clock::now();
+        std::unique_ptr<BPE> bpe = compiled.empty()
+            ? BPE::from_pretrained(model_dir, {}, special_character, token_replace_map, engine, cache_capacity)
+            : BPE::load_compiled(compiled, cache_capacity);
+
+        const CorpusStats stats = job_dir.empty() ? tokenize_corpus(*bpe, inputs, output, options)
+                                                  : run_corpus_job(*bpe, inputs, job_dir, options);
+
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (job_dir.empty())
+        {
+            for (const std::string &shard : stats.shards)
+            {
+                std::cerr << "wrote " << shard << ".bin/.idx\n";
+            }
+        }
+        else
+        {
+            std::cerr << "finished " << stats.shards.size() << " shards of " << job_dir << ", "
+                      << stats.pending_shards << " not done yet\n";
+        }
+        const double mib = stats.input_bytes / double(1 << 20);
+        std::cerr << stats.documents << " documents (" << stats.skipped << " empty skipped), "
+                  << stats.tokens << " tokens from " << mib << " MiB in " << seconds << " s ("
+                  << mib / std::max(seconds, 1e-9) << " MiB/s)\n";
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "tokenize_corpus: " << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}